@@ -0,0 +1,605 @@
+// End-to-end benchmark for file_sync: generates synthetic source/destination
+// trees, runs the real binary against them and writes the results as JSON.
+//
+//   bench [--binary PATH] [--files N] [--dirs N] [--sizes small|mixed|large]
+//         [--change-ratio R] [--tmpfs-dir DIR] [--disk-dir DIR] [--output FILE]
+//         [-- file_sync options...]
+//
+// Every run starts from a freshly generated destination, once with an empty
+// destination ("initial") and once with one that only differs in
+// change-ratio of the files ("incremental"). Warm runs read every file
+// first; cold runs drop both trees from the page cache with
+// posix_fadvise, which tmpfs has no use for, so it only gets warm runs.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_PATH 1024
+#define MAX_EXTRA_ARGS 32
+#define WRITE_CHUNK_SIZE (1 << 16)
+#define STDERR_CAPACITY (1 << 16)
+#define SOURCE_MTIME_AGE 3600
+
+typedef enum {
+    false,
+    true
+} boolean;
+
+typedef enum {
+    SIZES_SMALL,
+    SIZES_MIXED,
+    SIZES_LARGE
+} SizeDistribution;
+
+typedef enum {
+    CACHE_WARM,
+    CACHE_COLD
+} CacheState;
+
+typedef enum {
+    SCENARIO_INITIAL,
+    SCENARIO_INCREMENTAL
+} Scenario;
+
+typedef struct {
+    const char* binary;
+    int filesCount;
+    int dirsCount;
+    SizeDistribution sizes;
+    double changeRatio;
+    const char* tmpfsDir;
+    const char* diskDir;
+    const char* output;
+    char* extraArgs[MAX_EXTRA_ARGS];
+    int extraArgsCount;
+} BenchOptions;
+
+// the generated tree; sizes are kept so every file can be regenerated byte for byte
+typedef struct {
+    char root[MAX_PATH];
+    char src[MAX_PATH];
+    char dest[MAX_PATH];
+    off_t* sizes;
+    long long totalBytes;
+    time_t srcMtime;
+} Tree;
+
+typedef struct {
+    double wallMs;
+    double userMs;
+    double systemMs;
+    unsigned long long readCalls;
+    unsigned long long writeCalls;
+    unsigned long long readBytes;
+    unsigned long long writeBytes;
+    unsigned long long syncReadBytes;       // file data file_sync read and wrote, from its final --stats line
+    unsigned long long syncWrittenBytes;
+    long majorFaults;
+    int exitStatus;
+    char stats[STDERR_CAPACITY];
+} RunResult;
+
+boolean parseOptions(int argc, char** argv, BenchOptions* options);
+void printUsage();
+void generateTree(const BenchOptions* options, const char* baseDir, Tree* tree);
+void prepareDest(const BenchOptions* options, const Tree* tree, Scenario scenario);
+void setCacheState(const BenchOptions* options, const Tree* tree, CacheState cache);
+void runFileSync(const BenchOptions* options, const Tree* tree, RunResult* result);
+void writeResult(FILE* out, const BenchOptions* options, const Tree* tree, const char* location, Scenario scenario, CacheState cache, const RunResult* result, boolean isFirst);
+void filePath(char* path, const char* root, int index, int dirsCount);
+void checkPathLength(int length);
+void writeFile(const char* path, int index, off_t size, int flippedByte, time_t mtime);
+void makeDirs(const char* root, int dirsCount);
+void removeTree(const char* path);
+int removeEntry(const char* path, const struct stat* entryStat, int flag, struct FTW* ftw);
+off_t pickSize(SizeDistribution sizes, uint64_t* state);
+uint64_t nextRandom(uint64_t* state);
+boolean isChanged(int index, double changeRatio);
+void readProcessIo(pid_t pid, RunResult* result);
+double elapsedMs(const struct timespec* start, const struct timespec* end);
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    const char* locations[2];
+    const char* labels[2] = { "tmpfs", "disk" };
+    FILE* out = stdout;
+    boolean isFirst = true;
+
+    if (!parseOptions(argc, argv, &options))
+    {
+        printUsage();
+        exit(EXIT_FAILURE);
+    }
+
+    locations[0] = options.tmpfsDir;
+    locations[1] = options.diskDir;
+
+    if (options.output != NULL && (out = fopen(options.output, "w")) == NULL)
+    {
+        perror("fopen failed");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(out, "{\n  \"files\": %d,\n  \"dirs\": %d,\n  \"sizes\": \"%s\",\n  \"change_ratio\": %.3f,\n  \"runs\": [\n",
+        options.filesCount, options.dirsCount,
+        options.sizes == SIZES_SMALL ? "small" : options.sizes == SIZES_MIXED ? "mixed" : "large",
+        options.changeRatio);
+
+    for (int l = 0; l < 2; l++)
+    {
+        Tree tree;
+
+        if (locations[l] == NULL) continue;
+
+        generateTree(&options, locations[l], &tree);
+
+        for (Scenario scenario = SCENARIO_INITIAL; scenario <= SCENARIO_INCREMENTAL; scenario++)
+        {
+            for (CacheState cache = CACHE_WARM; cache <= CACHE_COLD; cache++)
+            {
+                RunResult result;
+
+                // tmpfs pages are the files themselves, there is nothing to drop
+                if (cache == CACHE_COLD && l == 0) continue;
+
+                prepareDest(&options, &tree, scenario);
+                setCacheState(&options, &tree, cache);
+                runFileSync(&options, &tree, &result);
+
+                writeResult(out, &options, &tree, labels[l], scenario, cache, &result, isFirst);
+                isFirst = false;
+
+                fprintf(stderr, "%-6s %-12s %-5s %10.1f ms %10.0f files/s %8.1f MB/s\n", labels[l],
+                    scenario == SCENARIO_INITIAL ? "initial" : "incremental", cache == CACHE_WARM ? "warm" : "cold",
+                    result.wallMs, options.filesCount / (result.wallMs / 1000.0),
+                    result.syncWrittenBytes / (1024.0 * 1024.0) / (result.wallMs / 1000.0));
+            }
+        }
+
+        removeTree(tree.root);
+        free(tree.sizes);
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+
+    return 0;
+}
+
+boolean parseOptions(int argc, char** argv, BenchOptions* options)
+{
+    memset(options, 0, sizeof(BenchOptions));
+    options->binary = "./file_sync";
+    options->filesCount = 1000;
+    options->sizes = SIZES_MIXED;
+    options->changeRatio = 0.1;
+    options->tmpfsDir = "/dev/shm";
+    options->diskDir = "/var/tmp";
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "--") == 0)
+        {
+            for (i++; i < argc && options->extraArgsCount < MAX_EXTRA_ARGS; i++)
+                options->extraArgs[options->extraArgsCount++] = argv[i];
+            break;
+        }
+
+        if (value == NULL) return false;
+
+        if (strcmp(argv[i], "--binary") == 0) options->binary = value;
+        else if (strcmp(argv[i], "--files") == 0) options->filesCount = atoi(value);
+        else if (strcmp(argv[i], "--dirs") == 0) options->dirsCount = atoi(value);
+        else if (strcmp(argv[i], "--change-ratio") == 0) options->changeRatio = atof(value);
+        else if (strcmp(argv[i], "--tmpfs-dir") == 0) options->tmpfsDir = *value ? value : NULL;
+        else if (strcmp(argv[i], "--disk-dir") == 0) options->diskDir = *value ? value : NULL;
+        else if (strcmp(argv[i], "--output") == 0) options->output = value;
+        else if (strcmp(argv[i], "--sizes") == 0)
+        {
+            if (strcmp(value, "small") == 0) options->sizes = SIZES_SMALL;
+            else if (strcmp(value, "mixed") == 0) options->sizes = SIZES_MIXED;
+            else if (strcmp(value, "large") == 0) options->sizes = SIZES_LARGE;
+            else return false;
+        }
+        else return false;
+
+        i++;
+    }
+
+    return options->filesCount > 0 && options->dirsCount >= 0
+        && options->changeRatio >= 0 && options->changeRatio <= 1;
+}
+
+void printUsage()
+{
+    printf("Usage: bench [--binary PATH] [--files N] [--dirs N] [--sizes small|mixed|large]\n");
+    printf("             [--change-ratio R] [--tmpfs-dir DIR] [--disk-dir DIR] [--output FILE]\n");
+    printf("             [-- file_sync options...]\n");
+    printf("An empty --tmpfs-dir or --disk-dir skips that location.\n");
+}
+
+void generateTree(const BenchOptions* options, const char* baseDir, Tree* tree)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ (uint64_t)options->filesCount;
+    char path[MAX_PATH];
+
+    checkPathLength(snprintf(tree->root, MAX_PATH, "%s/file_sync_bench.%d", baseDir, (int)getpid()));
+    checkPathLength(snprintf(tree->src, MAX_PATH, "%s/src", tree->root));
+    checkPathLength(snprintf(tree->dest, MAX_PATH, "%s/dest", tree->root));
+
+    if (mkdir(tree->root, 0755) == -1 || mkdir(tree->src, 0755) == -1)
+    {
+        perror("mkdir failed");
+        exit(EXIT_FAILURE);
+    }
+    makeDirs(tree->src, options->dirsCount);
+
+    tree->sizes = (off_t*)malloc(options->filesCount * sizeof(off_t));
+    if (tree->sizes == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // the source is older than anything written later, so changed destination files lose on mtime
+    tree->srcMtime = time(NULL) - SOURCE_MTIME_AGE;
+    tree->totalBytes = 0;
+
+    for (int i = 0; i < options->filesCount; i++)
+    {
+        tree->sizes[i] = pickSize(options->sizes, &state);
+        tree->totalBytes += tree->sizes[i];
+
+        filePath(path, tree->src, i, options->dirsCount);
+        writeFile(path, i, tree->sizes[i], -1, tree->srcMtime);
+    }
+}
+
+/*
+ * Rebuilds the destination from scratch. For the incremental scenario it
+ * is a copy of the source, except that change-ratio of the files are
+ * either missing or have one byte flipped and an mtime older than the
+ * source, alternating.
+ */
+void prepareDest(const BenchOptions* options, const Tree* tree, Scenario scenario)
+{
+    char path[MAX_PATH];
+
+    removeTree(tree->dest);
+    if (mkdir(tree->dest, 0755) == -1)
+    {
+        perror("mkdir failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (scenario == SCENARIO_INITIAL) return;
+
+    makeDirs(tree->dest, options->dirsCount);
+
+    for (int i = 0; i < options->filesCount; i++)
+    {
+        boolean changed = isChanged(i, options->changeRatio);
+
+        if (changed && i % 2 == 1) continue;
+
+        filePath(path, tree->dest, i, options->dirsCount);
+        if (changed)
+            writeFile(path, i, tree->sizes[i], tree->sizes[i] / 2, tree->srcMtime - SOURCE_MTIME_AGE);
+        else
+            writeFile(path, i, tree->sizes[i], -1, tree->srcMtime);
+    }
+}
+
+void setCacheState(const BenchOptions* options, const Tree* tree, CacheState cache)
+{
+    const char* roots[2] = { tree->src, tree->dest };
+    char* buffer = (char*)malloc(WRITE_CHUNK_SIZE);
+    char path[MAX_PATH];
+
+    if (buffer == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int r = 0; r < 2; r++)
+    {
+        for (int i = 0; i < options->filesCount; i++)
+        {
+            int fd = -1;
+
+            filePath(path, roots[r], i, options->dirsCount);
+            if ((fd = open(path, O_RDONLY)) == -1) continue;
+
+            if (cache == CACHE_WARM)
+            {
+                while (read(fd, buffer, WRITE_CHUNK_SIZE) > 0);
+            }
+            else
+            {
+                // dirty pages cannot be dropped, they have to reach the disk first
+                fdatasync(fd);
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            }
+            close(fd);
+        }
+    }
+
+    free(buffer);
+}
+
+/*
+ * Runs file_sync with --stats and collects what the kernel knows about the
+ * child. /proc/<pid>/io is only readable while the child exists, so it is
+ * read after waitid(WNOWAIT) and before the zombie is reaped.
+ */
+void runFileSync(const BenchOptions* options, const Tree* tree, RunResult* result)
+{
+    char* args[MAX_EXTRA_ARGS + 6];
+    int argsCount = 0;
+    int errorPipe[2];
+    struct timespec start;
+    struct timespec end;
+    struct rusage usage;
+    siginfo_t info;
+    size_t stderrLength = 0;
+    char* stderrData = NULL;
+    char* statsLine = NULL;
+    char* bytesField = NULL;
+    ssize_t bytesRead = 0;
+    int status = 0;
+    pid_t pid = 0;
+
+    memset(result, 0, sizeof(RunResult));
+
+    args[argsCount++] = (char*)options->binary;
+    args[argsCount++] = "--stats";
+    for (int i = 0; i < options->extraArgsCount; i++) args[argsCount++] = options->extraArgs[i];
+    if (options->dirsCount > 0) args[argsCount++] = "--recursive";
+    args[argsCount++] = (char*)tree->src;
+    args[argsCount++] = (char*)tree->dest;
+    args[argsCount] = NULL;
+
+    stderrData = (char*)malloc(STDERR_CAPACITY);
+    if (stderrData == NULL || pipe(errorPipe) == -1)
+    {
+        perror("pipe failed");
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid = fork();
+    if (pid == -1)
+    {
+        perror("fork failed");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        int devNull = open("/dev/null", O_WRONLY);
+
+        dup2(devNull, STDOUT_FILENO);
+        dup2(errorPipe[1], STDERR_FILENO);
+        close(errorPipe[0]);
+        execv(options->binary, args);
+        perror("execv failed");
+        _exit(127);
+    }
+
+    close(errorPipe[1]);
+    while ((bytesRead = read(errorPipe[0], stderrData + stderrLength, STDERR_CAPACITY - 1 - stderrLength)) > 0)
+        stderrLength += bytesRead;
+    stderrData[stderrLength] = '\0';
+    close(errorPipe[0]);
+
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1)
+    {
+        perror("waitid failed");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    readProcessIo(pid, result);
+
+    if (wait4(pid, &status, 0, &usage) == -1)
+    {
+        perror("wait4 failed");
+        exit(EXIT_FAILURE);
+    }
+
+    result->wallMs = elapsedMs(&start, &end);
+    result->userMs = usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0;
+    result->systemMs = usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+    result->majorFaults = usage.ru_majflt;
+    result->exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+    // interim lines may come first, the final one is kept whole
+    statsLine = strstr(stderrData, "{\"final\":true");
+    if (statsLine != NULL)
+        snprintf(result->stats, sizeof(result->stats), "%.*s", (int)strcspn(statsLine, "\n"), statsLine);
+    bytesField = statsLine != NULL ? strstr(statsLine, "\"bytes\":{") : NULL;
+    if (bytesField != NULL)
+        sscanf(bytesField, "\"bytes\":{\"read\":%llu,\"written\":%llu", &result->syncReadBytes, &result->syncWrittenBytes);
+    else
+        snprintf(result->stats, sizeof(result->stats), "null");
+
+    if (result->exitStatus != 0)
+        fprintf(stderr, "file_sync exited with %d: %s\n", result->exitStatus, stderrData);
+
+    free(stderrData);
+}
+
+void writeResult(FILE* out, const BenchOptions* options, const Tree* tree, const char* location, Scenario scenario, CacheState cache, const RunResult* result, boolean isFirst)
+{
+    double seconds = result->wallMs / 1000.0;
+
+    fprintf(out, "%s    {\"location\": \"%s\", \"scenario\": \"%s\", \"cache\": \"%s\", \"exit_status\": %d,\n",
+        isFirst ? "" : ",\n", location, scenario == SCENARIO_INITIAL ? "initial" : "incremental",
+        cache == CACHE_WARM ? "warm" : "cold", result->exitStatus);
+    // rates of the data actually moved: an incremental run reads and writes far less than the whole tree
+    fprintf(out, "     \"wall_ms\": %.3f, \"user_ms\": %.3f, \"system_ms\": %.3f, \"files_per_s\": %.1f, \"mb_per_s\": %.2f, \"read_mb_per_s\": %.2f,\n",
+        result->wallMs, result->userMs, result->systemMs, options->filesCount / seconds,
+        result->syncWrittenBytes / (1024.0 * 1024.0) / seconds, result->syncReadBytes / (1024.0 * 1024.0) / seconds);
+    fprintf(out, "     \"read_syscalls\": %llu, \"write_syscalls\": %llu, \"read_bytes\": %llu, \"write_bytes\": %llu,\n",
+        result->readCalls, result->writeCalls, result->readBytes, result->writeBytes);
+    fprintf(out, "     \"major_faults\": %ld, \"total_bytes\": %lld,\n",
+        result->majorFaults, tree->totalBytes);
+    fprintf(out, "     \"stats\": %s}", result->stats);
+}
+
+void filePath(char* path, const char* root, int index, int dirsCount)
+{
+    int length = dirsCount > 0
+        ? snprintf(path, MAX_PATH, "%s/d%04d/f%07d.dat", root, index % dirsCount, index)
+        : snprintf(path, MAX_PATH, "%s/f%07d.dat", root, index);
+
+    checkPathLength(length);
+}
+
+void checkPathLength(int length)
+{
+    if (length >= MAX_PATH)
+    {
+        fprintf(stderr, "path too long\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// contents depend only on the file index, so source and destination copies match byte for byte
+void writeFile(const char* path, int index, off_t size, int flippedByte, time_t mtime)
+{
+    uint64_t state = 0xD1B54A32D192ED03ULL * (uint64_t)(index + 1);
+    uint64_t buffer[WRITE_CHUNK_SIZE / sizeof(uint64_t)];
+    struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+    off_t written = 0;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd == -1)
+    {
+        perror("open failed");
+        exit(EXIT_FAILURE);
+    }
+
+    while (written < size)
+    {
+        size_t chunk = size - written < WRITE_CHUNK_SIZE ? size - written : WRITE_CHUNK_SIZE;
+
+        for (size_t j = 0; j < sizeof(buffer) / sizeof(buffer[0]); j++) buffer[j] = nextRandom(&state);
+        if (flippedByte >= written && flippedByte < written + (off_t)chunk)
+            ((char*)buffer)[flippedByte - written] ^= 0xFF;
+
+        if (write(fd, buffer, chunk) != (ssize_t)chunk)
+        {
+            perror("write failed");
+            exit(EXIT_FAILURE);
+        }
+        written += chunk;
+    }
+
+    if (futimens(fd, times) == -1 || close(fd) == -1)
+    {
+        perror("close failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void makeDirs(const char* root, int dirsCount)
+{
+    char path[MAX_PATH];
+
+    for (int i = 0; i < dirsCount; i++)
+    {
+        checkPathLength(snprintf(path, MAX_PATH, "%s/d%04d", root, i));
+        if (mkdir(path, 0755) == -1)
+        {
+            perror("mkdir failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void removeTree(const char* path)
+{
+    if (nftw(path, removeEntry, 16, FTW_DEPTH | FTW_PHYS) == -1 && errno != ENOENT)
+    {
+        perror("nftw failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int removeEntry(const char* path, const struct stat* entryStat, int flag, struct FTW* ftw)
+{
+    return remove(path);
+}
+
+/*
+ * small: 512 B - 16 KiB, source trees and configs
+ * mixed: 90% small, 9% 64 KiB - 1 MiB, 1% 1 - 8 MiB
+ * large: 1 - 32 MiB, media and dumps
+ */
+off_t pickSize(SizeDistribution sizes, uint64_t* state)
+{
+    uint64_t roll = nextRandom(state) % 100;
+    uint64_t value = nextRandom(state);
+
+    if (sizes == SIZES_LARGE) return (1 << 20) + value % (31 << 20);
+    if (sizes == SIZES_SMALL || roll < 90) return 512 + value % (16 * 1024 - 512);
+    if (roll < 99) return (64 << 10) + value % ((1 << 20) - (64 << 10));
+    return (1 << 20) + value % (7 << 20);
+}
+
+// xorshift64*, fast and deterministic across runs
+uint64_t nextRandom(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+boolean isChanged(int index, double changeRatio)
+{
+    uint64_t state = 0x632BE59BD9B4E019ULL + (uint64_t)index;
+
+    return (nextRandom(&state) % 1000000) < (uint64_t)(changeRatio * 1000000);
+}
+
+void readProcessIo(pid_t pid, RunResult* result)
+{
+    char path[64];
+    char line[256];
+    FILE* file = NULL;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    if ((file = fopen(path, "r")) == NULL) return;
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        sscanf(line, "syscr: %llu", &result->readCalls);
+        sscanf(line, "syscw: %llu", &result->writeCalls);
+        sscanf(line, "rchar: %llu", &result->readBytes);
+        sscanf(line, "wchar: %llu", &result->writeBytes);
+    }
+    fclose(file);
+}
+
+double elapsedMs(const struct timespec* start, const struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
@@ -0,0 +1,132 @@
+// Benchmark for sortFilesLexicographically() at 1k, 100k and 1M entries.
+// Builds against file_sync.c directly so it measures the exact code that ships.
+
+#define FILE_SYNC_NO_MAIN
+#include "../file_sync.c"
+
+#include <time.h>
+
+#define NAME_LENGTH 32
+
+const DirData* compareNamesDir = NULL;
+
+int compareNames(const void* first, const void* second);
+void fillNames(DirData* dir, int count, unsigned int seed);
+double benchmarkSort(int count);
+double benchmarkQsort(int count);
+double elapsedMs(const struct timespec* start, const struct timespec* end);
+
+int main(int argc, char** argv)
+{
+    int sizes[] = { 1000, 100000, 1000000 };
+
+    printf("%10s %14s %14s\n", "entries", "radix (ms)", "qsort (ms)");
+
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        double radixMs = benchmarkSort(sizes[i]);
+        double qsortMs = benchmarkQsort(sizes[i]);
+
+        printf("%10d %14.2f %14.2f\n", sizes[i], radixMs, qsortMs);
+    }
+
+    return 0;
+}
+
+// a mix of the shapes real directories have: long shared prefixes, numbered series, random names
+void fillNames(DirData* dir, int count, unsigned int seed)
+{
+    memset(dir, 0, sizeof(DirData));
+    dir->filesCount = count;
+    dir->files = (FileData*)malloc(count * sizeof(FileData));
+    if (dir->files == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(seed);
+    for (int i = 0; i < count; i++)
+    {
+        char name[NAME_LENGTH + 1];
+        size_t length = 0;
+
+        switch (i % 3)
+        {
+            case 0:
+                snprintf(name, NAME_LENGTH + 1, "IMG_%08d.jpg", rand() % 100000000);
+                break;
+            case 1:
+                snprintf(name, NAME_LENGTH + 1, "log-2024-%02d-%02d.%d", rand() % 12 + 1, rand() % 28 + 1, rand() % 1000);
+                break;
+            default:
+            {
+                int length = rand() % (NAME_LENGTH - 1) + 1;
+                for (int j = 0; j < length; j++) name[j] = (char)(rand() % 254 + 1);
+                name[length] = '\0';
+            }
+        }
+
+        length = strlen(name);
+        dir->files[i] = (FileData){ appendName(&dir->names, name, length), length, { 0, 0 }, 0 };
+    }
+}
+
+int compareNames(const void* first, const void* second)
+{
+    return strcmp(fileName(compareNamesDir, first), fileName(compareNamesDir, second));
+}
+
+double benchmarkSort(int count)
+{
+    DirData dir;
+    DirData reference;
+    struct timespec start;
+    struct timespec end;
+
+    fillNames(&dir, count, (unsigned int)count);
+    fillNames(&reference, count, (unsigned int)count);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sortFilesLexicographically(&dir);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    compareNamesDir = &reference;
+    qsort(reference.files, count, sizeof(FileData), compareNames);
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(fileName(&dir, &dir.files[i]), fileName(&reference, &reference.files[i])) != 0)
+        {
+            fprintf(stderr, "sort mismatch at %d of %d\n", i, count);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    freeDirData(&dir);
+    freeDirData(&reference);
+
+    return elapsedMs(&start, &end);
+}
+
+double benchmarkQsort(int count)
+{
+    DirData dir;
+    struct timespec start;
+    struct timespec end;
+
+    fillNames(&dir, count, (unsigned int)count);
+
+    compareNamesDir = &dir;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    qsort(dir.files, count, sizeof(FileData), compareNames);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    freeDirData(&dir);
+
+    return elapsedMs(&start, &end);
+}
+
+double elapsedMs(const struct timespec* start, const struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
@@ -0,0 +1,657 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BOARD_SIZE 128
+#define BOARD_WIDTH 8
+#define EMPTY_SQUARE '.'
+#define MAX_SQUARE_CHANGES 4
+#define COMMAND_INITIAL_SIZE 64
+#define MAX_PATH 4096
+
+#define SNAPSHOT_INTERVAL 16
+#define PACKED_BOARD_SIZE 32
+#define PACKED_PIECES ".PNBRQKpnbrqk"
+#define INDEX_MAGIC "CRIX"
+#define INDEX_VERSION 2
+
+#define PROMPT_TXT "Press 'd' to move forward, 'a' to move back, 'w' to go to the start, 's' to go to the end, 'q' to quit: "
+#define FILES_TXT "  a b c d e f g h"
+
+typedef enum  {
+    false,
+    true
+} boolean;
+
+/*
+ * A UCI move as chess_sim.sh takes it apart: two squares and an
+ * optional promotion piece, written as it is (so lowercase for white
+ * too). A move whose squares are not on the board changes nothing.
+ */
+typedef struct {
+    int from;
+    int to;
+    char promotion;
+    boolean isValid;
+} Move;
+
+typedef struct {
+    int square;
+    char piece;
+} SquareChange;
+
+// the squares a move changed and what stood on them before, restored in reverse
+typedef struct {
+    SquareChange changes[MAX_SQUARE_CHANGES];
+    int count;
+} MoveUndo;
+
+// a board at four bits a square, the index into PACKED_PIECES
+typedef struct {
+    unsigned char squares[PACKED_BOARD_SIZE];
+} PackedBoard;
+
+/*
+ * A 0x88 board: square = row * 16 + column with row 0 being rank 8,
+ * so (square & 0x88) != 0 exactly when a step left the board. Moves are
+ * applied one at a time and undone from the stack, so every step costs
+ * O(1) instead of a replay from the starting position. The board before
+ * every SNAPSHOT_INTERVAL-th move is kept packed, so a jump anywhere
+ * takes fewer than SNAPSHOT_INTERVAL moves from the nearest one.
+ */
+typedef struct {
+    char squares[BOARD_SIZE];
+    Move* moves;
+    MoveUndo* undos;            // count is -1 for a move jumped over and never played
+    int movesCount;
+    int current;
+    PackedBoard* snapshots;     // NULL when a piece the moves wrote does not pack
+    int snapshotsCount;
+} Replay;
+
+/*
+ * The sidecar index file: this header, then the snapshots. It holds in
+ * this machine's byte order; one that does not match the moves, or
+ * whose snapshots do not match their hash or hold codes that are not
+ * pieces, is simply rebuilt.
+ */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t interval;
+    uint32_t movesCount;
+    uint64_t movesHash;
+    uint64_t snapshotsHash;
+} IndexHeader;
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} Command;
+
+void initReplay(Replay* replay, int movesCount, char** moves);
+boolean parseMove(const char* text, Move* move);
+int toSquare(char column, char row);
+void stepForward(Replay* replay);
+void stepBack(Replay* replay);
+void jumpTo(Replay* replay, int target);
+boolean parseJump(const char* command, long* target);
+void buildSnapshots(Replay* replay);
+void loadSnapshot(Replay* replay, int index);
+boolean packBoard(const Replay* replay, PackedBoard* packed);
+uint64_t hashMoves(int movesCount, char** moves);
+uint64_t hashSnapshots(const PackedBoard* snapshots, int snapshotsCount);
+boolean isSnapshotValid(const PackedBoard* packed);
+boolean loadIndex(Replay* replay, const char* path, uint64_t movesHash);
+void saveIndex(const Replay* replay, const char* path, uint64_t movesHash);
+void setSquare(Replay* replay, MoveUndo* undo, int square, char piece);
+char pieceAt(const Replay* replay, int square);
+void printBoard(const Replay* replay);
+boolean readCommand(Command* command);
+void appendCommandChar(Command* command, char c);
+
+/*
+ * The board side of chess_sim.sh: chess_replay [--index <file>] <uci_move>...
+ * prints the starting position and then answers the script's keys with
+ * the same output, byte for byte. "j N" jumps to move N. The snapshots
+ * are read from the index file when it matches the moves, and written
+ * to it otherwise.
+ */
+int main(int argc, char** argv)
+{
+    Replay replay;
+    Command command = { NULL, 0, 0 };
+    const char* indexPath = NULL;
+    char** moves = argv + 1;
+    int movesCount = argc - 1;
+    uint64_t movesHash = 0;
+    boolean isLineRead = false;
+    long target = 0;
+
+    if (argc >= 3 && strcmp(argv[1], "--index") == 0)
+    {
+        indexPath = argv[2];
+        moves += 2;
+        movesCount -= 2;
+    }
+
+    initReplay(&replay, movesCount, moves);
+    movesHash = hashMoves(movesCount, moves);
+    if (indexPath == NULL || !loadIndex(&replay, indexPath, movesHash))
+    {
+        buildSnapshots(&replay);
+        if (indexPath != NULL && replay.snapshots != NULL) saveIndex(&replay, indexPath, movesHash);
+    }
+
+    printBoard(&replay);
+
+    while (true)
+    {
+        fputs(PROMPT_TXT, stdout);
+        fflush(stdout);
+
+        isLineRead = readCommand(&command);
+        // at the end of input the script would print "Invalid key pressed: " forever
+        if (!isLineRead && command.length == 0) break;
+
+        if (strcmp(command.data, "d") == 0)
+        {
+            if (replay.current == replay.movesCount)
+            {
+                puts("No more moves available.");
+                continue;
+            }
+            stepForward(&replay);
+            printBoard(&replay);
+        }
+        else if (strcmp(command.data, "q") == 0)
+        {
+            puts("Exiting.");
+            puts("End of game.");
+            break;
+        }
+        else if (strcmp(command.data, "a") == 0)
+        {
+            if (replay.current > 0) stepBack(&replay);
+            printBoard(&replay);
+        }
+        else if (strcmp(command.data, "s") == 0)
+        {
+            jumpTo(&replay, replay.movesCount);
+            printBoard(&replay);
+        }
+        else if (strcmp(command.data, "w") == 0)
+        {
+            jumpTo(&replay, 0);
+            printBoard(&replay);
+        }
+        else if (parseJump(command.data, &target))
+        {
+            if (target > replay.movesCount)
+            {
+                printf("No move %ld, the game has %d moves.\n", target, replay.movesCount);
+                continue;
+            }
+            jumpTo(&replay, target);
+            printBoard(&replay);
+        }
+        else
+        {
+            printf("Invalid key pressed: %s\n", command.data);
+        }
+
+        if (!isLineRead) break;
+    }
+
+    free(command.data);
+    free(replay.moves);
+    free(replay.undos);
+    free(replay.snapshots);
+
+    return 0;
+}
+
+void initReplay(Replay* replay, int movesCount, char** moves)
+{
+    static const char* initialBoard[BOARD_WIDTH] = {
+        "rnbqkbnr",
+        "pppppppp",
+        "........",
+        "........",
+        "........",
+        "........",
+        "PPPPPPPP",
+        "RNBQKBNR"
+    };
+
+    memset(replay->squares, EMPTY_SQUARE, BOARD_SIZE);
+    for (int row = 0; row < BOARD_WIDTH; row++)
+        memcpy(replay->squares + row * 16, initialBoard[row], BOARD_WIDTH);
+
+    replay->moves = (Move*)malloc((movesCount + 1) * sizeof(Move));
+    replay->undos = (MoveUndo*)malloc((movesCount + 1) * sizeof(MoveUndo));
+    if (replay->moves == NULL || replay->undos == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < movesCount; i++)
+    {
+        replay->moves[i].isValid = parseMove(moves[i], &replay->moves[i]);
+        replay->undos[i].count = -1;
+    }
+
+    replay->movesCount = movesCount;
+    replay->current = 0;
+    replay->snapshots = NULL;
+    replay->snapshotsCount = 0;
+}
+
+boolean parseMove(const char* text, Move* move)
+{
+    size_t length = strlen(text);
+
+    move->promotion = length > 4 ? text[4] : '\0';
+    if (length < 4) return false;
+
+    move->from = toSquare(text[0], text[1]);
+    move->to = toSquare(text[2], text[3]);
+
+    return move->from != -1 && move->to != -1;
+}
+
+// the script's transform_move_to_idx, on a 0x88 board
+int toSquare(char column, char row)
+{
+    if (column < 'a' || column > 'h' || row < '1' || row > '8') return -1;
+
+    return ('8' - row) * 16 + (column - 'a');
+}
+
+/*
+ * perform_move of chess_sim.sh: the piece (or the promotion piece)
+ * moves, a king going two columns brings the rook beside it, and a
+ * pawn moving diagonally onto an empty square takes the pawn it passed.
+ */
+void stepForward(Replay* replay)
+{
+    const Move* move = &replay->moves[replay->current];
+    MoveUndo* undo = &replay->undos[replay->current];
+    char piece = EMPTY_SQUARE;
+    int columnDiff = 0;
+
+    undo->count = 0;
+    replay->current++;
+    if (!move->isValid) return;
+
+    piece = move->promotion != '\0' ? move->promotion : replay->squares[move->from];
+    columnDiff = (move->to & 7) - (move->from & 7);
+
+    if ((piece == 'K' || piece == 'k') && (columnDiff == 2 || columnDiff == -2))
+    {
+        // the rook is read on the king's row and put down on the target's, as the script does
+        int rowFrom = move->from & 0x70;
+        int rowTo = move->to & 0x70;
+        int rookColumn = columnDiff > 0 ? (move->to & 7) + 1 : (move->to & 7) - 2;
+        int rookTarget = columnDiff > 0 ? (move->to & 7) - 1 : (move->to & 7) + 1;
+        char rook = pieceAt(replay, rowFrom | rookColumn);
+
+        setSquare(replay, undo, rowTo | rookColumn, EMPTY_SQUARE);
+        setSquare(replay, undo, rowTo | rookTarget, rook);
+    }
+
+    if ((piece == 'P' || piece == 'p') && columnDiff != 0 && replay->squares[move->to] == EMPTY_SQUARE)
+        setSquare(replay, undo, (move->from & 0x70) | (move->to & 7), EMPTY_SQUARE);
+
+    setSquare(replay, undo, move->to, piece);
+    setSquare(replay, undo, move->from, EMPTY_SQUARE);
+}
+
+void stepBack(Replay* replay)
+{
+    const MoveUndo* undo = &replay->undos[replay->current - 1];
+
+    // a move a jump went past has no undo yet, it is played from the snapshot before it
+    if (undo->count == -1)
+    {
+        int target = replay->current - 1;
+
+        loadSnapshot(replay, target / SNAPSHOT_INTERVAL);
+        while (replay->current < target) stepForward(replay);
+        return;
+    }
+
+    replay->current--;
+    for (int i = undo->count - 1; i >= 0; i--)
+        replay->squares[undo->changes[i].square] = undo->changes[i].piece;
+}
+
+// by steps from here when that is shorter than from the snapshot before target
+void jumpTo(Replay* replay, int target)
+{
+    int distance = abs(target - replay->current);
+
+    if (replay->snapshots != NULL && distance > target % SNAPSHOT_INTERVAL)
+        loadSnapshot(replay, target / SNAPSHOT_INTERVAL);
+
+    while (replay->current < target) stepForward(replay);
+    while (replay->current > target) stepBack(replay);
+}
+
+// "j N": a j, blanks and a move number
+boolean parseJump(const char* command, long* target)
+{
+    const char* number = command + 1;
+    char* end = NULL;
+
+    if (command[0] != 'j' || (*number != ' ' && *number != '\t')) return false;
+    while (*number == ' ' || *number == '\t') number++;
+    if (!isdigit((unsigned char)*number)) return false;
+
+    *target = strtol(number, &end, 10);
+
+    return *end == '\0';
+}
+
+// one pass over the game, which also leaves every move's undo behind
+void buildSnapshots(Replay* replay)
+{
+    boolean isPacked = true;
+
+    replay->snapshotsCount = replay->movesCount / SNAPSHOT_INTERVAL + 1;
+    replay->snapshots = (PackedBoard*)malloc(replay->snapshotsCount * sizeof(PackedBoard));
+    if (replay->snapshots == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    while (isPacked)
+    {
+        if (replay->current % SNAPSHOT_INTERVAL == 0)
+            isPacked = packBoard(replay, &replay->snapshots[replay->current / SNAPSHOT_INTERVAL]);
+        if (replay->current == replay->movesCount) break;
+        stepForward(replay);
+    }
+
+    while (replay->current > 0) stepBack(replay);
+
+    if (!isPacked)
+    {
+        free(replay->snapshots);
+        replay->snapshots = NULL;
+        replay->snapshotsCount = 0;
+    }
+}
+
+void loadSnapshot(Replay* replay, int index)
+{
+    const PackedBoard* packed = &replay->snapshots[index];
+
+    for (int i = 0; i < BOARD_WIDTH * BOARD_WIDTH; i++)
+    {
+        int code = (packed->squares[i / 2] >> (i % 2 * 4)) & 0xf;
+
+        replay->squares[(i / BOARD_WIDTH) * 16 + i % BOARD_WIDTH] = PACKED_PIECES[code];
+    }
+
+    replay->current = index * SNAPSHOT_INTERVAL;
+}
+
+// false for a board holding something a promotion wrote that is not a piece
+boolean packBoard(const Replay* replay, PackedBoard* packed)
+{
+    memset(packed, 0, sizeof(PackedBoard));
+
+    for (int i = 0; i < BOARD_WIDTH * BOARD_WIDTH; i++)
+    {
+        char piece = replay->squares[(i / BOARD_WIDTH) * 16 + i % BOARD_WIDTH];
+        const char* code = piece != '\0' ? strchr(PACKED_PIECES, piece) : NULL;
+
+        if (code == NULL) return false;
+        packed->squares[i / 2] |= (code - PACKED_PIECES) << (i % 2 * 4);
+    }
+
+    return true;
+}
+
+// FNV-1a over the moves as the script passes them, to tell an index of other moves
+uint64_t hashMoves(int movesCount, char** moves)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int i = 0; i < movesCount; i++)
+    {
+        for (const char* c = moves[i]; *c != '\0'; c++)
+            hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+        hash = (hash ^ ' ') * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// FNV-1a again, over the packed boards as they are written
+uint64_t hashSnapshots(const PackedBoard* snapshots, int snapshotsCount)
+{
+    const unsigned char* bytes = (const unsigned char*)snapshots;
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < snapshotsCount * sizeof(PackedBoard); i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+
+    return hash;
+}
+
+// every code has to name a piece, or loadSnapshot would read past PACKED_PIECES
+boolean isSnapshotValid(const PackedBoard* packed)
+{
+    for (int i = 0; i < BOARD_WIDTH * BOARD_WIDTH; i++)
+    {
+        int code = (packed->squares[i / 2] >> (i % 2 * 4)) & 0xf;
+
+        if (code >= (int)strlen(PACKED_PIECES)) return false;
+    }
+
+    return true;
+}
+
+boolean loadIndex(Replay* replay, const char* path, uint64_t movesHash)
+{
+    IndexHeader header;
+    FILE* file = fopen(path, "rb");
+    int snapshotsCount = replay->movesCount / SNAPSHOT_INTERVAL + 1;
+    boolean isLoaded = false;
+
+    if (file == NULL) return false;
+
+    if (fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0
+        && header.version == INDEX_VERSION && header.interval == SNAPSHOT_INTERVAL
+        && header.movesCount == (uint32_t)replay->movesCount && header.movesHash == movesHash)
+    {
+        replay->snapshots = (PackedBoard*)malloc(snapshotsCount * sizeof(PackedBoard));
+        if (replay->snapshots == NULL)
+        {
+            perror("Malloc failed");
+            exit(EXIT_FAILURE);
+        }
+
+        isLoaded = fread(replay->snapshots, sizeof(PackedBoard), snapshotsCount, file) == (size_t)snapshotsCount
+            && hashSnapshots(replay->snapshots, snapshotsCount) == header.snapshotsHash;
+        for (int i = 0; isLoaded && i < snapshotsCount; i++)
+            isLoaded = isSnapshotValid(&replay->snapshots[i]);
+
+        if (isLoaded)
+        {
+            replay->snapshotsCount = snapshotsCount;
+        }
+        else
+        {
+            free(replay->snapshots);
+            replay->snapshots = NULL;
+        }
+    }
+
+    fclose(file);
+    return isLoaded;
+}
+
+/*
+ * Written to a temporary name of its own and renamed over the index, so
+ * a reader never sees half of one, and two runs on the same game never
+ * write into the same file. The index only saves time: a game in a
+ * directory we cannot write to goes on without one, and says nothing.
+ */
+void saveIndex(const Replay* replay, const char* path, uint64_t movesHash)
+{
+    IndexHeader header;
+    char tempPath[MAX_PATH];
+    FILE* file = NULL;
+    boolean isWritten = false;
+    int fd = -1;
+
+    if (snprintf(tempPath, MAX_PATH, "%s.XXXXXX", path) >= MAX_PATH) return;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.interval = SNAPSHOT_INTERVAL;
+    header.movesCount = replay->movesCount;
+    header.movesHash = movesHash;
+    header.snapshotsHash = hashSnapshots(replay->snapshots, replay->snapshotsCount);
+
+    // mkstemp makes it 0600, the index is no more private than the game
+    fd = mkstemp(tempPath);
+    if (fd == -1) return;
+    if (fchmod(fd, 0644) == -1 || (file = fdopen(fd, "wb")) == NULL)
+    {
+        close(fd);
+        unlink(tempPath);
+        return;
+    }
+
+    isWritten = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(replay->snapshots, sizeof(PackedBoard), replay->snapshotsCount, file) == (size_t)replay->snapshotsCount;
+    if (fclose(file) != 0) isWritten = false;
+
+    if (!isWritten || rename(tempPath, path) == -1) unlink(tempPath);
+}
+
+void setSquare(Replay* replay, MoveUndo* undo, int square, char piece)
+{
+    if (square < 0 || (square & 0x88) != 0) return;
+
+    undo->changes[undo->count].square = square;
+    undo->changes[undo->count].piece = replay->squares[square];
+    undo->count++;
+    replay->squares[square] = piece;
+}
+
+// empty off the board, where the script's substrings come out empty
+char pieceAt(const Replay* replay, int square)
+{
+    if (square < 0 || (square & 0x88) != 0) return EMPTY_SQUARE;
+
+    return replay->squares[square];
+}
+
+void printBoard(const Replay* replay)
+{
+    char line[2 * BOARD_WIDTH + 8];
+
+    printf("Move %d/%d\n", replay->current, replay->movesCount);
+    puts(FILES_TXT);
+
+    for (int row = 0; row < BOARD_WIDTH; row++)
+    {
+        char* cursor = line;
+
+        *cursor++ = '8' - row;
+        for (int column = 0; column < BOARD_WIDTH; column++)
+        {
+            *cursor++ = ' ';
+            *cursor++ = replay->squares[row * 16 + column];
+        }
+        *cursor++ = ' ';
+        *cursor++ = '8' - row;
+        *cursor = '\0';
+        puts(line);
+    }
+
+    puts(FILES_TXT);
+}
+
+/*
+ * The script's `read -p "" CMD`: blanks around the line are dropped,
+ * a backslash keeps the next character (and joins the next line when
+ * that is the newline), NUL bytes vanish. False once input ended before
+ * a newline; whatever was read by then is still in command.
+ */
+boolean readCommand(Command* command)
+{
+    size_t protectedLength = 0;
+    boolean isLineRead = false;
+    int c = 0;
+
+    command->length = 0;
+
+    while ((c = getchar()) != EOF)
+    {
+        if (c == '\n')
+        {
+            isLineRead = true;
+            break;
+        }
+
+        if (c == '\\')
+        {
+            c = getchar();
+            if (c == EOF) break;
+            if (c == '\n') continue;
+            if (c != '\0')
+            {
+                appendCommandChar(command, c);
+                protectedLength = command->length;
+            }
+            continue;
+        }
+
+        if (c == '\0' || ((c == ' ' || c == '\t') && command->length == 0)) continue;
+        appendCommandChar(command, c);
+    }
+
+    while (command->length > protectedLength
+        && (command->data[command->length - 1] == ' ' || command->data[command->length - 1] == '\t'))
+    {
+        command->length--;
+    }
+    appendCommandChar(command, '\0');
+    command->length--;
+
+    return isLineRead;
+}
+
+void appendCommandChar(Command* command, char c)
+{
+    if (command->length + 1 >= command->capacity)
+    {
+        command->capacity = command->capacity ? command->capacity * 2 : COMMAND_INITIAL_SIZE;
+        command->data = (char*)realloc(command->data, command->capacity);
+        if (command->data == NULL)
+        {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    command->data[command->length++] = c;
+}
@@ -20,9 +20,25 @@ do
 done < $SRC
 # printing game
 
-MOV_ARRAY=($(python3 parse_moves.py "$(<$SRC)"))
+# the compiled parser (make parse_moves) gives the same moves without starting python
+PARSER="$(dirname "$0")/parse_moves"
+if [[ -x $PARSER ]]
+then
+    MOV_ARRAY=($("$PARSER" - < "$SRC"))
+else
+    MOV_ARRAY=($(python3 parse_moves.py "$(<$SRC)"))
+fi
 MOV_COUNTER=0
 TOTAL_MOV=${#MOV_ARRAY[@]}
+
+# the compiled replayer (make chess_replay) steps the board instead of replaying every move on each key,
+# and keeps snapshots of the game in a .idx file next to it
+REPLAYER="$(dirname "$0")/chess_replay"
+if [[ -x $REPLAYER ]]
+then
+    exec "$REPLAYER" --index "$SRC.idx" "${MOV_ARRAY[@]}"
+fi
+
 INITIAL_BOARD=(
   "rnbqkbnr"
   "pppppppp"
@@ -1,7 +1,16 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -9,9 +18,56 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 
 #define MAX_PATH 1024
 #define READ_BATCH_SIZE 100
+#define COMPARE_BLOCK_SIZE (1 << 20)
+#define COMPARE_SAMPLE_SIZE (1 << 16)
+#define IO_BUFFER_ALIGNMENT 4096
+#define COPY_CHUNK_SIZE (1 << 20)
+#define OUTPUT_BUFFER_INITIAL_SIZE 256
+#define LOG_RING_SIZE (1 << 20)
+#define RADIX_SORT_CUTOFF 32
+#define RADIX_BUCKETS 256
+#define DIRENT_BUFFER_SIZE (1 << 18)
+#define FILES_INITIAL_CAPACITY 64
+#define NAMES_INITIAL_CAPACITY 4096
+#define ARENA_BLOCK_SIZE (1 << 16)
+#define MANIFEST_FILE_NAME ".file_sync_manifest"
+#define MANIFEST_TEMP_FILE_NAME ".file_sync_manifest.tmp"
+#define MANIFEST_MAGIC "FSYNCMF1"
+#define MANIFEST_VERSION 2
+#define MANIFEST_HASH_KNOWN 1u
+#define DELTA_BLOCK_SIZE (1 << 13)
+#define DELTA_MIN_FILE_SIZE (1 << 20)
+#define DELTA_OPS_INITIAL_CAPACITY 64
+#define TEMP_FILE_PREFIX ".file_sync_tmp."
+#define TEMP_NAME_SIZE 64
+#define IO_RING_ENTRIES 256
+#define IO_RING_BATCH_SIZE 64
+#define IO_RING_SMALL_FILE_SIZE (1 << 16)
+#define WATCH_DEBOUNCE_MS 250
+#define WATCH_MAX_DELAY_MS 2000
+#define WATCH_EVENT_BUFFER_SIZE (1 << 16)
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define LATENCY_BUCKETS 32
+#define LINK_TABLE_BUCKETS (1 << 12)
+#define PIPELINE_DEPTH 256
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
 
 typedef struct timespec timespec;
 
@@ -20,102 +76,809 @@ typedef enum  {
     true
 } boolean;
 
+// how hard syncEntry looks before it believes two files with the same size are identical
+typedef enum {
+    COMPARE_POLICY_METADATA,    // same mtime
+    COMPARE_POLICY_FAST,        // same first and last COMPARE_SAMPLE_SIZE bytes
+    COMPARE_POLICY_FULL         // same content, every byte
+} ComparePolicy;
+
+// which events reach stdout; messages (start, errors, completion) are always shown
+typedef enum {
+    LOG_LEVEL_SUMMARY,      // messages and a closing count of every event
+    LOG_LEVEL_CHANGES,      // plus everything that touched the destination
+    LOG_LEVEL_FULL          // plus the files that were left alone
+} LogLevel;
+
+typedef enum {
+    LOG_FORMAT_TEXT,
+    LOG_FORMAT_JSONL
+} LogFormat;
+
+// when written files are forced out of the page cache; every file is renamed into place either way
+typedef enum {
+    DURABILITY_NONE,    // whenever the kernel gets to it
+    DURABILITY_FILE,    // fdatasync each file before its rename, fsync the directory after and a new directory's parent
+    DURABILITY_BATCH    // one syncfs of the destination once a whole run (or watch resync) is in place
+} Durability;
+
+// what --dedup makes of a file whose content an earlier file of the run already put in the destination
+typedef enum {
+    DEDUP_NONE,
+    DEDUP_REFLINK,  // a clone of the earlier copy, sharing its extents but nothing else
+    DEDUP_LINK      // a hard link to the earlier copy, so mode and mtime are shared as well
+} DedupMode;
+
+typedef enum {
+    COMPARE_IDENTICAL,
+    COMPARE_DIFFERENT,
+    COMPARE_ERROR
+} CompareResult;
+
+typedef enum {
+    COPY_DONE,
+    COPY_UNSUPPORTED,
+    COPY_FAILED
+} CopyResult;
+
+// the name lives in the owning DirData's names blob, see fileName()
 typedef struct {
-    char* name;
+    unsigned int nameOffset;
+    unsigned int nameLength;
     timespec lastModified;
+    off_t size;
+    ino_t inode;
+    dev_t device;
+    nlink_t linksCount;
 } FileData;
 
+// the record getdents64 fills in, glibc does not export it
+typedef struct {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} LinuxDirent64;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} ArenaBlock;
+
+// bump allocator: allocations are never freed one by one, only reset or released as a whole
+typedef struct {
+    ArenaBlock* head;
+    ArenaBlock* current;
+} Arena;
+
+// NUL-terminated names packed back to back, addressed by offset so the blob may move when it grows
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} NamesBlob;
+
 typedef struct {
     char* path;
+    const char* relativePath;   // log prefix below the synced root ("sub/dir/"), NULL at the root
+    int fd;
     FileData* files;
     int filesCount;
+    FileData* subdirs;
+    int subdirsCount;
+    boolean isSorted;
+    NamesBlob names;
+    Arena arena;
 } DirData;
 
+typedef enum {
+    SYNC_NEW,
+    SYNC_BOTH,
+    SYNC_DEST_ONLY
+} SyncKind;
+
+typedef enum {
+    OUTCOME_NONE,
+    OUTCOME_IDENTICAL,
+    OUTCOME_COPIED,
+    OUTCOME_SKIPPED
+} SyncOutcome;
+
+typedef struct {
+    SyncKind kind;
+    const FileData* srcFile;
+    const FileData* destFile;
+    SyncOutcome outcome;
+    uint64_t contentHash;
+    boolean hasContentHash;     // false after the cheaper compare policies and after a plain copy, neither reads the whole file
+} SyncEntry;
+
+typedef struct {
+    SyncEntry* entries;
+    int entriesCount;
+} SyncPlan;
+
+// open-addressing hash of file names to their index in a DirData, -1 marks an empty slot
+typedef struct {
+    int* slots;
+    unsigned int mask;
+} FileIndex;
+
+typedef struct {
+    int jobs;
+    boolean useManifest;
+    boolean recursive;
+    boolean useDelta;
+    boolean useIoUring;
+    boolean watch;
+    ComparePolicy comparePolicy;
+    boolean printStats;
+    int statsInterval;      // seconds between interim --stats lines, 0 for none
+    LogLevel logLevel;
+    LogFormat logFormat;
+    Durability durability;
+    boolean preserveHardLinks;
+    DedupMode dedupMode;
+    boolean pipeline;
+} SyncOptions;
+
+// streaming XXH64 state
+typedef struct {
+    uint64_t lanes[4];
+    unsigned char pending[32];
+    size_t pendingLength;
+    uint64_t totalLength;
+} ContentHash;
+
+/*
+ * On-disk manifest, stored in the destination directory: a header, the
+ * records sorted by name, then the NUL-terminated names they point into.
+ * Each record describes a file that was identical on both sides when the
+ * manifest was written.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordsCount;
+    uint64_t namesSize;
+} ManifestHeader;
+
+typedef struct {
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t inode;
+    int64_t destMtimeSec;
+    int64_t destMtimeNsec;
+    uint64_t contentHash;
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    uint32_t flags;         // MANIFEST_HASH_KNOWN when contentHash is the file's XXH64
+    uint32_t reserved;
+} ManifestRecord;
+
+typedef struct {
+    void* map;
+    size_t mapSize;
+    const ManifestRecord* records;
+    uint32_t recordsCount;
+    const char* names;
+} Manifest;
+
+typedef struct {
+    const DirData* src;
+    const DirData* dest;
+    const SyncOptions* options;
+    const Manifest* manifest;
+} SyncContext;
+
+// rsync's weak checksum over a window of the source, rolled one byte at a time
+typedef struct {
+    uint32_t a;
+    uint32_t b;
+    size_t length;
+} RollingChecksum;
+
+typedef struct {
+    uint32_t weak;
+    uint64_t strong;
+    int next;   // next block in the same bucket, -1 ends the chain
+} BlockSignature;
+
+// signatures of the full DELTA_BLOCK_SIZE blocks of the destination, bucketed by weak checksum
+typedef struct {
+    BlockSignature* blocks;
+    int blocksCount;
+    int* buckets;
+    int bucketBits;
+} DeltaSignature;
+
+typedef struct {
+    off_t srcOffset;
+    off_t destOffset;   // -1 for literal data that has to come from the source
+    off_t length;
+} DeltaOp;
+
+typedef struct {
+    DeltaOp* ops;
+    int opsCount;
+    int opsCapacity;
+    off_t literalBytes;
+} DeltaPlan;
+
+// a raw io_uring instance, only ever used by one thread
+typedef struct {
+    int fd;
+    unsigned int* sqHead;
+    unsigned int* sqTail;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+    struct io_uring_sqe* sqes;
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe* cqes;
+    void* ringMap;
+    size_t ringMapSize;
+    size_t sqesSize;
+    unsigned int queued;    // filled in but not yet handed to the kernel
+    unsigned int pending;   // handed to the kernel, completion not reaped yet
+} IoRing;
+
+// one small file of a ring batch; every ring op stores its result (fd, count or -errno) in here
+typedef struct {
+    SyncEntry* entry;
+    boolean useSyncPath;    // left to syncEntry once the batch is done
+    boolean isIdentical;
+    boolean needsCopy;
+    struct statx srcStat;
+    struct statx destStat;
+    int srcStatResult;
+    int destStatResult;
+    int srcFd;
+    int destFd;
+    int writeFd;
+    char tempName[TEMP_NAME_SIZE];  // what writeFd was opened as, renamed over the real name at the end
+    int srcLength;
+    int destLength;
+    int writeResult;
+    int writeSyncResult;
+    int writeCloseResult;
+    int closeResult;
+    char* srcBuffer;
+    char* destBuffer;
+} RingTask;
+
+// names touched by inotify events since the last resync, possibly repeated
+typedef struct {
+    NamesBlob names;
+    FileData* files;    // only nameOffset and nameLength are used
+    int filesCount;
+    int filesCapacity;
+} DirtySet;
+
+static volatile sig_atomic_t watchStopRequested = 0;
+
+typedef enum {
+    PHASE_LS,
+    PHASE_SORT,
+    PHASE_SYNC,
+    PHASES_COUNT
+} Phase;
+
+// what a phase cost; syscalls are the read/write family as /proc/self/io counts them, forks are this process's own
+typedef struct {
+    long long elapsedNs;
+    unsigned long long readCalls;
+    unsigned long long writeCalls;
+    unsigned long long forks;
+} PhaseStats;
+
+// ways of deciding about a file pair without reading both files whole
+typedef enum {
+    FAST_PATH_MANIFEST,     // unchanged since the manifest was written, nothing read
+    FAST_PATH_SIZE,         // sizes differ, nothing read
+    FAST_PATH_METADATA,     // --compare=metadata settled it on mtimes
+    FAST_PATH_SAMPLE,       // --compare=fast settled it on head and tail
+    FAST_PATHS_COUNT
+} FastPath;
+
+// bucket i counts operations that took [2^i, 2^(i+1)) microseconds, bucket 0 also takes everything faster
+typedef struct {
+    unsigned long long buckets[LATENCY_BUCKETS];
+    unsigned long long count;
+    unsigned long long totalNs;
+    unsigned long long maxNs;
+} LatencyHistogram;
+
+/*
+ * Everything --stats reports. The phases are only ever touched by the
+ * main thread; the counters and histograms are bumped with relaxed
+ * atomics from whichever thread does the work, and read the same way by
+ * the --stats-interval reporter.
+ */
+typedef struct {
+    boolean enabled;
+    long long startNs;
+    PhaseStats phases[PHASES_COUNT];
+    PhaseStats start;       // the counters when the current phase began
+    PhaseStats overhead;    // what reading the counters itself adds to them
+    unsigned long long bytesRead;
+    unsigned long long bytesWritten;
+    unsigned long long bytesCompared;
+    unsigned long long bytesLinked;     // files linked or cloned in the destination rather than copied
+    unsigned long long forks;           // every fork or spawn site bumps it; none is left since diff and cp run in-process
+    unsigned long long fastPaths[FAST_PATHS_COUNT];
+    LatencyHistogram compareLatency;
+    LatencyHistogram copyLatency;
+    int intervalSeconds;
+    boolean stopRequested;
+    pthread_t reporter;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+} RunStats;
+
+static RunStats runStats;
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} OutputBuffer;
+
+typedef enum {
+    LOG_EVENT_NEW,
+    LOG_EVENT_UPDATED,
+    LOG_EVENT_COPIED,
+    LOG_EVENT_PATCHED,
+    LOG_EVENT_LINKED,
+    LOG_EVENT_CLONED,
+    LOG_EVENT_CREATED_DIR,
+    LOG_EVENT_IDENTICAL,
+    LOG_EVENT_DEST_NEWER,
+    LOG_EVENT_MESSAGE,
+    LOG_EVENTS_COUNT
+} LogEvent;
+
+/*
+ * Everything bound for stdout is formatted into OutputBuffers and then
+ * queued here. A flusher thread drains the ring with large writes, so
+ * the sync loops only wait on a slow pipe or terminal once a whole ring
+ * of output is backed up behind it. head and tail count bytes ever
+ * queued and written, their difference is what the ring holds.
+ */
+typedef struct {
+    LogLevel level;
+    LogFormat format;
+    boolean isStarted;
+    boolean stopRequested;
+    char* ring;
+    size_t head;
+    size_t tail;
+    pthread_t flusher;
+    pthread_mutex_t lock;
+    pthread_cond_t dataReady;
+    pthread_cond_t spaceReady;
+    unsigned long long counts[LOG_EVENTS_COUNT];
+} Logger;
+
+static Logger logger;
+
+typedef enum {
+    LINK_KEY_INODE,     // source files that are hard links of one another
+    LINK_KEY_CONTENT    // source files of the same size and content hash
+} LinkKeyKind;
+
+/*
+ * The first file of a link group to get synced (its leader) claims the
+ * group and syncs as usual; every other member waits for the claim to
+ * be settled and then links or clones the leader's destination instead
+ * of copying. A leader that did not end up in sync leaves the claim
+ * unusable and the members sync on their own.
+ */
+typedef struct LinkClaim {
+    struct LinkClaim* next;
+    LinkKeyKind kind;
+    uint64_t first;     // device, or size
+    uint64_t second;    // inode, or content hash
+    boolean isSettled;
+    boolean isUsable;
+    char* destPath;
+    dev_t destDevice;
+    ino_t destInode;
+    uint64_t contentHash;   // the leader's, for the manifest
+    boolean hasContentHash;
+} LinkClaim;
+
+// the claims of one run (or one watch resync), shared by every worker and tree node
+typedef struct {
+    LinkClaim* buckets[LINK_TABLE_BUCKETS];
+    Arena arena;
+    pthread_mutex_t lock;
+    pthread_cond_t settled;
+} LinkTable;
+
+static LinkTable linkTable = { .lock = PTHREAD_MUTEX_INITIALIZER, .settled = PTHREAD_COND_INITIALIZER };
+
+/*
+ * One source file on its way through --pipeline. src and dest are views
+ * of the synced directories whose names blob is just this item's name,
+ * so the item carries everything syncEntry needs without a listing.
+ */
+typedef struct {
+    SyncEntry entry;
+    FileData srcFile;
+    FileData destFile;
+    DirData src;
+    DirData dest;
+    SyncContext context;
+    OutputBuffer output;
+    boolean isClassified;   // false sends it to the copy stage for syncEntry to do all of it
+    char name[NAME_MAX + 1];
+} PipelineItem;
+
+// a FIFO of items; it never fills, because no more than PIPELINE_DEPTH items exist in all queues together
+typedef struct {
+    PipelineItem* items[PIPELINE_DEPTH];
+    int head;
+    int count;
+    int producersCount;     // the queue is drained for good once every producer closed it
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+} PipelineQueue;
+
+typedef struct {
+    const SyncOptions* options;
+    PipelineQueue freeItems;
+    PipelineQueue toCompare;
+    PipelineQueue toCopy;
+} Pipeline;
+
+// a contiguous range of task indices: the owner pops from the front, thieves split off the back
+typedef struct {
+    int begin;
+    int end;
+    pthread_mutex_t lock;
+} TaskDeque;
+
+typedef struct {
+    const SyncContext* context;
+    SyncPlan* plan;
+    OutputBuffer* outputs;
+    boolean* done;
+    TaskDeque* deques;
+    int workersCount;
+    pthread_mutex_t doneLock;
+    pthread_cond_t doneCond;
+} SyncPool;
+
+typedef struct {
+    SyncPool* pool;
+    int id;
+    Arena scratch;
+} SyncWorker;
+
+// one directory of a recursive sync; its fds stay open until every child has opened its own
+typedef struct TreeNode {
+    struct TreeNode* parent;
+    struct TreeNode* next;
+    const char* name;
+    DirData src;
+    DirData dest;
+    OutputBuffer output;
+    struct TreeNode** children;
+    int childrenCount;
+    int unopenedChildren;
+    boolean processed;
+} TreeNode;
+
+// directories waiting to be synced; a stack, so the traversal stays depth-first and few fds are open
+typedef struct {
+    TreeNode* stack;
+    int activeCount;
+    const SyncOptions* options;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} TreeSync;
+
 boolean isDirExists(const char* path);
 char* getDirPath(const char* path);
 char* getDirName(const char* path);
-char* getFullPath(const char* basePath, const char* path);
+char* getFullPath(Arena* arena, const char* basePath, const char* path);
+void* arenaAlloc(Arena* arena, size_t size, size_t alignment);
+void arenaReset(Arena* arena);
+void arenaRelease(Arena* arena);
+const char* fileName(const DirData* dir, const FileData* file);
+unsigned int appendName(NamesBlob* names, const char* name, size_t length);
 void sortFilesLexicographically(DirData* dir);
+void sortFileArray(const char* names, FileData** files, int count);
+void radixSortNames(const char* names, const FileData* files, int* indices, int* scratch, unsigned char* keys, int count, int depth);
+void insertionSortNames(const char* names, const FileData* files, int* indices, int count, int depth);
 void freeDirData(DirData* dir);
-void syncDirs(const DirData* src, const DirData* dest);
-FileData* findFile(const FileData* file, const DirData* dir);
+int openDirectory(const char* path);
+boolean parseArguments(int argc, char** argv, SyncOptions* options, char** srcArg, char** destArg);
+boolean matchValueOption(int argc, char** argv, int* idx, const char* name, const char** value);
+void printUsage();
+void syncDirs(const DirData* src, const DirData* dest, const SyncOptions* options, OutputBuffer* output);
+void syncTrees(const DirData* src, const DirData* dest, const SyncOptions* options);
+void* treeWorkerMain(void* arg);
+void processTreeNode(TreeSync* tree, TreeNode* node);
+boolean openTreeNode(TreeNode* node, Durability durability);
+void releaseTreeParent(TreeSync* tree, TreeNode* node);
+TreeNode* createTreeNode(TreeNode* parent, const char* name);
+void printTreeNode(TreeSync* tree, TreeNode* node);
+void closeTreeNode(TreeNode* node);
+void buildSyncPlan(const DirData* src, const DirData* dest, SyncPlan* plan);
+void mergeSortedListings(const DirData* src, const DirData* dest, SyncPlan* plan);
+void joinIndexedListings(const DirData* src, const DirData* dest, SyncPlan* plan);
+void addSyncEntry(SyncPlan* plan, SyncKind kind, const FileData* srcFile, const FileData* destFile);
+void buildFileIndex(const DirData* dir, FileIndex* index);
+int lookupFile(const FileIndex* index, const DirData* dir, const char* name);
+unsigned int hashName(const char* name);
+void syncEntry(const SyncContext* context, SyncEntry* entry, OutputBuffer* output, Arena* scratch);
+void syncEntryContents(const SyncContext* context, SyncEntry* entry, OutputBuffer* output, Arena* scratch);
+boolean classifyEntry(const SyncContext* context, SyncEntry* entry, OutputBuffer* output, Arena* scratch);
+void transferEntry(const SyncContext* context, SyncEntry* entry, OutputBuffer* output, Arena* scratch);
+void copyEntry(const SyncContext* context, SyncEntry* entry, boolean allowDelta, OutputBuffer* output, uint64_t* contentHash, Arena* scratch);
+LinkClaim* claimLink(LinkTable* table, LinkKeyKind kind, uint64_t first, uint64_t second, boolean* isLeader);
+void settleLinkClaim(LinkTable* table, LinkClaim* claim, const DirData* dest, const char* name, const SyncEntry* entry);
+void resetLinkTable(LinkTable* table);
+boolean linkHardLinkedFile(const SyncContext* context, SyncEntry* entry, const LinkClaim* claim, OutputBuffer* output);
+boolean dedupFile(const SyncContext* context, SyncEntry* entry, LinkClaim** leaderClaim, OutputBuffer* output, uint64_t* contentHash, Arena* scratch);
+boolean materializeDuplicate(const SyncContext* context, const char* name, const LinkClaim* claim, int srcFd, const struct stat* srcStat, Arena* scratch);
+boolean linkIntoPlace(const DirData* dest, const char* targetPath, const char* name);
+void syncDirsParallel(const SyncContext* context, SyncPlan* plan);
+void syncPipelined(const DirData* src, const DirData* dest, const SyncOptions* options);
+void scanIntoPipeline(Pipeline* pipeline, const DirData* src, const DirData* dest);
+void* compareStageMain(void* arg);
+void* copyStageMain(void* arg);
+void initPipelineQueue(PipelineQueue* queue, int producersCount);
+void destroyPipelineQueue(PipelineQueue* queue);
+void pushPipelineItem(PipelineQueue* queue, PipelineItem* item);
+PipelineItem* popPipelineItem(PipelineQueue* queue);
+void closePipelineQueue(PipelineQueue* queue);
+void releasePipelineItem(Pipeline* pipeline, PipelineItem* item);
+void loadManifest(const DirData* dest, Manifest* manifest);
+void unloadManifest(Manifest* manifest);
+const ManifestRecord* findManifestRecord(const Manifest* manifest, const char* name);
+boolean isUnchangedSinceManifest(const ManifestRecord* record, const FileData* srcFile, const FileData* destFile);
+void writeManifest(const SyncContext* context, const SyncPlan* plan);
+int compareManifestRecords(const void* first, const void* second, void* names);
+boolean writeFull(int fd, const void* buffer, size_t size);
+void hashInit(ContentHash* hash);
+uint64_t hashRound(uint64_t accumulator, uint64_t input);
+uint64_t hashMergeRound(uint64_t accumulator, uint64_t lane);
+uint64_t rotateLeft64(uint64_t value, int bits);
+uint64_t readLittleEndian64(const unsigned char* bytes);
+uint32_t readLittleEndian32(const unsigned char* bytes);
+void hashUpdate(ContentHash* hash, const void* data, size_t length);
+uint64_t hashDigest(const ContentHash* hash);
+uint64_t hashFileContents(int fd, Arena* scratch);
+void hashZeros(ContentHash* hash, off_t length);
+void* syncWorkerMain(void* arg);
+boolean popTask(TaskDeque* deque, int* task);
+boolean stealTasks(SyncPool* pool, int thiefId);
+void appendOutput(OutputBuffer* output, const char* format, ...);
+void appendOutputV(OutputBuffer* output, const char* format, va_list args);
+void appendJsonEscaped(OutputBuffer* output, const char* text);
+void flushOutput(OutputBuffer* output);
+void startLogger(LogLevel level, LogFormat format);
+void stopLogger();
+void* loggerFlusherMain(void* arg);
+void logWrite(const char* data, size_t length);
+boolean isLogged(LogEvent event);
+void logFile(OutputBuffer* output, LogEvent event, const char* prefix, const char* name);
+void logTransfer(OutputBuffer* output, LogEvent event, const DirData* src, const DirData* dest, const char* name, long long transferred, long long size);
+void logLink(OutputBuffer* output, LogEvent event, const char* target, const DirData* dest, const char* name, long long size);
+void logMessage(OutputBuffer* output, const char* format, ...);
+void printLogSummary();
 boolean isFirstNewer(const FileData* first, const FileData* second);
+CompareResult compareFileContents(int srcFd, int destFd, ContentHash* hash, Arena* scratch);
+CompareResult compareMappedFiles(int srcFd, int destFd, size_t size, boolean isSparse, ContentHash* hash, Arena* scratch);
+CompareResult compareMappedRange(const char* srcMap, const char* destMap, off_t offset, off_t length, ContentHash* hash);
+CompareResult compareSparseRanges(int srcFd, int destFd, const char* srcMap, const char* destMap, off_t size, ContentHash* hash);
+CompareResult compareBufferedFiles(int srcFd, int destFd, ContentHash* hash, Arena* scratch);
+CompareResult compareSampledFiles(int srcFd, int destFd, Arena* scratch);
+boolean filesDiffer(const SyncContext* context, const SyncEntry* entry, uint64_t* contentHash, Arena* scratch);
+ssize_t readFull(int fd, char* buffer, size_t size);
+boolean copyFileContents(int srcFd, int destFd, const struct stat* srcStat, Arena* scratch);
+CopyResult copyWithReflink(int srcFd, int destFd);
+CopyResult copySparseFile(int srcFd, int destFd, off_t size, off_t* copied, Arena* scratch);
+boolean copyExtent(int srcFd, int destFd, off_t offset, off_t length, Arena* scratch);
+boolean isSparseFile(const struct stat* fileStat);
+off_t seekExtent(int fd, off_t offset, int whence, off_t size);
+CopyResult copyWithFileRange(int srcFd, int destFd, off_t* copied);
+CopyResult copyWithSendfile(int srcFd, int destFd, off_t* copied);
+CopyResult copyWithReadWrite(int srcFd, int destFd, off_t* copied, Arena* scratch);
+boolean isCopyUnsupported(int error);
+void makeTempName(char* tempName);
+int openTempFile(const DirData* dest, mode_t mode, char* tempName);
+boolean commitTempFile(const DirData* dest, int tempFd, const char* tempName, const char* name, boolean isComplete, Durability durability);
+void syncDestDirectory(const DirData* dest, Durability durability);
+void syncDestParent(const DirData* dest, Durability durability);
+void syncDestFilesystem(const DirData* dest, Durability durability);
+boolean deltaTransfer(const DirData* dest, const DirData* src, const FileData* file, Durability durability, OutputBuffer* output, uint64_t* contentHash, Arena* scratch);
+boolean patchMappedFile(const DirData* dest, const char* name, int srcFd, int destFd, const struct stat* srcStat, const unsigned char* srcData, const unsigned char* destData, off_t destSize, Durability durability, DeltaPlan* plan);
+void buildDeltaSignature(const unsigned char* data, off_t size, DeltaSignature* signature);
+void buildDeltaPlan(const DeltaSignature* signature, const unsigned char* srcData, off_t srcSize, const unsigned char* destData, off_t destSize, DeltaPlan* plan);
+int findMatchingBlock(const DeltaSignature* signature, uint32_t weak, const unsigned char* window, off_t position);
+void addDeltaOp(DeltaPlan* plan, off_t srcOffset, off_t destOffset, off_t length);
+boolean applyDeltaToTempFile(const DeltaPlan* plan, int srcFd, int destFd, int tempFd, const struct stat* srcStat, const unsigned char* srcData, const unsigned char* destData);
+boolean applyDeltaOp(const DeltaOp* op, off_t start, off_t end, int srcFd, int destFd, int tempFd, const unsigned char* srcData, const unsigned char* destData);
+boolean copyRange(int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length, const unsigned char* fallbackData);
+void rollingInit(RollingChecksum* checksum, const unsigned char* data, size_t length);
+void rollingRotate(RollingChecksum* checksum, unsigned char outByte, unsigned char inByte);
+uint32_t rollingDigest(const RollingChecksum* checksum);
+unsigned int weakBucket(uint32_t weak, int bits);
+uint64_t hashBlock(const void* data, size_t length);
+void syncDirsWithRing(const SyncContext* context, SyncPlan* plan, IoRing* ring, OutputBuffer* output);
+void prepareRingTask(const SyncContext* context, SyncEntry* entry, RingTask* task);
+void runRingBatch(const SyncContext* context, IoRing* ring, RingTask* tasks, int count, Arena* scratch);
+void finishRingTask(const SyncContext* context, RingTask* task, OutputBuffer* output, Arena* scratch);
+boolean ioRingInit(IoRing* ring, unsigned int entries);
+boolean ioRingSupportsOps(int ringFd);
+void watchDirs(DirData* src, DirData* dest, const SyncOptions* options);
+boolean readWatchEvents(int inotifyFd, DirtySet* dirty, boolean* rescanAll);
+void resyncDirtyFiles(DirData* src, DirData* dest, const SyncOptions* options, DirtySet* dirty);
+void rescanDirs(DirData* src, DirData* dest, const SyncOptions* options);
+void refreshDirEntry(DirData* dir, const char* name);
+int findSortedFile(const DirData* dir, const char* name, boolean* found);
+void compactNames(DirData* dir);
+long long monotonicMillis();
+void requestWatchStop(int signal);
+void initRunStats(RunStats* stats, boolean enabled, int intervalSeconds);
+void finishRunStats(RunStats* stats);
+void beginPhase(RunStats* stats);
+void endPhase(RunStats* stats, Phase phase);
+void sampleCounters(PhaseStats* sample);
+void* statsReporterMain(void* arg);
+long long statsClock();
+void countStat(unsigned long long* counter, unsigned long long amount);
+void recordLatency(LatencyHistogram* histogram, long long startNs);
+void printRunStats(RunStats* stats, boolean isFinal);
+void appendHistogram(OutputBuffer* output, const char* name, LatencyHistogram* histogram);
+void ioRingDestroy(IoRing* ring);
+struct io_uring_sqe* ioRingNext(IoRing* ring, unsigned char opcode, int fd, int* result);
+void ioRingWait(IoRing* ring);
 
 void __DEBUG_print_files_data(const DirData dir, const char* message);
 
 void __strcpy(char* dest, const char* src, int copy_size);
 char* __pwd();
-FileData*__ls(const char* cwd, int* length);
+void __ls(DirData* dir, boolean withSubdirs, boolean isSource);
+FileData* appendFileData(FileData** files, int* count, int* capacity);
+boolean isReservedName(const char* name);
+boolean isSkippedName(const DirData* dir, const char* name, boolean isSource);
+void setFileStat(FileData* file, const struct statx* entryStat);
+boolean statEntry(int dirFd, const char* name, struct statx* entryStat);
 void __mkdir(const char* dirName);
 void __cd(const char* path);
-boolean __diff(const DirData* dest, const DirData* src, const FileData* file);
-void __cp(const DirData* dest, const DirData* src, const FileData* file);
+boolean __diff(const DirData* dest, const DirData* src, const FileData* file, ComparePolicy policy, uint64_t* contentHash, Arena* scratch);
+void __cp(const DirData* dest, const DirData* src, const FileData* file, Durability durability, OutputBuffer* output, Arena* scratch);
 
+#ifndef FILE_SYNC_NO_MAIN
 int main(int argc, char** argv)
 {
-    DirData src;
-    DirData dest;
+    DirData src = { 0 };
+    DirData dest = { 0 };
 
     char* srcDirPath = NULL;
     char* destDirPath = NULL;
     char* srcDirName = NULL;
     char* destDirName = NULL;
 
+    char* srcArg = NULL;
+    char* destArg = NULL;
+    SyncOptions options;
+
     char* cwd = NULL;
+    boolean isDestCreated = false;
 
     cwd = __pwd();
-    printf("Current working directory: %s\n", cwd);
 
-    if (argc != 3)
+    if (!parseArguments(argc, argv, &options, &srcArg, &destArg))
     {
-        printf("Usage: file_sync <source_directory> <destination_directory>\n");
+        printf("Current working directory: %s\n", cwd);
+        printUsage();
         exit(EXIT_FAILURE);
     }
 
-    srcDirName = getDirName(argv[1]);
-    destDirName = getDirName(argv[2]);
+    startLogger(options.logLevel, options.logFormat);
+    logMessage(NULL, "Current working directory: %s\n", cwd);
+
+    initRunStats(&runStats, options.printStats, options.statsInterval);
 
-    srcDirPath = getDirPath(argv[1]);
-    destDirPath = getDirPath(argv[2]);
+    srcDirName = getDirName(srcArg);
+    destDirName = getDirName(destArg);
+
+    srcDirPath = getDirPath(srcArg);
+    destDirPath = getDirPath(destArg);
 
     if (srcDirPath != NULL)
         __cd(srcDirPath);
     free(cwd);
     cwd = __pwd();
-    src.path = getFullPath(cwd, srcDirName);
+    src.path = getFullPath(&src.arena, cwd, srcDirName);
 
     if (destDirPath != NULL)
         __cd(destDirPath);
     free(cwd);
     cwd = __pwd();
-    dest.path = getFullPath(cwd, destDirName);
+    dest.path = getFullPath(&dest.arena, cwd, destDirName);
 
-    if (!isDirExists(argv[1]))
+    if (!isDirExists(srcArg))
     {
-        printf("Error: Source directory '%s' does not exist.\n", srcDirName);
+        logMessage(NULL, "Error: Source directory '%s' does not exist.\n", srcDirName);
         exit(EXIT_FAILURE);
     }
-    if (!isDirExists(argv[2]))
-        __mkdir(argv[2]);
+    if (!isDirExists(destArg))
+    {
+        __mkdir(destArg);
+        isDestCreated = true;
+    }
 
-    printf("Synchronizing from %s to %s\n", src.path, dest.path);
+    logMessage(NULL, "Synchronizing from %s to %s\n", src.path, dest.path);
 
-    __cd(src.path);
-    free(cwd);
-    cwd = __pwd();
-    src.files =__ls(cwd, &src.filesCount);
+    src.fd = openDirectory(src.path);
+    dest.fd = openDirectory(dest.path);
+    if (isDestCreated) syncDestParent(&dest, options.durability);
 
-    __cd(dest.path);
-    free(cwd);
-    cwd = __pwd();
-    dest.files = __ls(cwd, &dest.filesCount);
+    if (options.recursive)
+    {
+        // listing, sorting and syncing interleave across the tree, so it all counts as the sync phase
+        beginPhase(&runStats);
+        syncTrees(&src, &dest, &options);
+        syncDestFilesystem(&dest, options.durability);
+        resetLinkTable(&linkTable);
+        endPhase(&runStats, PHASE_SYNC);
+    }
+    else if (options.pipeline)
+    {
+        // the same goes for the stages of the pipeline
+        beginPhase(&runStats);
+        syncPipelined(&src, &dest, &options);
+        syncDestFilesystem(&dest, options.durability);
+        resetLinkTable(&linkTable);
+        endPhase(&runStats, PHASE_SYNC);
+    }
+    else
+    {
+        beginPhase(&runStats);
+        __ls(&src, false, true);
+        __ls(&dest, false, false);
+        endPhase(&runStats, PHASE_LS);
+
+        beginPhase(&runStats);
+        sortFilesLexicographically(&src);
+        sortFilesLexicographically(&dest);
+        endPhase(&runStats, PHASE_SORT);
+
+        beginPhase(&runStats);
+        syncDirs(&src, &dest, &options, NULL);
+        syncDestFilesystem(&dest, options.durability);
+        resetLinkTable(&linkTable);
+        endPhase(&runStats, PHASE_SYNC);
 
-    sortFilesLexicographically(&src);
-    sortFilesLexicographically(&dest);
+        if (options.watch)
+            watchDirs(&src, &dest, &options);
+    }
+
+    logMessage(NULL, "Synchronization complete.\n");
+    if (options.logLevel == LOG_LEVEL_SUMMARY || options.logFormat == LOG_FORMAT_JSONL)
+        printLogSummary();
+    stopLogger();
 
-    syncDirs(&src, &dest);
+    if (options.printStats)
+    {
+        finishRunStats(&runStats);
+        printRunStats(&runStats, true);
+    }
 
-    printf("Synchronization complete.\n");
+    close(src.fd);
+    close(dest.fd);
 
     free(srcDirName);
     free(destDirName);
@@ -125,6 +888,208 @@ int main(int argc, char** argv)
     freeDirData(&src);
     freeDirData(&dest);
 }
+#endif
+
+boolean parseArguments(int argc, char** argv, SyncOptions* options, char** srcArg, char** destArg)
+{
+    int positionalCount = 0;
+
+    options->jobs = 1;
+    options->useManifest = false;
+    options->recursive = false;
+    options->useDelta = false;
+    options->useIoUring = false;
+    options->watch = false;
+    options->comparePolicy = COMPARE_POLICY_FULL;
+    options->printStats = false;
+    options->statsInterval = 0;
+    options->logLevel = LOG_LEVEL_FULL;
+    options->logFormat = LOG_FORMAT_TEXT;
+    options->durability = DURABILITY_NONE;
+    options->preserveHardLinks = false;
+    options->dedupMode = DEDUP_NONE;
+    options->pipeline = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char* value = NULL;
+        char* end = NULL;
+
+        if (strcmp(argv[i], "--manifest") == 0)
+        {
+            options->useManifest = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--recursive") == 0)
+        {
+            options->recursive = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--delta") == 0)
+        {
+            options->useDelta = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--io-uring") == 0)
+        {
+            options->useIoUring = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--watch") == 0)
+        {
+            options->watch = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--pipeline") == 0)
+        {
+            options->pipeline = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--hard-links") == 0)
+        {
+            options->preserveHardLinks = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--stats") == 0)
+        {
+            options->printStats = true;
+            continue;
+        }
+
+        if (matchValueOption(argc, argv, &i, "--compare", &value))
+        {
+            if (value == NULL) return false;
+            if (strcmp(value, "metadata") == 0) options->comparePolicy = COMPARE_POLICY_METADATA;
+            else if (strcmp(value, "fast") == 0) options->comparePolicy = COMPARE_POLICY_FAST;
+            else if (strcmp(value, "full") == 0) options->comparePolicy = COMPARE_POLICY_FULL;
+            else return false;
+            continue;
+        }
+
+        if (matchValueOption(argc, argv, &i, "--stats-interval", &value))
+        {
+            if (value == NULL) return false;
+            options->statsInterval = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || options->statsInterval < 1) return false;
+            options->printStats = true;
+            continue;
+        }
+
+        if (matchValueOption(argc, argv, &i, "--log-level", &value))
+        {
+            if (value == NULL) return false;
+            if (strcmp(value, "summary") == 0) options->logLevel = LOG_LEVEL_SUMMARY;
+            else if (strcmp(value, "changes") == 0) options->logLevel = LOG_LEVEL_CHANGES;
+            else if (strcmp(value, "full") == 0) options->logLevel = LOG_LEVEL_FULL;
+            else return false;
+            continue;
+        }
+
+        if (matchValueOption(argc, argv, &i, "--log-format", &value))
+        {
+            if (value == NULL) return false;
+            if (strcmp(value, "text") == 0) options->logFormat = LOG_FORMAT_TEXT;
+            else if (strcmp(value, "jsonl") == 0) options->logFormat = LOG_FORMAT_JSONL;
+            else return false;
+            continue;
+        }
+
+        if (matchValueOption(argc, argv, &i, "--durability", &value))
+        {
+            if (value == NULL) return false;
+            if (strcmp(value, "none") == 0) options->durability = DURABILITY_NONE;
+            else if (strcmp(value, "file") == 0) options->durability = DURABILITY_FILE;
+            else if (strcmp(value, "batch") == 0) options->durability = DURABILITY_BATCH;
+            else return false;
+            continue;
+        }
+
+        if (matchValueOption(argc, argv, &i, "--dedup", &value))
+        {
+            if (value == NULL) return false;
+            if (strcmp(value, "reflink") == 0) options->dedupMode = DEDUP_REFLINK;
+            else if (strcmp(value, "link") == 0) options->dedupMode = DEDUP_LINK;
+            else return false;
+            continue;
+        }
+
+        if (matchValueOption(argc, argv, &i, "--jobs", &value))
+        {
+            if (value == NULL) return false;
+            options->jobs = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || options->jobs < 1) return false;
+            continue;
+        }
+
+        if (strncmp(argv[i], "--", 2) == 0) return false;
+
+        if (positionalCount == 0) *srcArg = argv[i];
+        else if (positionalCount == 1) *destArg = argv[i];
+        positionalCount++;
+    }
+
+    // watching a whole tree needs a watch per directory, which is not there yet
+    if (options->watch && options->recursive) return false;
+
+    // the pipeline never holds a full listing, which the manifest, the ring batches and --watch all build on
+    if (options->pipeline && (options->recursive || options->watch || options->useManifest || options->useIoUring))
+        return false;
+
+    return positionalCount == 2;
+}
+
+// accepts both "--name value" and "--name=value"; value is NULL when it is missing
+boolean matchValueOption(int argc, char** argv, int* idx, const char* name, const char** value)
+{
+    size_t nameLength = strlen(name);
+    const char* arg = argv[*idx];
+
+    if (strncmp(arg, name, nameLength) != 0) return false;
+
+    if (arg[nameLength] == '=')
+        *value = arg + nameLength + 1;
+    else if (arg[nameLength] == '\0')
+        *value = *idx + 1 < argc ? argv[++*idx] : NULL;
+    else
+        return false;
+
+    return true;
+}
+
+void printUsage()
+{
+    printf("Usage: file_sync <source_directory> <destination_directory>\n");
+    printf("Options:\n");
+    printf("  --compare P   check files of equal size by metadata (mtime), fast (head and tail) or full (default)\n");
+    printf("  --jobs N      compare and copy up to N files (or directories with --recursive) in parallel\n");
+    printf("  --manifest    remember synced files in the destination and skip them while unchanged\n");
+    printf("  --recursive   synchronize subdirectories too\n");
+    printf("  --delta       rewrite only the changed blocks of large files the destination already has\n");
+    printf("  --io-uring    batch the opens, reads and writes of small files through io_uring\n");
+    printf("  --pipeline    list, compare and copy concurrently in constant memory; the log follows directory\n");
+    printf("                order instead of name order (not with --recursive, --watch, --manifest or --io-uring)\n");
+    printf("  --hard-links  recreate files that are hard links of each other in the source as hard links\n");
+    printf("  --dedup M     copy each distinct content once, then reflink (a separate file sharing its blocks)\n");
+    printf("                or link (a hard link, sharing mode and mtime too) the other files with the same bytes\n");
+    printf("  --durability D\n");
+    printf("                none (default), file (fdatasync every copied file) or batch (one syncfs per run)\n");
+    printf("  --watch       keep running and resync files as they change in the source (not with --recursive)\n");
+    printf("  --stats       print phase timings, syscall and byte counts, fast path hits and compare/copy\n");
+    printf("                latency histograms as one line of JSON on stderr at exit\n");
+    printf("  --stats-interval N\n");
+    printf("                like --stats, plus an interim line every N seconds\n");
+    printf("  --log-level L summary (messages and a closing count), changes (plus what was copied or created)\n");
+    printf("                or full (plus the files left alone, default)\n");
+    printf("  --log-format F\n");
+    printf("                text (default) or jsonl, one JSON object per event ending with a summary\n");
+}
 
 boolean isDirExists(const char* path)
 {
@@ -145,7 +1110,7 @@ char* getDirPath(const char* path)
         if (path[lastSlashIdx] == '/')
             break;
     }
-    if (lastSlashIdx == -1) return NULL;
+    if (lastSlashIdx < 0) return NULL;
     dirPath = (char*)malloc((lastSlashIdx + 1) * sizeof(char));
     __strcpy(dirPath, path, lastSlashIdx);
 
@@ -177,33 +1142,17 @@ char* getDirName(const char* path)
 
 void __mkdir(const char* dirName)
 {
-    int status = 0;
-    pid_t pid = fork();
+    OutputBuffer output = { NULL, 0, 0 };
 
-    switch (pid)
+    if (mkdir(dirName, 0777) == -1)
     {
-        case -1:
-            perror("fork failed");
-            exit(EXIT_FAILURE);
-        case 0:
-            execlp("/usr/bin/mkdir", "mkdir", dirName, NULL);
-
-            perror("Failed to create dir");
-            exit(EXIT_FAILURE);
-        default:
-            waitpid(pid, &status, 0);
-            if (WIFEXITED(status))
-            {
-                int exit_status = WEXITSTATUS(status);
-                if (exit_status == EXIT_SUCCESS)
-                    printf("Created destination directory '%s'.\n", dirName);
-                else
-                {
-                    perror("mkdir failed");
-                    exit(EXIT_FAILURE);
-                }
-            }
+        perror("mkdir failed");
+        exit(EXIT_FAILURE);
     }
+
+    logFile(&output, LOG_EVENT_CREATED_DIR, "", dirName);
+    flushOutput(&output);
+    free(output.data);
 }
 
 char* __pwd()
@@ -234,288 +1183,4366 @@ void __cd(const char* path)
     }
 }
 
-char* getFullPath(const char* basePath, const char* path)
+char* getFullPath(Arena* arena, const char* basePath, const char* path)
 {
-    char* fullPath = (char*)malloc((strlen(basePath) + strlen(path) + 2) * sizeof(char));
-    if (fullPath == NULL)
-    {
-        perror("malloc failed");
-        exit(EXIT_FAILURE);
-    }
+    size_t baseLength = strlen(basePath);
+    size_t pathLength = strlen(path);
+    char* fullPath = (char*)arenaAlloc(arena, baseLength + pathLength + 2, 1);
 
-    strcpy(fullPath, basePath);
-    strcat(fullPath, "/");
-    strcat(fullPath, path);
+    memcpy(fullPath, basePath, baseLength);
+    fullPath[baseLength] = '/';
+    memcpy(fullPath + baseLength + 1, path, pathLength + 1);
 
     return fullPath;
 }
 
-FileData* __ls(const char* cwd, int* length)
+void* arenaAlloc(Arena* arena, size_t size, size_t alignment)
 {
-    DIR* dir = NULL;
-    struct dirent *entry = NULL;
-    char* filePath = NULL;
-    FileData* filesData = NULL;
-    int filesCount = 0;
-
-    struct stat fileStat;
-    dir = opendir(cwd);
-    if (dir == NULL)
-    {
-        perror("opendir failed");
-        exit(EXIT_FAILURE);
-    }
+    ArenaBlock* block = arena->current;
 
+    size_t capacity = 0;
 
-    while ((entry = readdir(dir)) != NULL)
+    while (block != NULL)
     {
-        char* fileName = NULL;
-
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-
-        filePath = getFullPath(cwd, entry->d_name);
-        if (stat(filePath, &fileStat) == -1) {
-            perror("stat to read file data failed");
-            continue;
-        }
+        uintptr_t cursor = (uintptr_t)(block->data + block->used);
+        char* start = (char*)((cursor + alignment - 1) & ~(uintptr_t)(alignment - 1));
 
-        if (S_ISDIR(fileStat.st_mode)) continue;
-        
-        filesCount++;
-        filesData = (FileData*)realloc(filesData, filesCount * sizeof(FileData));
-        if (filesData == NULL)
+        if (start + size <= block->data + block->capacity)
         {
-            perror("Realloc failed");
-            exit(EXIT_FAILURE);
+            block->used = start + size - block->data;
+            arena->current = block;
+            return start;
         }
+        block = block->next;
+    }
 
-        fileName = (char*)malloc(strlen(entry->d_name) * sizeof(char));
-        if (fileName == NULL)
-        {
-            perror("Malloc failed");
-            exit(EXIT_FAILURE);
-        }
-        strcpy(fileName, entry->d_name);
+    capacity = size + alignment > ARENA_BLOCK_SIZE ? size + alignment : ARENA_BLOCK_SIZE;
+    block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + capacity);
+    if (block == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    block->used = 0;
+    block->capacity = capacity;
 
-        filesData[filesCount - 1] = (FileData)
-        {
-            fileName,
-            fileStat.st_mtim
-        };
+    // new blocks go right after the current one, so a reset walks them in the same order again
+    if (arena->current == NULL)
+    {
+        block->next = arena->head;
+        arena->head = block;
+    }
+    else
+    {
+        block->next = arena->current->next;
+        arena->current->next = block;
     }
+    arena->current = block;
 
-    closedir(dir);
+    return arenaAlloc(arena, size, alignment);
+}
 
-    *length = filesCount;
-    return filesData;
+void arenaReset(Arena* arena)
+{
+    for (ArenaBlock* block = arena->head; block != NULL; block = block->next)
+        block->used = 0;
+    arena->current = arena->head;
 }
 
-void sortFilesLexicographically(DirData* dir)
+void arenaRelease(Arena* arena)
 {
-    FileData temp;
-    char* name1 = NULL;
-    char* name2 = NULL;
+    ArenaBlock* block = arena->head;
 
-    for (int i = 0; i < dir->filesCount - 1; i++)
+    while (block != NULL)
     {
-        name1 = dir->files[i].name;
-        name2 = dir->files[i + 1].name;
-
-        if (strcmp(name1, name2) <= 0) continue;
-        temp = dir->files[i + 1];
-        dir->files[i + 1] = dir->files[i];
-        dir->files[i] = temp;
-        i = -1; // start over
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
     }
+    arena->head = NULL;
+    arena->current = NULL;
 }
 
-void freeDirData(DirData* dir)
+const char* fileName(const DirData* dir, const FileData* file)
 {
-    for (int i = 0; i < dir->filesCount; i++)
-    {
-        free(dir->files[i].name);
-    }
-    free(dir->files);
-    free(dir->path);
+    return dir->names.data + file->nameOffset;
 }
 
-void __DEBUG_print_files_data(const DirData dir, const char* message)
+unsigned int appendName(NamesBlob* names, const char* name, size_t length)
 {
-    if (message != NULL)
-        printf("%s\n", message);
-
-    printf("Reading %d files from path: %s\n", dir.filesCount, dir.path);
+    unsigned int offset = names->length;
 
-    for (int i = 0; i < dir.filesCount; i++)
+    if (names->length + length + 1 > names->capacity)
     {
-        printf("%s\n", dir.files[i].name);
-        printf("%ld\n", dir.files[i].lastModified.tv_sec);
-        printf("======================================\n");
+        size_t capacity = names->capacity ? names->capacity : NAMES_INITIAL_CAPACITY;
+        while (names->length + length + 1 > capacity) capacity *= 2;
+
+        names->data = (char*)realloc(names->data, capacity);
+        if (names->data == NULL)
+        {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        names->capacity = capacity;
     }
+
+    memcpy(names->data + names->length, name, length + 1);
+    names->length += length + 1;
+
+    return offset;
 }
 
-void syncDirs(const DirData* src, const DirData* dest)
+int openDirectory(const char* path)
 {
-    for (int i = 0; i < src->filesCount; i++)
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1)
     {
-        FileData* currentFile = &src->files[i];
-        FileData* correspondingDestFile = NULL;
+        perror("opendir failed");
+        exit(EXIT_FAILURE);
+    }
 
-        if ((correspondingDestFile = findFile(currentFile, dest)) == NULL)
-        {
-            printf("New file found: %s\n", currentFile->name);
-            __cp(dest, src, currentFile);
-            continue;
-        }
-        else
+    return fd;
+}
+
+/*
+ * Reads dir->fd in large getdents64 batches. Entries whose d_type already
+ * says "directory" need no stat: they are dropped, or collected into
+ * dir->subdirs when withSubdirs is set. Everything else is statx'ed
+ * relative to the directory fd for just its type, size, mtime and inode.
+ */
+void __ls(DirData* dir, boolean withSubdirs, boolean isSource)
+{
+    int dirFd = dir->fd;
+    char* buffer = NULL;
+    ssize_t bufferLength = 0;
+    FileData* filesData = NULL;
+    int filesCount = 0;
+    int filesCapacity = 0;
+    FileData* subdirs = NULL;
+    int subdirsCount = 0;
+    int subdirsCapacity = 0;
+
+    if (lseek(dirFd, 0, SEEK_SET) == -1)
+    {
+        perror("rewinddir failed");
+        exit(EXIT_FAILURE);
+    }
+
+    buffer = (char*)malloc(DIRENT_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    while ((bufferLength = syscall(SYS_getdents64, dirFd, buffer, DIRENT_BUFFER_SIZE)) > 0)
+    {
+        for (ssize_t offset = 0; offset < bufferLength;)
         {
-            if (__diff(dest, src, currentFile))
+            LinuxDirent64* entry = (LinuxDirent64*)(buffer + offset);
+            struct statx entryStat;
+            FileData* file = NULL;
+            size_t nameLength = 0;
+
+            offset += entry->d_reclen;
+
+            if (isSkippedName(dir, entry->d_name, isSource)) continue;
+
+            nameLength = strlen(entry->d_name);
+
+            if (entry->d_type == DT_DIR)
             {
-                if (isFirstNewer(currentFile, correspondingDestFile))
-                {
-                    __cp(dest, src, currentFile);
-                    printf("File %s is newer in source. Updating...\n", currentFile->name);
-                    continue;
-                }
-                else
+                if (withSubdirs)
                 {
-                    printf("File %s is newer in destination. Skipping...\n", currentFile->name);
-                    continue;
+                    *appendFileData(&subdirs, &subdirsCount, &subdirsCapacity) = (FileData)
+                    {
+                        appendName(&dir->names, entry->d_name, nameLength),
+                        nameLength
+                    };
                 }
+                continue;
             }
-            else
+
+            if (!statEntry(dirFd, entry->d_name, &entryStat))
+            {
+                perror("stat to read file data failed");
+                continue;
+            }
+
+            // DT_UNKNOWN and symlinks only reveal what they are after the stat; symlinked directories are never descended into
+            if (S_ISDIR(entryStat.stx_mode))
             {
-                printf("File %s is identical. Skipping...\n", currentFile->name);
+                if (withSubdirs && entry->d_type == DT_UNKNOWN)
+                {
+                    *appendFileData(&subdirs, &subdirsCount, &subdirsCapacity) = (FileData)
+                    {
+                        appendName(&dir->names, entry->d_name, nameLength),
+                        nameLength
+                    };
+                }
                 continue;
             }
+
+            file = appendFileData(&filesData, &filesCount, &filesCapacity);
+            file->nameOffset = appendName(&dir->names, entry->d_name, nameLength);
+            file->nameLength = nameLength;
+            setFileStat(file, &entryStat);
         }
     }
+
+    if (bufferLength == -1)
+    {
+        perror("getdents64 failed");
+        exit(EXIT_FAILURE);
+    }
+
+    free(buffer);
+
+    dir->files = filesData;
+    dir->filesCount = filesCount;
+    dir->subdirs = subdirs;
+    dir->subdirsCount = subdirsCount;
+    dir->isSorted = false;
 }
 
-FileData* findFile(const FileData* file, const DirData* dir)
+FileData* appendFileData(FileData** files, int* count, int* capacity)
 {
-    for (int i = 0; i < dir->filesCount; i++)
+    if (*count == *capacity)
     {
-        if (strcmp(file->name, dir->files[i].name) == 0) return &dir->files[i];
+        *capacity = *capacity ? *capacity * 2 : FILES_INITIAL_CAPACITY;
+        *files = (FileData*)realloc(*files, *capacity * sizeof(FileData));
+        if (*files == NULL)
+        {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
     }
-    return NULL;
+
+    return &(*files)[(*count)++];
+}
+
+// the files file_sync keeps in the destination for itself
+boolean isReservedName(const char* name)
+{
+    if (strcmp(name, MANIFEST_FILE_NAME) == 0 || strcmp(name, MANIFEST_TEMP_FILE_NAME) == 0) return true;
+
+    return strncmp(name, TEMP_FILE_PREFIX, sizeof(TEMP_FILE_PREFIX) - 1) == 0;
+}
+
+/*
+ * . and .. are always skipped. A reserved name is ours in the destination,
+ * but in the source it is user data that cannot be synced without
+ * clobbering the manifest or a temp file, so it is reported, not dropped silently.
+ */
+boolean isSkippedName(const DirData* dir, const char* name, boolean isSource)
+{
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return true;
+    if (!isReservedName(name)) return false;
+
+    if (isSource)
+    {
+        logMessage(NULL, "File %s%s has a name reserved by file_sync. Skipping...\n",
+                   dir->relativePath != NULL ? dir->relativePath : "", name);
+    }
+    return true;
 }
 
-boolean __diff(const DirData* dest, const DirData* src, const FileData* file)
+void setFileStat(FileData* file, const struct statx* entryStat)
 {
-    int null_fd = -1;
+    file->lastModified.tv_sec = entryStat->stx_mtime.tv_sec;
+    file->lastModified.tv_nsec = entryStat->stx_mtime.tv_nsec;
+    file->size = entryStat->stx_size;
+    file->inode = entryStat->stx_ino;
+    file->device = makedev(entryStat->stx_dev_major, entryStat->stx_dev_minor);
+    file->linksCount = entryStat->stx_nlink;
+}
+
+boolean statEntry(int dirFd, const char* name, struct statx* entryStat)
+{
+    struct stat fallbackStat;
+
+    if (statx(dirFd, name, AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO | STATX_NLINK, entryStat) == 0)
+        return true;
+    if (errno != ENOSYS) return false;
+
+    // kernels older than 4.11 have no statx
+    if (fstatat(dirFd, name, &fallbackStat, 0) == -1) return false;
 
-    char* srcFileFullPath = NULL;
-    char* destFileFullPath = NULL;
+    entryStat->stx_mode = fallbackStat.st_mode;
+    entryStat->stx_size = fallbackStat.st_size;
+    entryStat->stx_ino = fallbackStat.st_ino;
+    entryStat->stx_nlink = fallbackStat.st_nlink;
+    entryStat->stx_dev_major = major(fallbackStat.st_dev);
+    entryStat->stx_dev_minor = minor(fallbackStat.st_dev);
+    entryStat->stx_mtime.tv_sec = fallbackStat.st_mtim.tv_sec;
+    entryStat->stx_mtime.tv_nsec = fallbackStat.st_mtim.tv_nsec;
+
+    return true;
+}
 
-    int status = 0;
-    pid_t pid = -1;
+/*
+ * MSD radix sort over an index array, one byte of the name per level.
+ * Bytes are bucketed as unsigned char, which is exactly the order strcmp
+ * defines, and the end of a name (byte 0) sorts before everything else.
+ * Small buckets fall back to insertion sort on the remaining suffixes.
+ */
+void sortFilesLexicographically(DirData* dir)
+{
+    sortFileArray(dir->names.data, &dir->files, dir->filesCount);
+    sortFileArray(dir->names.data, &dir->subdirs, dir->subdirsCount);
+    dir->isSorted = true;
+}
 
-    srcFileFullPath = getFullPath(src->path, file->name);
-    destFileFullPath = getFullPath(dest->path, file->name);
+void sortFileArray(const char* names, FileData** files, int count)
+{
+    int* indices = NULL;
+    int* scratch = NULL;
+    unsigned char* keys = NULL;
+    FileData* sorted = NULL;
 
-    pid = fork();
+    if (count < 2) return;
 
-    switch (pid)
+    indices = (int*)malloc(count * sizeof(int));
+    scratch = (int*)malloc(count * sizeof(int));
+    keys = (unsigned char*)malloc(count * sizeof(unsigned char));
+    sorted = (FileData*)malloc(count * sizeof(FileData));
+    if (indices == NULL || scratch == NULL || keys == NULL || sorted == NULL)
     {
-        case -1:
-            perror("fork failed");
-            exit(EXIT_FAILURE);
-        case 0:
-            null_fd = open("/dev/null", O_WRONLY);
-            dup2(null_fd, STDOUT_FILENO);
-            close(null_fd);
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
 
-            execlp("/usr/bin/diff", "diff", "-q", srcFileFullPath, destFileFullPath, NULL);
+    for (int i = 0; i < count; i++) indices[i] = i;
 
-            perror("failed to get diffs");
-            exit(EXIT_FAILURE);
-        default:
-            waitpid(pid, &status, 0);
-            if (WIFEXITED(status))
-            {
-                int exit_status = WEXITSTATUS(status);
-                switch (exit_status)
-                {
-                    case 0:
-                        return false;
-                    case 1:
-                        return true;
-                    case 2:
-                    default:
-                        perror("diff failed");
-                        exit(EXIT_FAILURE);
-                }
-            }
+    radixSortNames(names, *files, indices, scratch, keys, count, 0);
+
+    for (int i = 0; i < count; i++) sorted[i] = (*files)[indices[i]];
+
+    free(*files);
+    *files = sorted;
+
+    free(indices);
+    free(scratch);
+    free(keys);
+}
+
+void radixSortNames(const char* names, const FileData* files, int* indices, int* scratch, unsigned char* keys, int count, int depth)
+{
+    int bucketStart[RADIX_BUCKETS + 1];
+    int bucketFill[RADIX_BUCKETS];
+    int counts[RADIX_BUCKETS] = { 0 };
+
+    if (count <= RADIX_SORT_CUTOFF)
+    {
+        insertionSortNames(names, files, indices, count, depth);
+        return;
+    }
+
+    // one pass over the names to pull out this level's byte, then work on the dense key array
+    for (int i = 0; i < count; i++)
+    {
+        const FileData* file = &files[indices[i]];
+        keys[i] = depth < (int)file->nameLength
+            ? (unsigned char)names[file->nameOffset + depth]
+            : 0;
+        counts[keys[i]]++;
+    }
+
+    bucketStart[0] = 0;
+    for (int b = 0; b < RADIX_BUCKETS; b++)
+    {
+        bucketStart[b + 1] = bucketStart[b] + counts[b];
+        bucketFill[b] = bucketStart[b];
+    }
+
+    for (int i = 0; i < count; i++)
+        scratch[bucketFill[keys[i]]++] = indices[i];
+    memcpy(indices, scratch, count * sizeof(int));
+
+    // bucket 0 holds names that end here, they are all equal and already in place
+    for (int b = 1; b < RADIX_BUCKETS; b++)
+    {
+        int bucketSize = bucketStart[b + 1] - bucketStart[b];
+        if (bucketSize > 1)
+            radixSortNames(names, files, indices + bucketStart[b], scratch, keys, bucketSize, depth + 1);
     }
-    perror("unexpected error");
-    exit(EXIT_FAILURE);
 }
 
-boolean isFirstNewer(const FileData* first, const FileData* second)
+void insertionSortNames(const char* names, const FileData* files, int* indices, int count, int depth)
 {
-    if (first->lastModified.tv_sec < second->lastModified.tv_sec) return false;
-    else if (first->lastModified.tv_sec == second->lastModified.tv_sec)
+    for (int i = 1; i < count; i++)
     {
-        if (first->lastModified.tv_nsec < second->lastModified.tv_nsec) return false;
+        int current = indices[i];
+        const char* name = names + files[current].nameOffset + depth;
+        int j = i - 1;
 
+        while (j >= 0 && strcmp(names + files[indices[j]].nameOffset + depth, name) > 0)
+        {
+            indices[j + 1] = indices[j];
+            j--;
+        }
+        indices[j + 1] = current;
+    }
+}
+
+void freeDirData(DirData* dir)
+{
+    free(dir->files);
+    free(dir->subdirs);
+    free(dir->names.data);
+    arenaRelease(&dir->arena);
+}
+
+void __DEBUG_print_files_data(const DirData dir, const char* message)
+{
+    if (message != NULL)
+        printf("%s\n", message);
+
+    printf("Reading %d files from path: %s\n", dir.filesCount, dir.path);
+
+    for (int i = 0; i < dir.filesCount; i++)
+    {
+        printf("%s\n", fileName(&dir, &dir.files[i]));
+        printf("%ld\n", dir.files[i].lastModified.tv_sec);
+        printf("======================================\n");
     }
-    return true;
 }
 
-void __cp(const DirData* dest, const DirData* src, const FileData* file)
+/*
+ * Syncs the files of one directory pair. With output NULL each entry is
+ * printed as soon as it is done (and --jobs spreads the files over
+ * threads); otherwise the whole log is appended to output for the caller.
+ */
+void syncDirs(const DirData* src, const DirData* dest, const SyncOptions* options, OutputBuffer* output)
 {
-    char* srcFileFullPath = NULL;
-    char* destFileFullPath = NULL;
+    OutputBuffer entryOutput = { NULL, 0, 0 };
+    Arena scratch = { NULL, NULL };
+    Manifest manifest = { 0 };
+    SyncContext context = { src, dest, options, NULL };
+    SyncPlan plan;
+    IoRing ring;
+
+    if (options->useManifest)
+    {
+        loadManifest(dest, &manifest);
+        context.manifest = &manifest;
+    }
+
+    buildSyncPlan(src, dest, &plan);
+
+    // the ring is the concurrency of choice when asked for; without kernel support we quietly go synchronous
+    if (options->useIoUring && plan.entriesCount > 0 && ioRingInit(&ring, IO_RING_ENTRIES))
+    {
+        syncDirsWithRing(&context, &plan, &ring, output);
+        ioRingDestroy(&ring);
+    }
+    else if (output == NULL && options->jobs > 1 && plan.entriesCount > 1)
+    {
+        syncDirsParallel(&context, &plan);
+    }
+    else
+    {
+        for (int i = 0; i < plan.entriesCount; i++)
+        {
+            syncEntry(&context, &plan.entries[i], output != NULL ? output : &entryOutput, &scratch);
+            if (output == NULL) flushOutput(&entryOutput);
+            arenaReset(&scratch);
+        }
+        free(entryOutput.data);
+    }
 
-    int status = 0;
-    pid_t pid = -1;
+    if (options->useManifest)
+    {
+        writeManifest(&context, &plan);
+        unloadManifest(&manifest);
+    }
 
-    srcFileFullPath = getFullPath(src->path, file->name);
-    destFileFullPath = getFullPath(dest->path, file->name);
+    syncDestDirectory(dest, options->durability);
+
+    arenaRelease(&scratch);
+    free(plan.entries);
+}
 
-    pid = fork();
+/*
+ * --pipeline. The calling thread reads the source a getdents64 batch at
+ * a time and looks each name up in the destination with a statx instead
+ * of listing it; a compare thread classifies the entries as they arrive
+ * and --jobs copy threads transfer what needs it. Items cycle through a
+ * fixed pool, so memory stays flat however large the directory, and the
+ * first copy starts as soon as the first changed file is found. Each
+ * item is printed by the stage that finishes with it, so the log
+ * roughly follows directory order and not name order.
+ */
+void syncPipelined(const DirData* src, const DirData* dest, const SyncOptions* options)
+{
+    Pipeline pipeline;
+    PipelineItem* items = (PipelineItem*)calloc(PIPELINE_DEPTH, sizeof(PipelineItem));
+    pthread_t* copyThreads = (pthread_t*)malloc(options->jobs * sizeof(pthread_t));
+    pthread_t compareThread;
 
-    switch (pid)
+    if (items == NULL || copyThreads == NULL)
     {
-        case -1:
-            perror("fork failed");
-            exit(EXIT_FAILURE);
-        case 0:
-            execlp("/usr/bin/cp", "cp", srcFileFullPath, destFileFullPath, NULL);
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    pipeline.options = options;
+
+    // never closed, the stages keep handing items back until the end
+    initPipelineQueue(&pipeline.freeItems, 1);
+    initPipelineQueue(&pipeline.toCompare, 1);
+    initPipelineQueue(&pipeline.toCopy, 1);
+
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
+        pushPipelineItem(&pipeline.freeItems, &items[i]);
 
-            perror("failed to cp");
+    if (pthread_create(&compareThread, NULL, compareStageMain, &pipeline) != 0)
+    {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < options->jobs; i++)
+    {
+        if (pthread_create(&copyThreads[i], NULL, copyStageMain, &pipeline) != 0)
+        {
+            perror("pthread_create failed");
             exit(EXIT_FAILURE);
-        default:
-            waitpid(pid, &status, 0);
-            if (WIFEXITED(status))
-            {
-                int exit_status = WEXITSTATUS(status);
-                if (exit_status == EXIT_SUCCESS)
-                {
-                    printf("Copied: %s -> %s\n", srcFileFullPath, destFileFullPath);
-                }
-                if (exit_status == EXIT_FAILURE)
-                {
-                    perror("cp failed");
-                    exit(EXIT_FAILURE);
-                }
-            }
+        }
     }
+
+    scanIntoPipeline(&pipeline, src, dest);
+    closePipelineQueue(&pipeline.toCompare);
+
+    pthread_join(compareThread, NULL);
+    for (int i = 0; i < options->jobs; i++)
+        pthread_join(copyThreads[i], NULL);
+
+    syncDestDirectory(dest, options->durability);
+
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
+        free(items[i].output.data);
+    destroyPipelineQueue(&pipeline.freeItems);
+    destroyPipelineQueue(&pipeline.toCompare);
+    destroyPipelineQueue(&pipeline.toCopy);
+    free(items);
+    free(copyThreads);
 }
-void __strcpy(char* dest, const char* src, int copy_size)
+
+// the scan stage: what __ls does, one entry at a time, each paired with its destination file (if any) right away
+void scanIntoPipeline(Pipeline* pipeline, const DirData* src, const DirData* dest)
 {
-    int srcLength = strlen(src);
+    char* buffer = NULL;
+    ssize_t bufferLength = 0;
 
-    for (int i = 0; i < copy_size; i++)
+    if (lseek(src->fd, 0, SEEK_SET) == -1)
     {
-        if (srcLength == i)
+        perror("rewinddir failed");
+        exit(EXIT_FAILURE);
+    }
+
+    buffer = (char*)malloc(DIRENT_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    while ((bufferLength = syscall(SYS_getdents64, src->fd, buffer, DIRENT_BUFFER_SIZE)) > 0)
+    {
+        for (ssize_t offset = 0; offset < bufferLength;)
         {
-            perror("cannot copy more than srcLength bytes");
-            exit(EXIT_FAILURE);
+            LinuxDirent64* entry = (LinuxDirent64*)(buffer + offset);
+            struct statx srcStat;
+            struct statx destStat;
+            PipelineItem* item = NULL;
+            size_t nameLength = 0;
+
+            offset += entry->d_reclen;
+
+            if (entry->d_type == DT_DIR || isSkippedName(src, entry->d_name, true)) continue;
+
+            if (!statEntry(src->fd, entry->d_name, &srcStat))
+            {
+                perror("stat to read file data failed");
+                continue;
+            }
+            if (S_ISDIR(srcStat.stx_mode)) continue;
+
+            nameLength = strlen(entry->d_name);
+            item = popPipelineItem(&pipeline->freeItems);
+            memcpy(item->name, entry->d_name, nameLength + 1);
+
+            item->src = *src;
+            item->src.names = (NamesBlob){ item->name, nameLength + 1, sizeof(item->name) };
+            item->dest = *dest;
+            item->dest.names = item->src.names;
+            item->context = (SyncContext){ &item->src, &item->dest, pipeline->options, NULL };
+
+            item->srcFile.nameOffset = 0;
+            item->srcFile.nameLength = nameLength;
+            setFileStat(&item->srcFile, &srcStat);
+            item->entry = (SyncEntry){ SYNC_NEW, &item->srcFile, NULL, OUTCOME_NONE, 0 };
+
+            if (statEntry(dest->fd, entry->d_name, &destStat) && !S_ISDIR(destStat.stx_mode))
+            {
+                item->destFile = item->srcFile;
+                setFileStat(&item->destFile, &destStat);
+                item->entry.kind = SYNC_BOTH;
+                item->entry.destFile = &item->destFile;
+            }
+
+            pushPipelineItem(&pipeline->toCompare, item);
         }
-        dest[i] = src[i];
     }
-    dest[copy_size] = '\0';
+
+    if (bufferLength == -1)
+    {
+        perror("getdents64 failed");
+        exit(EXIT_FAILURE);
+    }
+
+    free(buffer);
+}
+
+void* compareStageMain(void* arg)
+{
+    Pipeline* pipeline = (Pipeline*)arg;
+    Arena scratch = { NULL, NULL };
+    PipelineItem* item = NULL;
+
+    while ((item = popPipelineItem(&pipeline->toCompare)) != NULL)
+    {
+        // link groups are coordinated in syncEntry, which the copy stage then runs whole
+        item->isClassified = !pipeline->options->preserveHardLinks || item->srcFile.linksCount < 2;
+
+        if (!item->isClassified || classifyEntry(&item->context, &item->entry, &item->output, &scratch))
+            pushPipelineItem(&pipeline->toCopy, item);
+        else
+            releasePipelineItem(pipeline, item);
+        arenaReset(&scratch);
+    }
+
+    closePipelineQueue(&pipeline->toCopy);
+    arenaRelease(&scratch);
+
+    return NULL;
+}
+
+void* copyStageMain(void* arg)
+{
+    Pipeline* pipeline = (Pipeline*)arg;
+    Arena scratch = { NULL, NULL };
+    PipelineItem* item = NULL;
+
+    while ((item = popPipelineItem(&pipeline->toCopy)) != NULL)
+    {
+        if (item->isClassified)
+            transferEntry(&item->context, &item->entry, &item->output, &scratch);
+        else
+            syncEntry(&item->context, &item->entry, &item->output, &scratch);
+
+        releasePipelineItem(pipeline, item);
+        arenaReset(&scratch);
+    }
+
+    arenaRelease(&scratch);
+
+    return NULL;
+}
+
+void initPipelineQueue(PipelineQueue* queue, int producersCount)
+{
+    queue->head = 0;
+    queue->count = 0;
+    queue->producersCount = producersCount;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+}
+
+void destroyPipelineQueue(PipelineQueue* queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->notEmpty);
+}
+
+void pushPipelineItem(PipelineQueue* queue, PipelineItem* item)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->items[(queue->head + queue->count) % PIPELINE_DEPTH] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// waits for an item; NULL once the queue is empty and closed by all its producers
+PipelineItem* popPipelineItem(PipelineQueue* queue)
+{
+    PipelineItem* item = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && queue->producersCount > 0)
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+
+    if (queue->count > 0)
+    {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % PIPELINE_DEPTH;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+void closePipelineQueue(PipelineQueue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->producersCount--;
+    pthread_cond_broadcast(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// prints what the item logged and returns it to the pool
+void releasePipelineItem(Pipeline* pipeline, PipelineItem* item)
+{
+    flushOutput(&item->output);
+    pushPipelineItem(&pipeline->freeItems, item);
+}
+
+/*
+ * Recursive mode. Every directory pair is a TreeNode; workers pop nodes
+ * off a shared stack, open and list them, sync their files into the
+ * node's own OutputBuffer and push the subdirectories as new nodes. The
+ * calling thread prints the buffers in preorder as they complete, so the
+ * log does not depend on --jobs. All file operations go through the
+ * directory fds, which keeps paths out of the hot loop and is safe
+ * against concurrent renames of the parents.
+ */
+void syncTrees(const DirData* src, const DirData* dest, const SyncOptions* options)
+{
+    TreeSync tree;
+    TreeNode* root = createTreeNode(NULL, NULL);
+    pthread_t* threads = NULL;
+    int workersCount = options->jobs > 1 ? options->jobs : 1;
+
+    // the root borrows the paths of the caller but gets fds of its own, nodes close theirs when done
+    root->src.path = src->path;
+    root->dest.path = dest->path;
+    root->src.fd = dup(src->fd);
+    root->dest.fd = dup(dest->fd);
+    if (root->src.fd == -1 || root->dest.fd == -1)
+    {
+        perror("dup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    tree.stack = root;
+    tree.activeCount = 0;
+    tree.options = options;
+    pthread_mutex_init(&tree.lock, NULL);
+    pthread_cond_init(&tree.changed, NULL);
+
+    threads = (pthread_t*)malloc(workersCount * sizeof(pthread_t));
+    if (threads == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < workersCount; i++)
+    {
+        if (pthread_create(&threads[i], NULL, treeWorkerMain, &tree) != 0)
+        {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printTreeNode(&tree, root);
+
+    for (int i = 0; i < workersCount; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&tree.lock);
+    pthread_cond_destroy(&tree.changed);
+    free(threads);
+}
+
+void* treeWorkerMain(void* arg)
+{
+    TreeSync* tree = (TreeSync*)arg;
+    TreeNode* node = NULL;
+
+    pthread_mutex_lock(&tree->lock);
+    for (;;)
+    {
+        // once the stack is empty and nobody is still listing a directory, no more work can appear
+        while (tree->stack == NULL && tree->activeCount > 0)
+            pthread_cond_wait(&tree->changed, &tree->lock);
+        if (tree->stack == NULL) break;
+
+        node = tree->stack;
+        tree->stack = node->next;
+        tree->activeCount++;
+        pthread_mutex_unlock(&tree->lock);
+
+        processTreeNode(tree, node);
+
+        pthread_mutex_lock(&tree->lock);
+        tree->activeCount--;
+        node->processed = true;
+        pthread_cond_broadcast(&tree->changed);
+    }
+    pthread_mutex_unlock(&tree->lock);
+
+    return NULL;
+}
+
+void processTreeNode(TreeSync* tree, TreeNode* node)
+{
+    boolean opened = node->parent == NULL || openTreeNode(node, tree->options->durability);
+    TreeNode* pushed = NULL;
+
+    if (node->parent != NULL) releaseTreeParent(tree, node);
+    if (!opened) return;
+
+    __ls(&node->src, true, true);
+    __ls(&node->dest, false, false);
+
+    sortFilesLexicographically(&node->src);
+    sortFilesLexicographically(&node->dest);
+
+    syncDirs(&node->src, &node->dest, tree->options, &node->output);
+
+    node->childrenCount = node->src.subdirsCount;
+    node->unopenedChildren = node->childrenCount;
+    if (node->childrenCount == 0)
+    {
+        closeTreeNode(node);
+        return;
+    }
+
+    node->children = (TreeNode**)malloc(node->childrenCount * sizeof(TreeNode*));
+    if (node->children == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // pushed in reverse, so the first subdirectory is the next one popped
+    for (int i = node->childrenCount - 1; i >= 0; i--)
+    {
+        TreeNode* child = createTreeNode(node, fileName(&node->src, &node->src.subdirs[i]));
+        node->children[i] = child;
+        child->next = pushed;
+        pushed = child;
+    }
+
+    pthread_mutex_lock(&tree->lock);
+    node->children[node->childrenCount - 1]->next = tree->stack;
+    tree->stack = pushed;
+    pthread_cond_broadcast(&tree->changed);
+    pthread_mutex_unlock(&tree->lock);
+}
+
+/*
+ * Opens the node's directories relative to its parent's fds. A missing
+ * destination directory is created with the source directory's mode;
+ * a source directory that vanished or is not readable is reported and
+ * its subtree skipped, the rest of the tree still syncs.
+ */
+boolean openTreeNode(TreeNode* node, Durability durability)
+{
+    struct stat srcStat;
+
+    node->src.fd = openat(node->parent->src.fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (node->src.fd == -1 || fstat(node->src.fd, &srcStat) == -1)
+    {
+        logMessage(&node->output, "Error: cannot open source directory '%s': %s\n", node->src.path, strerror(errno));
+        return false;
+    }
+
+    node->dest.fd = openat(node->parent->dest.fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (node->dest.fd == -1 && errno == ENOENT)
+    {
+        if (mkdirat(node->parent->dest.fd, node->name, srcStat.st_mode & 07777) == -1)
+        {
+            perror("mkdir failed");
+            exit(EXIT_FAILURE);
+        }
+        logFile(&node->output, LOG_EVENT_CREATED_DIR, "", node->dest.path);
+        // the new name has to be on disk before any file renamed into it counts as synced
+        syncDestDirectory(&node->parent->dest, durability);
+        node->dest.fd = openat(node->parent->dest.fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+
+    if (node->dest.fd == -1)
+    {
+        logMessage(&node->output, "Error: cannot open destination directory '%s': %s\n", node->dest.path, strerror(errno));
+        close(node->src.fd);
+        node->src.fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+// the parent's fds are only needed until the last child has opened its own
+void releaseTreeParent(TreeSync* tree, TreeNode* node)
+{
+    TreeNode* parent = node->parent;
+    boolean isLast = false;
+
+    pthread_mutex_lock(&tree->lock);
+    isLast = --parent->unopenedChildren == 0;
+    pthread_mutex_unlock(&tree->lock);
+
+    if (isLast) closeTreeNode(parent);
+}
+
+TreeNode* createTreeNode(TreeNode* parent, const char* name)
+{
+    TreeNode* node = (TreeNode*)calloc(1, sizeof(TreeNode));
+
+    if (node == NULL)
+    {
+        perror("Calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    node->parent = parent;
+    node->src.fd = -1;
+    node->dest.fd = -1;
+
+    if (parent != NULL)
+    {
+        const char* parentPrefix = parent->src.relativePath != NULL ? parent->src.relativePath : "";
+        char* relativePath = NULL;
+        size_t length = strlen(parentPrefix) + strlen(name) + 2;
+
+        // borrowed from the parent's listing, which outlives the node
+        node->name = name;
+        node->src.path = getFullPath(&node->src.arena, parent->src.path, name);
+        node->dest.path = getFullPath(&node->dest.arena, parent->dest.path, name);
+
+        relativePath = (char*)arenaAlloc(&node->src.arena, length, 1);
+        snprintf(relativePath, length, "%s%s/", parentPrefix, name);
+        node->src.relativePath = relativePath;
+        node->dest.relativePath = relativePath;
+    }
+
+    return node;
+}
+
+// prints the node's log, then its subtree, freeing every node once printed
+void printTreeNode(TreeSync* tree, TreeNode* node)
+{
+    pthread_mutex_lock(&tree->lock);
+    while (!node->processed)
+        pthread_cond_wait(&tree->changed, &tree->lock);
+    pthread_mutex_unlock(&tree->lock);
+
+    flushOutput(&node->output);
+
+    for (int i = 0; i < node->childrenCount; i++)
+        printTreeNode(tree, node->children[i]);
+
+    free(node->output.data);
+    free(node->children);
+    freeDirData(&node->src);
+    freeDirData(&node->dest);
+    free(node);
+}
+
+void closeTreeNode(TreeNode* node)
+{
+    if (node->src.fd != -1) close(node->src.fd);
+    if (node->dest.fd != -1) close(node->dest.fd);
+    node->src.fd = -1;
+    node->dest.fd = -1;
+}
+
+/*
+ * Pairs every source file with its destination counterpart and classifies
+ * destination-only files in the same pass. Sorted listings are joined with
+ * a linear two-cursor merge, anything else through a hash of the
+ * destination names.
+ */
+void buildSyncPlan(const DirData* src, const DirData* dest, SyncPlan* plan)
+{
+    plan->entriesCount = 0;
+    plan->entries = (SyncEntry*)malloc((src->filesCount + dest->filesCount + 1) * sizeof(SyncEntry));
+    if (plan->entries == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (src->isSorted && dest->isSorted)
+        mergeSortedListings(src, dest, plan);
+    else
+        joinIndexedListings(src, dest, plan);
+}
+
+void mergeSortedListings(const DirData* src, const DirData* dest, SyncPlan* plan)
+{
+    int srcIdx = 0;
+    int destIdx = 0;
+
+    while (srcIdx < src->filesCount || destIdx < dest->filesCount)
+    {
+        int order = 0;
+
+        if (srcIdx == src->filesCount) order = 1;
+        else if (destIdx == dest->filesCount) order = -1;
+        else order = strcmp(fileName(src, &src->files[srcIdx]), fileName(dest, &dest->files[destIdx]));
+
+        if (order < 0)
+        {
+            addSyncEntry(plan, SYNC_NEW, &src->files[srcIdx++], NULL);
+        }
+        else if (order > 0)
+        {
+            addSyncEntry(plan, SYNC_DEST_ONLY, NULL, &dest->files[destIdx++]);
+        }
+        else
+        {
+            addSyncEntry(plan, SYNC_BOTH, &src->files[srcIdx], &dest->files[destIdx]);
+            srcIdx++;
+            destIdx++;
+        }
+    }
+}
+
+void joinIndexedListings(const DirData* src, const DirData* dest, SyncPlan* plan)
+{
+    FileIndex index;
+    boolean* matched = (boolean*)calloc(dest->filesCount + 1, sizeof(boolean));
+
+    if (matched == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    buildFileIndex(dest, &index);
+
+    for (int i = 0; i < src->filesCount; i++)
+    {
+        int destIdx = lookupFile(&index, dest, fileName(src, &src->files[i]));
+
+        if (destIdx == -1)
+        {
+            addSyncEntry(plan, SYNC_NEW, &src->files[i], NULL);
+            continue;
+        }
+        matched[destIdx] = true;
+        addSyncEntry(plan, SYNC_BOTH, &src->files[i], &dest->files[destIdx]);
+    }
+
+    for (int i = 0; i < dest->filesCount; i++)
+    {
+        if (!matched[i])
+            addSyncEntry(plan, SYNC_DEST_ONLY, NULL, &dest->files[i]);
+    }
+
+    free(matched);
+    free(index.slots);
+}
+
+void addSyncEntry(SyncPlan* plan, SyncKind kind, const FileData* srcFile, const FileData* destFile)
+{
+    plan->entries[plan->entriesCount++] = (SyncEntry){ kind, srcFile, destFile, OUTCOME_NONE, 0 };
+}
+
+void buildFileIndex(const DirData* dir, FileIndex* index)
+{
+    unsigned int capacity = 2;
+
+    // keep the load factor at or below one half
+    while (capacity < (unsigned int)dir->filesCount * 2) capacity *= 2;
+
+    index->mask = capacity - 1;
+    index->slots = (int*)malloc(capacity * sizeof(int));
+    if (index->slots == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(index->slots, -1, capacity * sizeof(int));
+
+    for (int i = 0; i < dir->filesCount; i++)
+    {
+        unsigned int slot = hashName(fileName(dir, &dir->files[i])) & index->mask;
+
+        while (index->slots[slot] != -1)
+            slot = (slot + 1) & index->mask;
+        index->slots[slot] = i;
+    }
+}
+
+int lookupFile(const FileIndex* index, const DirData* dir, const char* name)
+{
+    unsigned int slot = hashName(name) & index->mask;
+
+    while (index->slots[slot] != -1)
+    {
+        if (strcmp(fileName(dir, &dir->files[index->slots[slot]]), name) == 0)
+            return index->slots[slot];
+        slot = (slot + 1) & index->mask;
+    }
+
+    return -1;
+}
+
+// FNV-1a
+unsigned int hashName(const char* name)
+{
+    unsigned int hash = 2166136261u;
+
+    for (; *name; name++)
+    {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * With --hard-links, a file with more than one link claims its inode:
+ * the first of its names to get here syncs it, the others wait and then
+ * become links to that copy.
+ */
+void syncEntry(const SyncContext* context, SyncEntry* entry, OutputBuffer* output, Arena* scratch)
+{
+    const FileData* file = entry->srcFile;
+    LinkClaim* claim = NULL;
+    boolean isLeader = false;
+
+    if (entry->kind == SYNC_DEST_ONLY || !context->options->preserveHardLinks || file->linksCount < 2)
+    {
+        syncEntryContents(context, entry, output, scratch);
+        return;
+    }
+
+    claim = claimLink(&linkTable, LINK_KEY_INODE, file->device, file->inode, &isLeader);
+    if (!isLeader && claim->isUsable && linkHardLinkedFile(context, entry, claim, output))
+        return;
+
+    syncEntryContents(context, entry, output, scratch);
+    if (isLeader) settleLinkClaim(&linkTable, claim, context->dest, fileName(context->src, file), entry);
+}
+
+void syncEntryContents(const SyncContext* context, SyncEntry* entry, OutputBuffer* output, Arena* scratch)
+{
+    if (classifyEntry(context, entry, output, scratch))
+        transferEntry(context, entry, output, scratch);
+}
+
+// the compare half of a sync: settles the entry, or (true) leaves it for transferEntry to copy
+boolean classifyEntry(const SyncContext* context, SyncEntry* entry, OutputBuffer* output, Arena* scratch)
+{
+    const DirData* src = context->src;
+    const FileData* file = entry->srcFile;
+    const ManifestRecord* record = NULL;
+    const char* name = fileName(src, file);
+    const char* prefix = src->relativePath != NULL ? src->relativePath : "";
+    uint64_t* contentHash = context->manifest != NULL ? &entry->contentHash : NULL;
+
+    switch (entry->kind)
+    {
+        case SYNC_DEST_ONLY:
+            // left alone, a mirror mode would delete it here
+            return false;
+        case SYNC_NEW:
+            logFile(output, LOG_EVENT_NEW, prefix, name);
+            return true;
+        case SYNC_BOTH:
+            break;
+    }
+
+    if (context->manifest != NULL)
+        record = findManifestRecord(context->manifest, name);
+
+    if (record != NULL && isUnchangedSinceManifest(record, file, entry->destFile))
+    {
+        countStat(&runStats.fastPaths[FAST_PATH_MANIFEST], 1);
+        entry->contentHash = record->contentHash;
+        entry->hasContentHash = (record->flags & MANIFEST_HASH_KNOWN) != 0;
+        entry->outcome = OUTCOME_IDENTICAL;
+        logFile(output, LOG_EVENT_IDENTICAL, prefix, name);
+        return false;
+    }
+
+    if (!filesDiffer(context, entry, contentHash, scratch))
+    {
+        entry->hasContentHash = contentHash != NULL && context->options->comparePolicy == COMPARE_POLICY_FULL;
+        entry->outcome = OUTCOME_IDENTICAL;
+        logFile(output, LOG_EVENT_IDENTICAL, prefix, name);
+        return false;
+    }
+
+    if (isFirstNewer(file, entry->destFile)) return true;
+
+    entry->outcome = OUTCOME_SKIPPED;
+    logFile(output, LOG_EVENT_DEST_NEWER, prefix, name);
+    return false;
+}
+
+// the copy half, for the entries classifyEntry passed on
+void transferEntry(const SyncContext* context, SyncEntry* entry, OutputBuffer* output, Arena* scratch)
+{
+    const char* prefix = context->src->relativePath != NULL ? context->src->relativePath : "";
+    uint64_t* contentHash = context->manifest != NULL ? &entry->contentHash : NULL;
+
+    copyEntry(context, entry, entry->kind == SYNC_BOTH, output, contentHash, scratch);
+    if (entry->kind == SYNC_BOTH)
+        logFile(output, LOG_EVENT_UPDATED, prefix, fileName(context->src, entry->srcFile));
+}
+
+// copies the source over (or into) the destination, through --dedup or --delta when they apply
+void copyEntry(const SyncContext* context, SyncEntry* entry, boolean allowDelta, OutputBuffer* output, uint64_t* contentHash, Arena* scratch)
+{
+    const DirData* src = context->src;
+    const DirData* dest = context->dest;
+    const FileData* file = entry->srcFile;
+    LinkClaim* claim = NULL;
+    boolean isDone = context->options->dedupMode != DEDUP_NONE
+        && dedupFile(context, entry, &claim, output, contentHash, scratch);
+
+    if (!isDone && allowDelta)
+    {
+        isDone = context->options->useDelta
+            && file->size >= DELTA_MIN_FILE_SIZE
+            && entry->destFile->size >= DELTA_BLOCK_SIZE
+            && deltaTransfer(dest, src, file, context->options->durability, output, contentHash, scratch);
+    }
+
+    if (!isDone)
+        __cp(dest, src, file, context->options->durability, output, scratch);
+    // dedup and delta read the whole source anyway, a plain copy leaves the bytes to the kernel and has no hash
+    entry->hasContentHash = isDone && contentHash != NULL;
+    entry->outcome = OUTCOME_COPIED;
+
+    if (claim != NULL) settleLinkClaim(&linkTable, claim, dest, fileName(src, file), entry);
+}
+
+// returns the group's claim, after waiting for its leader to settle it unless this caller is the leader
+LinkClaim* claimLink(LinkTable* table, LinkKeyKind kind, uint64_t first, uint64_t second, boolean* isLeader)
+{
+    unsigned int bucket = hashRound(first, second) % LINK_TABLE_BUCKETS;
+    LinkClaim* claim = NULL;
+
+    pthread_mutex_lock(&table->lock);
+
+    for (claim = table->buckets[bucket]; claim != NULL; claim = claim->next)
+    {
+        if (claim->kind == kind && claim->first == first && claim->second == second) break;
+    }
+
+    *isLeader = claim == NULL;
+    if (*isLeader)
+    {
+        claim = (LinkClaim*)arenaAlloc(&table->arena, sizeof(LinkClaim), sizeof(void*));
+        memset(claim, 0, sizeof(LinkClaim));
+        claim->kind = kind;
+        claim->first = first;
+        claim->second = second;
+        claim->next = table->buckets[bucket];
+        table->buckets[bucket] = claim;
+    }
+
+    // waits cannot go round in a circle as long as claims are taken in one order: an inode claim
+    // (syncEntry) before a content claim (dedupFile), and nothing waited on while a content claim is unsettled
+    while (!*isLeader && !claim->isSettled)
+        pthread_cond_wait(&table->settled, &table->lock);
+
+    pthread_mutex_unlock(&table->lock);
+
+    return claim;
+}
+
+// only a destination that ended up holding the leader's source content is worth linking to
+void settleLinkClaim(LinkTable* table, LinkClaim* claim, const DirData* dest, const char* name, const SyncEntry* entry)
+{
+    struct stat destStat;
+    boolean isUsable = (entry->outcome == OUTCOME_COPIED || entry->outcome == OUTCOME_IDENTICAL)
+        && fstatat(dest->fd, name, &destStat, AT_SYMLINK_NOFOLLOW) == 0
+        && S_ISREG(destStat.st_mode);
+
+    pthread_mutex_lock(&table->lock);
+
+    if (isUsable)
+    {
+        claim->destPath = getFullPath(&table->arena, dest->path, name);
+        claim->destDevice = destStat.st_dev;
+        claim->destInode = destStat.st_ino;
+        claim->contentHash = entry->contentHash;
+        claim->hasContentHash = entry->hasContentHash;
+    }
+    claim->isUsable = isUsable;
+    claim->isSettled = true;
+    pthread_cond_broadcast(&table->settled);
+
+    pthread_mutex_unlock(&table->lock);
+}
+
+// claims only hold for the sync they were made in, the files may change before the next one
+void resetLinkTable(LinkTable* table)
+{
+    pthread_mutex_lock(&table->lock);
+    memset(table->buckets, 0, sizeof(table->buckets));
+    arenaRelease(&table->arena);
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Makes name in the destination one more link of the leader's copy. A
+ * destination that already is one is identical; one that is newer than
+ * the source gets the usual checks instead (false).
+ */
+boolean linkHardLinkedFile(const SyncContext* context, SyncEntry* entry, const LinkClaim* claim, OutputBuffer* output)
+{
+    const DirData* dest = context->dest;
+    const FileData* file = entry->srcFile;
+    const char* name = fileName(context->src, file);
+    const char* prefix = context->src->relativePath != NULL ? context->src->relativePath : "";
+
+    if (entry->kind == SYNC_BOTH && entry->destFile->device == claim->destDevice && entry->destFile->inode == claim->destInode)
+    {
+        entry->contentHash = claim->contentHash;
+        entry->hasContentHash = claim->hasContentHash;
+        entry->outcome = OUTCOME_IDENTICAL;
+        logFile(output, LOG_EVENT_IDENTICAL, prefix, name);
+        return true;
+    }
+
+    // isFirstNewer also holds for equal times, only a strictly newer destination is kept
+    if (entry->kind == SYNC_BOTH && !isFirstNewer(file, entry->destFile)) return false;
+    if (!linkIntoPlace(dest, claim->destPath, name)) return false;
+
+    entry->contentHash = claim->contentHash;
+    entry->hasContentHash = claim->hasContentHash;
+    entry->outcome = OUTCOME_COPIED;
+    countStat(&runStats.bytesLinked, file->size);
+
+    if (entry->kind == SYNC_NEW) logFile(output, LOG_EVENT_NEW, prefix, name);
+    logLink(output, LOG_EVENT_LINKED, claim->destPath, dest, name, file->size);
+    if (entry->kind == SYNC_BOTH) logFile(output, LOG_EVENT_UPDATED, prefix, name);
+
+    return true;
+}
+
+/*
+ * --dedup: hashes the source and, when an earlier file of the run with
+ * the same size and hash is already in the destination, checks the two
+ * byte for byte and clones or links that copy instead of copying. With
+ * no earlier file the entry leads its content group; the claim goes to
+ * *leaderClaim for the caller to settle once the copy is done.
+ */
+boolean dedupFile(const SyncContext* context, SyncEntry* entry, LinkClaim** leaderClaim, OutputBuffer* output, uint64_t* contentHash, Arena* scratch)
+{
+    const char* name = fileName(context->src, entry->srcFile);
+    struct stat srcStat;
+    LinkClaim* claim = NULL;
+    boolean isLeader = false;
+    boolean isDone = false;
+    uint64_t hash = 0;
+    int srcFd = openat(context->src->fd, name, O_RDONLY | O_CLOEXEC);
+
+    if (srcFd == -1) return false;
+    if (fstat(srcFd, &srcStat) == -1 || !S_ISREG(srcStat.st_mode) || srcStat.st_size == 0)
+    {
+        close(srcFd);
+        return false;
+    }
+
+    hash = hashFileContents(srcFd, scratch);
+    countStat(&runStats.bytesRead, srcStat.st_size);
+
+    claim = claimLink(&linkTable, LINK_KEY_CONTENT, srcStat.st_size, hash, &isLeader);
+    if (isLeader)
+        *leaderClaim = claim;
+    else if (claim->isUsable)
+        isDone = materializeDuplicate(context, name, claim, srcFd, &srcStat, scratch);
+
+    close(srcFd);
+    if (!isDone) return false;
+
+    if (contentHash != NULL) *contentHash = hash;
+    countStat(&runStats.bytesLinked, srcStat.st_size);
+    logLink(output, context->options->dedupMode == DEDUP_LINK ? LOG_EVENT_LINKED : LOG_EVENT_CLONED,
+        claim->destPath, context->dest, name, srcStat.st_size);
+
+    return true;
+}
+
+// equal hashes are only a hint, the copy has to hold the very same bytes before anything points at it
+boolean materializeDuplicate(const SyncContext* context, const char* name, const LinkClaim* claim, int srcFd, const struct stat* srcStat, Arena* scratch)
+{
+    const DirData* dest = context->dest;
+    struct timespec times[2] = {
+        { .tv_nsec = UTIME_OMIT },
+        srcStat->st_mtim
+    };
+    char tempName[TEMP_NAME_SIZE];
+    boolean isDone = false;
+    int tempFd = -1;
+    int targetFd = open(claim->destPath, O_RDONLY | O_CLOEXEC);
+
+    if (targetFd == -1) return false;
+
+    if (compareFileContents(srcFd, targetFd, NULL, scratch) == COMPARE_IDENTICAL)
+    {
+        if (context->options->dedupMode == DEDUP_LINK)
+        {
+            isDone = linkIntoPlace(dest, claim->destPath, name);
+        }
+        else if ((tempFd = openTempFile(dest, srcStat->st_mode & 07777, tempName)) != -1)
+        {
+            isDone = copyWithReflink(targetFd, tempFd) == COPY_DONE
+                && fchmod(tempFd, srcStat->st_mode & 07777) == 0
+                && futimens(tempFd, times) == 0;
+            isDone = commitTempFile(dest, tempFd, tempName, name, isDone, context->options->durability);
+        }
+    }
+
+    close(targetFd);
+
+    return isDone;
+}
+
+// links targetPath in as name, replacing whatever name was in a single rename
+boolean linkIntoPlace(const DirData* dest, const char* targetPath, const char* name)
+{
+    char tempName[TEMP_NAME_SIZE];
+    boolean isLinked = false;
+
+    makeTempName(tempName);
+    if (linkat(AT_FDCWD, targetPath, dest->fd, tempName, 0) == -1) return false;
+
+    isLinked = renameat(dest->fd, tempName, dest->fd, name) == 0;
+
+    // a rename between two links of one file succeeds without doing anything, the temp name stays
+    unlinkat(dest->fd, tempName, 0);
+
+    return isLinked;
+}
+
+/*
+ * Each worker starts with an even slice of the (sorted) plan entries and
+ * steals from the others once its own slice runs dry. Workers only ever
+ * write into their task's OutputBuffer; the calling thread prints those
+ * buffers strictly in task order, so the log matches a sequential run.
+ */
+void syncDirsParallel(const SyncContext* context, SyncPlan* plan)
+{
+    SyncPool pool;
+    SyncWorker* workers = NULL;
+    pthread_t* threads = NULL;
+    int tasksCount = plan->entriesCount;
+    int jobs = context->options->jobs;
+
+    if (jobs > tasksCount) jobs = tasksCount;
+
+    pool.context = context;
+    pool.plan = plan;
+    pool.workersCount = jobs;
+    pool.outputs = (OutputBuffer*)calloc(tasksCount, sizeof(OutputBuffer));
+    pool.done = (boolean*)calloc(tasksCount, sizeof(boolean));
+    pool.deques = (TaskDeque*)malloc(jobs * sizeof(TaskDeque));
+    workers = (SyncWorker*)malloc(jobs * sizeof(SyncWorker));
+    threads = (pthread_t*)malloc(jobs * sizeof(pthread_t));
+    if (pool.outputs == NULL || pool.done == NULL || pool.deques == NULL || workers == NULL || threads == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&pool.doneLock, NULL);
+    pthread_cond_init(&pool.doneCond, NULL);
+
+    for (int i = 0; i < jobs; i++)
+    {
+        pool.deques[i].begin = (int)((long)tasksCount * i / jobs);
+        pool.deques[i].end = (int)((long)tasksCount * (i + 1) / jobs);
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+
+    for (int i = 0; i < jobs; i++)
+    {
+        workers[i] = (SyncWorker){ &pool, i, { NULL, NULL } };
+        if (pthread_create(&threads[i], NULL, syncWorkerMain, &workers[i]) != 0)
+        {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < tasksCount; i++)
+    {
+        pthread_mutex_lock(&pool.doneLock);
+        while (!pool.done[i])
+            pthread_cond_wait(&pool.doneCond, &pool.doneLock);
+        pthread_mutex_unlock(&pool.doneLock);
+
+        flushOutput(&pool.outputs[i]);
+        free(pool.outputs[i].data);
+    }
+
+    // every worker may still be stealing from every deque until it exits
+    for (int i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < jobs; i++)
+    {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        arenaRelease(&workers[i].scratch);
+    }
+
+    pthread_mutex_destroy(&pool.doneLock);
+    pthread_cond_destroy(&pool.doneCond);
+    free(pool.outputs);
+    free(pool.done);
+    free(pool.deques);
+    free(workers);
+    free(threads);
+}
+
+void* syncWorkerMain(void* arg)
+{
+    SyncWorker* worker = (SyncWorker*)arg;
+    SyncPool* pool = worker->pool;
+    int task = -1;
+
+    while (true)
+    {
+        if (!popTask(&pool->deques[worker->id], &task))
+        {
+            if (!stealTasks(pool, worker->id)) break;
+            continue;
+        }
+
+        syncEntry(pool->context, &pool->plan->entries[task], &pool->outputs[task], &worker->scratch);
+        arenaReset(&worker->scratch);
+
+        pthread_mutex_lock(&pool->doneLock);
+        pool->done[task] = true;
+        pthread_cond_broadcast(&pool->doneCond);
+        pthread_mutex_unlock(&pool->doneLock);
+    }
+
+    return NULL;
+}
+
+boolean popTask(TaskDeque* deque, int* task)
+{
+    boolean found = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->begin < deque->end)
+    {
+        *task = deque->begin++;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+boolean stealTasks(SyncPool* pool, int thiefId)
+{
+    TaskDeque* own = &pool->deques[thiefId];
+
+    for (int offset = 1; offset < pool->workersCount; offset++)
+    {
+        TaskDeque* victim = &pool->deques[(thiefId + offset) % pool->workersCount];
+        int begin = 0;
+        int end = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->begin < victim->end)
+        {
+            // take the back half, the victim keeps working on the front
+            end = victim->end;
+            begin = victim->begin + (victim->end - victim->begin) / 2;
+            victim->end = begin;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (begin == end) continue;
+
+        pthread_mutex_lock(&own->lock);
+        own->begin = begin;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+        return true;
+    }
+
+    return false;
+}
+
+void appendOutput(OutputBuffer* output, const char* format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    appendOutputV(output, format, args);
+    va_end(args);
+}
+
+void appendOutputV(OutputBuffer* output, const char* format, va_list args)
+{
+    va_list copy;
+    int needed = 0;
+
+    va_copy(copy, args);
+    needed = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+
+    if (output->length + needed + 1 > output->capacity)
+    {
+        size_t capacity = output->capacity ? output->capacity : OUTPUT_BUFFER_INITIAL_SIZE;
+        while (output->length + needed + 1 > capacity) capacity *= 2;
+
+        output->data = (char*)realloc(output->data, capacity);
+        if (output->data == NULL)
+        {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        output->capacity = capacity;
+    }
+
+    vsnprintf(output->data + output->length, needed + 1, format, args);
+
+    output->length += needed;
+}
+
+// JSON string escaping without the quotes; bytes that are not ASCII are passed through as they are
+void appendJsonEscaped(OutputBuffer* output, const char* text)
+{
+    while (*text != '\0')
+    {
+        size_t plain = 0;
+
+        while (text[plain] != '\0' && text[plain] != '"' && text[plain] != '\\' && (unsigned char)text[plain] >= 0x20)
+            plain++;
+        if (plain > 0) appendOutput(output, "%.*s", (int)plain, text);
+
+        text += plain;
+        if (*text == '\0') break;
+
+        if (*text == '"' || *text == '\\') appendOutput(output, "\\%c", *text);
+        else appendOutput(output, "\\u%04x", (unsigned char)*text);
+        text++;
+    }
+}
+
+void flushOutput(OutputBuffer* output)
+{
+    if (output->length == 0) return;
+
+    logWrite(output->data, output->length);
+    output->length = 0;
+}
+
+// registered with atexit too, so the output queued before an exit(EXIT_FAILURE) is not lost
+void startLogger(LogLevel level, LogFormat format)
+{
+    logger.level = level;
+    logger.format = format;
+    logger.ring = (char*)malloc(LOG_RING_SIZE);
+    if (logger.ring == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // whatever stdio still holds goes first, the ring writes to the fd directly
+    fflush(stdout);
+
+    pthread_mutex_init(&logger.lock, NULL);
+    pthread_cond_init(&logger.dataReady, NULL);
+    pthread_cond_init(&logger.spaceReady, NULL);
+    if (pthread_create(&logger.flusher, NULL, loggerFlusherMain, NULL) != 0)
+    {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+
+    logger.isStarted = true;
+    atexit(stopLogger);
+}
+
+// drains what is queued and joins the flusher; later output goes straight to stdout
+void stopLogger()
+{
+    if (!logger.isStarted) return;
+
+    pthread_mutex_lock(&logger.lock);
+    logger.stopRequested = true;
+    pthread_cond_signal(&logger.dataReady);
+    pthread_mutex_unlock(&logger.lock);
+
+    pthread_join(logger.flusher, NULL);
+    logger.isStarted = false;
+
+    pthread_cond_destroy(&logger.spaceReady);
+    pthread_cond_destroy(&logger.dataReady);
+    pthread_mutex_destroy(&logger.lock);
+    free(logger.ring);
+    logger.ring = NULL;
+}
+
+void* loggerFlusherMain(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&logger.lock);
+    while (true)
+    {
+        size_t offset = logger.tail % LOG_RING_SIZE;
+        size_t length = logger.head - logger.tail;
+
+        if (length == 0)
+        {
+            if (logger.stopRequested) break;
+            pthread_cond_wait(&logger.dataReady, &logger.lock);
+            continue;
+        }
+
+        // up to the end of the ring, the wrapped part goes in the next round
+        if (length > LOG_RING_SIZE - offset) length = LOG_RING_SIZE - offset;
+
+        pthread_mutex_unlock(&logger.lock);
+        // a log nobody reads any more is not worth failing the sync over
+        writeFull(STDOUT_FILENO, logger.ring + offset, length);
+        pthread_mutex_lock(&logger.lock);
+
+        logger.tail += length;
+        pthread_cond_broadcast(&logger.spaceReady);
+    }
+    pthread_mutex_unlock(&logger.lock);
+
+    return NULL;
+}
+
+void logWrite(const char* data, size_t length)
+{
+    if (!logger.isStarted)
+    {
+        fwrite(data, 1, length, stdout);
+        return;
+    }
+
+    pthread_mutex_lock(&logger.lock);
+    while (length > 0)
+    {
+        size_t offset = logger.head % LOG_RING_SIZE;
+        size_t space = LOG_RING_SIZE - (logger.head - logger.tail);
+
+        if (space == 0)
+        {
+            pthread_cond_wait(&logger.spaceReady, &logger.lock);
+            continue;
+        }
+
+        if (space > LOG_RING_SIZE - offset) space = LOG_RING_SIZE - offset;
+        if (space > length) space = length;
+
+        memcpy(logger.ring + offset, data, space);
+        logger.head += space;
+        data += space;
+        length -= space;
+        pthread_cond_signal(&logger.dataReady);
+    }
+    pthread_mutex_unlock(&logger.lock);
+}
+
+boolean isLogged(LogEvent event)
+{
+    switch (event)
+    {
+        case LOG_EVENT_MESSAGE:
+            return true;
+        case LOG_EVENT_IDENTICAL:
+        case LOG_EVENT_DEST_NEWER:
+            return logger.level == LOG_LEVEL_FULL;
+        default:
+            return logger.level != LOG_LEVEL_SUMMARY;
+    }
+}
+
+// an event about a single name; events below the log level are only counted, never formatted
+void logFile(OutputBuffer* output, LogEvent event, const char* prefix, const char* name)
+{
+    const char* textFormats[LOG_EVENTS_COUNT] = {
+        [LOG_EVENT_NEW] = "New file found: %s%s\n",
+        [LOG_EVENT_UPDATED] = "File %s%s is newer in source. Updating...\n",
+        [LOG_EVENT_CREATED_DIR] = "Created destination directory '%s%s'.\n",
+        [LOG_EVENT_IDENTICAL] = "File %s%s is identical. Skipping...\n",
+        [LOG_EVENT_DEST_NEWER] = "File %s%s is newer in destination. Skipping...\n"
+    };
+    const char* eventNames[LOG_EVENTS_COUNT] = {
+        [LOG_EVENT_NEW] = "new",
+        [LOG_EVENT_UPDATED] = "updated",
+        [LOG_EVENT_CREATED_DIR] = "created_dir",
+        [LOG_EVENT_IDENTICAL] = "identical",
+        [LOG_EVENT_DEST_NEWER] = "dest_newer"
+    };
+
+    __atomic_fetch_add(&logger.counts[event], 1, __ATOMIC_RELAXED);
+    if (!isLogged(event)) return;
+
+    if (logger.format == LOG_FORMAT_TEXT)
+    {
+        appendOutput(output, textFormats[event], prefix, name);
+        return;
+    }
+
+    appendOutput(output, "{\"event\":\"%s\",\"file\":\"", eventNames[event]);
+    appendJsonEscaped(output, prefix);
+    appendJsonEscaped(output, name);
+    appendOutput(output, "\"}\n");
+}
+
+// a copy or patch of name from src to dest; transferred is what actually moved, size the whole file
+void logTransfer(OutputBuffer* output, LogEvent event, const DirData* src, const DirData* dest, const char* name, long long transferred, long long size)
+{
+    __atomic_fetch_add(&logger.counts[event], 1, __ATOMIC_RELAXED);
+    if (!isLogged(event)) return;
+
+    if (logger.format == LOG_FORMAT_TEXT)
+    {
+        if (event == LOG_EVENT_PATCHED)
+            appendOutput(output, "Patched: %s/%s -> %s/%s (%lld of %lld bytes transferred)\n",
+                src->path, name, dest->path, name, transferred, size);
+        else
+            appendOutput(output, "Copied: %s/%s -> %s/%s\n", src->path, name, dest->path, name);
+        return;
+    }
+
+    appendOutput(output, "{\"event\":\"%s\",\"src\":\"", event == LOG_EVENT_PATCHED ? "patched" : "copied");
+    appendJsonEscaped(output, src->path);
+    appendOutput(output, "/");
+    appendJsonEscaped(output, name);
+    appendOutput(output, "\",\"dest\":\"");
+    appendJsonEscaped(output, dest->path);
+    appendOutput(output, "/");
+    appendJsonEscaped(output, name);
+    appendOutput(output, "\",\"bytes\":%lld,\"transferred\":%lld}\n", size, transferred);
+}
+
+// name in dest was linked to or cloned from target, a file this run already put in the destination
+void logLink(OutputBuffer* output, LogEvent event, const char* target, const DirData* dest, const char* name, long long size)
+{
+    __atomic_fetch_add(&logger.counts[event], 1, __ATOMIC_RELAXED);
+    if (!isLogged(event)) return;
+
+    if (logger.format == LOG_FORMAT_TEXT)
+    {
+        appendOutput(output, "%s: %s -> %s/%s\n", event == LOG_EVENT_LINKED ? "Linked" : "Cloned", target, dest->path, name);
+        return;
+    }
+
+    appendOutput(output, "{\"event\":\"%s\",\"src\":\"", event == LOG_EVENT_LINKED ? "linked" : "cloned");
+    appendJsonEscaped(output, target);
+    appendOutput(output, "\",\"dest\":\"");
+    appendJsonEscaped(output, dest->path);
+    appendOutput(output, "/");
+    appendJsonEscaped(output, name);
+    appendOutput(output, "\",\"bytes\":%lld}\n", size);
+}
+
+// free form text, shown at every log level; output NULL writes it out right away
+void logMessage(OutputBuffer* output, const char* format, ...)
+{
+    OutputBuffer message = { NULL, 0, 0 };
+    OutputBuffer* target = output != NULL ? output : &message;
+    va_list args;
+
+    va_start(args, format);
+    if (logger.format == LOG_FORMAT_TEXT)
+    {
+        appendOutputV(target, format, args);
+    }
+    else
+    {
+        // formatted on its own first, so it can be escaped as a whole and lose its newline
+        OutputBuffer text = { NULL, 0, 0 };
+
+        appendOutputV(&text, format, args);
+        if (text.length > 0 && text.data[text.length - 1] == '\n') text.data[--text.length] = '\0';
+
+        appendOutput(target, "{\"event\":\"message\",\"text\":\"");
+        appendJsonEscaped(target, text.data != NULL ? text.data : "");
+        appendOutput(target, "\"}\n");
+        free(text.data);
+    }
+    va_end(args);
+
+    if (output == NULL)
+    {
+        flushOutput(&message);
+        free(message.data);
+    }
+}
+
+void printLogSummary()
+{
+    unsigned long long* counts = logger.counts;
+    OutputBuffer summary = { NULL, 0, 0 };
+
+    if (logger.format == LOG_FORMAT_TEXT)
+    {
+        appendOutput(&summary, "Summary: %llu new, %llu updated, %llu identical, %llu newer in destination, %llu directories created, "
+            "%llu copied, %llu patched, %llu linked, %llu cloned.\n",
+            counts[LOG_EVENT_NEW], counts[LOG_EVENT_UPDATED], counts[LOG_EVENT_IDENTICAL],
+            counts[LOG_EVENT_DEST_NEWER], counts[LOG_EVENT_CREATED_DIR],
+            counts[LOG_EVENT_COPIED], counts[LOG_EVENT_PATCHED],
+            counts[LOG_EVENT_LINKED], counts[LOG_EVENT_CLONED]);
+    }
+    else
+    {
+        appendOutput(&summary, "{\"event\":\"summary\",\"new\":%llu,\"updated\":%llu,\"identical\":%llu,\"dest_newer\":%llu,\"created_dirs\":%llu,\"copied\":%llu,\"patched\":%llu,\"linked\":%llu,\"cloned\":%llu}\n",
+            counts[LOG_EVENT_NEW], counts[LOG_EVENT_UPDATED], counts[LOG_EVENT_IDENTICAL],
+            counts[LOG_EVENT_DEST_NEWER], counts[LOG_EVENT_CREATED_DIR],
+            counts[LOG_EVENT_COPIED], counts[LOG_EVENT_PATCHED],
+            counts[LOG_EVENT_LINKED], counts[LOG_EVENT_CLONED]);
+    }
+
+    flushOutput(&summary);
+    free(summary.data);
+}
+
+/*
+ * The listing already knows both sizes, so a size change never costs an
+ * open. Equal sizes are settled by the compare policy; only the full
+ * compare reads whole files, and only it can feed the manifest a hash;
+ * classifyEntry marks the others' identical files as having none.
+ */
+boolean filesDiffer(const SyncContext* context, const SyncEntry* entry, uint64_t* contentHash, Arena* scratch)
+{
+    const FileData* srcFile = entry->srcFile;
+    const FileData* destFile = entry->destFile;
+
+    if (srcFile->size != destFile->size)
+    {
+        countStat(&runStats.fastPaths[FAST_PATH_SIZE], 1);
+        return true;
+    }
+
+    switch (context->options->comparePolicy)
+    {
+        case COMPARE_POLICY_METADATA:
+            countStat(&runStats.fastPaths[FAST_PATH_METADATA], 1);
+            return srcFile->lastModified.tv_sec != destFile->lastModified.tv_sec
+                || srcFile->lastModified.tv_nsec != destFile->lastModified.tv_nsec;
+        case COMPARE_POLICY_FAST:
+            countStat(&runStats.fastPaths[FAST_PATH_SAMPLE], 1);
+            return __diff(context->dest, context->src, srcFile, COMPARE_POLICY_FAST, NULL, scratch);
+        case COMPARE_POLICY_FULL:
+        default:
+            return __diff(context->dest, context->src, srcFile, COMPARE_POLICY_FULL, contentHash, scratch);
+    }
+}
+
+boolean __diff(const DirData* dest, const DirData* src, const FileData* file, ComparePolicy policy, uint64_t* contentHash, Arena* scratch)
+{
+    ContentHash hash;
+
+    int srcFd = -1;
+    int destFd = -1;
+
+    CompareResult result = COMPARE_ERROR;
+    long long startNs = statsClock();
+
+    srcFd = openat(src->fd, fileName(src, file), O_RDONLY | O_CLOEXEC);
+    destFd = openat(dest->fd, fileName(src, file), O_RDONLY | O_CLOEXEC);
+
+    hashInit(&hash);
+    if (srcFd != -1 && destFd != -1 && policy == COMPARE_POLICY_FAST)
+        result = compareSampledFiles(srcFd, destFd, scratch);
+    else if (srcFd != -1 && destFd != -1)
+        result = compareFileContents(srcFd, destFd, contentHash != NULL ? &hash : NULL, scratch);
+    if (result == COMPARE_IDENTICAL && contentHash != NULL)
+        *contentHash = hashDigest(&hash);
+
+    if (srcFd != -1) close(srcFd);
+    if (destFd != -1) close(destFd);
+    recordLatency(&runStats.compareLatency, startNs);
+
+    switch (result)
+    {
+        case COMPARE_IDENTICAL:
+            return false;
+        case COMPARE_DIFFERENT:
+            return true;
+        case COMPARE_ERROR:
+        default:
+            perror("diff failed");
+            exit(EXIT_FAILURE);
+    }
+}
+
+// when hash is not NULL it is fed the source content, which is only complete if the files are identical
+CompareResult compareFileContents(int srcFd, int destFd, ContentHash* hash, Arena* scratch)
+{
+    struct stat srcStat;
+    struct stat destStat;
+
+    if (fstat(srcFd, &srcStat) == -1 || fstat(destFd, &destStat) == -1)
+        return COMPARE_ERROR;
+
+    // the size of a pipe or a device says nothing about what reading it yields
+    if (!S_ISREG(srcStat.st_mode) || !S_ISREG(destStat.st_mode))
+        return compareBufferedFiles(srcFd, destFd, hash, scratch);
+
+    if (srcStat.st_size != destStat.st_size) return COMPARE_DIFFERENT;
+    if (srcStat.st_size == 0) return COMPARE_IDENTICAL;
+
+    return compareMappedFiles(srcFd, destFd, srcStat.st_size,
+        isSparseFile(&srcStat) || isSparseFile(&destStat), hash, scratch);
+}
+
+CompareResult compareMappedFiles(int srcFd, int destFd, size_t size, boolean isSparse, ContentHash* hash, Arena* scratch)
+{
+    char* srcMap = NULL;
+    char* destMap = NULL;
+    CompareResult result = COMPARE_IDENTICAL;
+
+    srcMap = mmap(NULL, size, PROT_READ, MAP_PRIVATE, srcFd, 0);
+    if (srcMap == MAP_FAILED)
+        return compareBufferedFiles(srcFd, destFd, hash, scratch);
+
+    destMap = mmap(NULL, size, PROT_READ, MAP_PRIVATE, destFd, 0);
+    if (destMap == MAP_FAILED)
+    {
+        munmap(srcMap, size);
+        return compareBufferedFiles(srcFd, destFd, hash, scratch);
+    }
+
+    madvise(srcMap, size, MADV_SEQUENTIAL);
+    madvise(destMap, size, MADV_SEQUENTIAL);
+
+    if (isSparse)
+        result = compareSparseRanges(srcFd, destFd, srcMap, destMap, size, hash);
+    else
+        result = compareMappedRange(srcMap, destMap, 0, size, hash);
+
+    munmap(srcMap, size);
+    munmap(destMap, size);
+
+    return result;
+}
+
+// block by block, so an early mismatch never faults in the rest of either file
+CompareResult compareMappedRange(const char* srcMap, const char* destMap, off_t offset, off_t length, ContentHash* hash)
+{
+    for (off_t end = offset + length; offset < end; offset += COMPARE_BLOCK_SIZE)
+    {
+        size_t blockSize = end - offset < COMPARE_BLOCK_SIZE
+            ? end - offset
+            : COMPARE_BLOCK_SIZE;
+
+        countStat(&runStats.bytesRead, 2 * blockSize);
+        countStat(&runStats.bytesCompared, blockSize);
+        if (memcmp(srcMap + offset, destMap + offset, blockSize) != 0) return COMPARE_DIFFERENT;
+        if (hash != NULL) hashUpdate(hash, srcMap + offset, blockSize);
+    }
+
+    return COMPARE_IDENTICAL;
+}
+
+/*
+ * A range that is a hole in both files is equal without reading it, so
+ * only the ranges where either file has data are compared. Without
+ * SEEK_DATA support the rest is compared byte by byte.
+ */
+CompareResult compareSparseRanges(int srcFd, int destFd, const char* srcMap, const char* destMap, off_t size, ContentHash* hash)
+{
+    off_t offset = 0;
+
+    while (offset < size)
+    {
+        off_t srcData = seekExtent(srcFd, offset, SEEK_DATA, size);
+        off_t destData = seekExtent(destFd, offset, SEEK_DATA, size);
+        off_t srcHole = offset;
+        off_t destHole = offset;
+        off_t end = offset;
+        CompareResult result = COMPARE_IDENTICAL;
+
+        if (srcData == -1 || destData == -1)
+            return compareMappedRange(srcMap, destMap, offset, size - offset, hash);
+
+        if (srcData > offset && destData > offset)
+        {
+            end = srcData < destData ? srcData : destData;
+            if (hash != NULL) hashZeros(hash, end - offset);
+            offset = end;
+            continue;
+        }
+
+        // compare up to where both files could be in a hole again
+        if (srcData == offset) srcHole = seekExtent(srcFd, offset, SEEK_HOLE, size);
+        if (destData == offset) destHole = seekExtent(destFd, offset, SEEK_HOLE, size);
+        if (srcHole == -1 || destHole == -1)
+            return compareMappedRange(srcMap, destMap, offset, size - offset, hash);
+
+        end = srcHole > destHole ? srcHole : destHole;
+
+        result = compareMappedRange(srcMap, destMap, offset, end - offset, hash);
+        if (result != COMPARE_IDENTICAL) return result;
+        offset = end;
+    }
+
+    return COMPARE_IDENTICAL;
+}
+
+CompareResult compareBufferedFiles(int srcFd, int destFd, ContentHash* hash, Arena* scratch)
+{
+    char* srcBuffer = (char*)arenaAlloc(scratch, COMPARE_BLOCK_SIZE, IO_BUFFER_ALIGNMENT);
+    char* destBuffer = (char*)arenaAlloc(scratch, COMPARE_BLOCK_SIZE, IO_BUFFER_ALIGNMENT);
+    ssize_t srcRead = 0;
+    ssize_t destRead = 0;
+    CompareResult result = COMPARE_IDENTICAL;
+
+    do
+    {
+        srcRead = readFull(srcFd, srcBuffer, COMPARE_BLOCK_SIZE);
+        destRead = readFull(destFd, destBuffer, COMPARE_BLOCK_SIZE);
+
+        if (srcRead == -1 || destRead == -1)
+        {
+            result = COMPARE_ERROR;
+            break;
+        }
+        countStat(&runStats.bytesRead, srcRead + destRead);
+        countStat(&runStats.bytesCompared, srcRead < destRead ? srcRead : destRead);
+        if (srcRead != destRead || memcmp(srcBuffer, destBuffer, srcRead) != 0)
+        {
+            result = COMPARE_DIFFERENT;
+            break;
+        }
+        if (hash != NULL) hashUpdate(hash, srcBuffer, srcRead);
+    } while (srcRead == COMPARE_BLOCK_SIZE);
+
+    return result;
+}
+
+// only the head and the tail of the files are read, which catches appends, truncations and rewritten headers
+CompareResult compareSampledFiles(int srcFd, int destFd, Arena* scratch)
+{
+    char* srcBuffer = (char*)arenaAlloc(scratch, COMPARE_SAMPLE_SIZE, IO_BUFFER_ALIGNMENT);
+    char* destBuffer = (char*)arenaAlloc(scratch, COMPARE_SAMPLE_SIZE, IO_BUFFER_ALIGNMENT);
+    struct stat srcStat;
+    struct stat destStat;
+    off_t offsets[2] = { 0, 0 };
+    int samplesCount = 1;
+
+    if (fstat(srcFd, &srcStat) == -1 || fstat(destFd, &destStat) == -1)
+        return COMPARE_ERROR;
+
+    if (!S_ISREG(srcStat.st_mode) || !S_ISREG(destStat.st_mode))
+        return compareBufferedFiles(srcFd, destFd, NULL, scratch);
+
+    if (srcStat.st_size != destStat.st_size) return COMPARE_DIFFERENT;
+
+    if (srcStat.st_size > COMPARE_SAMPLE_SIZE)
+    {
+        offsets[1] = srcStat.st_size - COMPARE_SAMPLE_SIZE;
+        if (offsets[1] < COMPARE_SAMPLE_SIZE) offsets[1] = COMPARE_SAMPLE_SIZE;
+        samplesCount = 2;
+    }
+
+    for (int i = 0; i < samplesCount; i++)
+    {
+        ssize_t srcRead = 0;
+        ssize_t destRead = 0;
+
+        if (lseek(srcFd, offsets[i], SEEK_SET) == -1 || lseek(destFd, offsets[i], SEEK_SET) == -1)
+            return COMPARE_ERROR;
+
+        srcRead = readFull(srcFd, srcBuffer, COMPARE_SAMPLE_SIZE);
+        destRead = readFull(destFd, destBuffer, COMPARE_SAMPLE_SIZE);
+        if (srcRead == -1 || destRead == -1) return COMPARE_ERROR;
+        countStat(&runStats.bytesRead, srcRead + destRead);
+        countStat(&runStats.bytesCompared, srcRead < destRead ? srcRead : destRead);
+        if (srcRead != destRead || memcmp(srcBuffer, destBuffer, srcRead) != 0) return COMPARE_DIFFERENT;
+    }
+
+    return COMPARE_IDENTICAL;
+}
+
+ssize_t readFull(int fd, char* buffer, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size)
+    {
+        ssize_t bytesRead = read(fd, buffer + total, size - total);
+        if (bytesRead == -1)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (bytesRead == 0) break;
+        total += bytesRead;
+    }
+
+    return total;
+}
+
+boolean isFirstNewer(const FileData* first, const FileData* second)
+{
+    if (first->lastModified.tv_sec < second->lastModified.tv_sec) return false;
+    else if (first->lastModified.tv_sec == second->lastModified.tv_sec)
+    {
+        if (first->lastModified.tv_nsec < second->lastModified.tv_nsec) return false;
+
+    }
+    return true;
+}
+
+// the copy goes to a temp file first, so the destination name only ever refers to a complete file
+void __cp(const DirData* dest, const DirData* src, const FileData* file, Durability durability, OutputBuffer* output, Arena* scratch)
+{
+    int srcFd = -1;
+    int tempFd = -1;
+
+    struct stat srcStat;
+    char tempName[TEMP_NAME_SIZE];
+    boolean copied = false;
+    long long startNs = statsClock();
+
+    const char* name = fileName(src, file);
+
+    srcFd = openat(src->fd, name, O_RDONLY | O_CLOEXEC);
+    if (srcFd != -1 && fstat(srcFd, &srcStat) == 0)
+        tempFd = openTempFile(dest, srcStat.st_mode & 07777, tempName);
+
+    if (tempFd != -1)
+        copied = copyFileContents(srcFd, tempFd, &srcStat, scratch);
+
+    if (srcFd != -1) close(srcFd);
+    if (tempFd != -1)
+        copied = commitTempFile(dest, tempFd, tempName, name, copied, durability);
+
+    if (!copied)
+    {
+        perror("cp failed");
+        exit(EXIT_FAILURE);
+    }
+    recordLatency(&runStats.copyLatency, startNs);
+
+    logTransfer(output, LOG_EVENT_COPIED, src, dest, name, srcStat.st_size, srcStat.st_size);
+}
+
+boolean copyFileContents(int srcFd, int destFd, const struct stat* srcStat, Arena* scratch)
+{
+    off_t copied = 0;
+    CopyResult result = COPY_UNSUPPORTED;
+    struct timespec times[2] = {
+        { .tv_nsec = UTIME_OMIT },
+        srcStat->st_mtim
+    };
+
+    if (S_ISREG(srcStat->st_mode))
+        result = copyWithReflink(srcFd, destFd);
+
+    // a clone moves no data, but it stands for the whole file all the same
+    if (result == COPY_DONE)
+        copied = srcStat->st_size;
+
+    // read back through the holes, a sparse image would land fully allocated
+    if (result == COPY_UNSUPPORTED && isSparseFile(srcStat))
+        result = copySparseFile(srcFd, destFd, srcStat->st_size, &copied, scratch);
+
+    if (result == COPY_UNSUPPORTED && S_ISREG(srcStat->st_mode) && srcStat->st_size > 0)
+    {
+        // a failed preallocation only costs us the fragmentation it was meant to avoid
+        fallocate(destFd, FALLOC_FL_KEEP_SIZE, 0, srcStat->st_size);
+    }
+
+    // each fallback picks up from wherever the previous method stopped
+    if (result == COPY_UNSUPPORTED)
+        result = copyWithFileRange(srcFd, destFd, &copied);
+    if (result == COPY_UNSUPPORTED)
+        result = copyWithSendfile(srcFd, destFd, &copied);
+    if (result == COPY_UNSUPPORTED)
+        result = copyWithReadWrite(srcFd, destFd, &copied, scratch);
+
+    if (result != COPY_DONE) return false;
+
+    countStat(&runStats.bytesRead, copied);
+    countStat(&runStats.bytesWritten, copied);
+
+    if (fchmod(destFd, srcStat->st_mode & 07777) == -1) return false;
+    if (futimens(destFd, times) == -1) return false;
+
+    return true;
+}
+
+CopyResult copyWithReflink(int srcFd, int destFd)
+{
+    if (ioctl(destFd, FICLONE, srcFd) == 0) return COPY_DONE;
+
+    return isCopyUnsupported(errno) ? COPY_UNSUPPORTED : COPY_FAILED;
+}
+
+/*
+ * Copies only the data extents; the destination is a fresh file, so
+ * every range left unwritten is a hole, and the final ftruncate adds
+ * the trailing one. copied counts the data bytes. Unsupported only when
+ * the very first SEEK_DATA is, before anything was written.
+ */
+CopyResult copySparseFile(int srcFd, int destFd, off_t size, off_t* copied, Arena* scratch)
+{
+    off_t offset = 0;
+
+    while (offset < size)
+    {
+        off_t dataStart = seekExtent(srcFd, offset, SEEK_DATA, size);
+        off_t dataEnd = 0;
+
+        if (dataStart == -1)
+            return offset == 0 && isCopyUnsupported(errno) ? COPY_UNSUPPORTED : COPY_FAILED;
+        if (dataStart == size) break;
+
+        dataEnd = seekExtent(srcFd, dataStart, SEEK_HOLE, size);
+        if (dataEnd == -1) return COPY_FAILED;
+
+        if (!copyExtent(srcFd, destFd, dataStart, dataEnd - dataStart, scratch)) return COPY_FAILED;
+        *copied += dataEnd - dataStart;
+        offset = dataEnd;
+    }
+
+    return ftruncate(destFd, size) == 0 ? COPY_DONE : COPY_FAILED;
+}
+
+boolean copyExtent(int srcFd, int destFd, off_t offset, off_t length, Arena* scratch)
+{
+    char* buffer = NULL;
+    off_t done = 0;
+
+    while (done < length)
+    {
+        loff_t from = offset + done;
+        loff_t to = offset + done;
+        ssize_t bytesCopied = copy_file_range(srcFd, &from, destFd, &to, length - done, 0);
+
+        if (bytesCopied > 0)
+        {
+            done += bytesCopied;
+            continue;
+        }
+        if (bytesCopied == -1 && errno == EINTR) continue;
+        if (bytesCopied == -1 && !isCopyUnsupported(errno)) return false;
+        break;
+    }
+
+    while (done < length)
+    {
+        size_t chunk = length - done < COPY_CHUNK_SIZE ? length - done : COPY_CHUNK_SIZE;
+        ssize_t bytesRead = 0;
+
+        if (buffer == NULL) buffer = (char*)arenaAlloc(scratch, COPY_CHUNK_SIZE, IO_BUFFER_ALIGNMENT);
+
+        bytesRead = pread(srcFd, buffer, chunk, offset + done);
+        if (bytesRead == -1 && errno == EINTR) continue;
+        if (bytesRead <= 0) return false;
+
+        for (ssize_t written = 0; written < bytesRead; )
+        {
+            ssize_t result = pwrite(destFd, buffer + written, bytesRead - written, offset + done + written);
+            if (result == -1 && errno == EINTR) continue;
+            if (result == -1) return false;
+            written += result;
+        }
+        done += bytesRead;
+    }
+
+    return true;
+}
+
+// fewer blocks than the size needs means holes somewhere (or compression, which the extent walk handles just as well)
+boolean isSparseFile(const struct stat* fileStat)
+{
+    return S_ISREG(fileStat->st_mode) && (off_t)fileStat->st_blocks * 512 < fileStat->st_size;
+}
+
+// lseek to the next data or hole; data past the last extent is reported as size, failures as -1
+off_t seekExtent(int fd, off_t offset, int whence, off_t size)
+{
+    off_t result = lseek(fd, offset, whence);
+
+    if (result == -1 && errno == ENXIO) return size;
+    if (result > size) return size;
+
+    return result;
+}
+
+CopyResult copyWithFileRange(int srcFd, int destFd, off_t* copied)
+{
+    while (true)
+    {
+        loff_t srcOffset = *copied;
+        loff_t destOffset = *copied;
+        ssize_t bytesCopied = copy_file_range(srcFd, &srcOffset, destFd, &destOffset, COPY_CHUNK_SIZE, 0);
+
+        if (bytesCopied == 0) return COPY_DONE;
+        if (bytesCopied == -1)
+        {
+            if (errno == EINTR) continue;
+            return isCopyUnsupported(errno) ? COPY_UNSUPPORTED : COPY_FAILED;
+        }
+        *copied += bytesCopied;
+    }
+}
+
+CopyResult copyWithSendfile(int srcFd, int destFd, off_t* copied)
+{
+    if (lseek(destFd, *copied, SEEK_SET) == -1)
+        return COPY_UNSUPPORTED;
+
+    while (true)
+    {
+        ssize_t bytesCopied = sendfile(destFd, srcFd, copied, COPY_CHUNK_SIZE);
+
+        if (bytesCopied == 0) return COPY_DONE;
+        if (bytesCopied == -1)
+        {
+            if (errno == EINTR) continue;
+            return isCopyUnsupported(errno) ? COPY_UNSUPPORTED : COPY_FAILED;
+        }
+    }
+}
+
+CopyResult copyWithReadWrite(int srcFd, int destFd, off_t* copied, Arena* scratch)
+{
+    char* buffer = (char*)arenaAlloc(scratch, COPY_CHUNK_SIZE, IO_BUFFER_ALIGNMENT);
+    CopyResult result = COPY_DONE;
+
+    while (true)
+    {
+        ssize_t bytesRead = pread(srcFd, buffer, COPY_CHUNK_SIZE, *copied);
+        ssize_t bytesWritten = 0;
+
+        if (bytesRead == 0) break;
+        if (bytesRead == -1)
+        {
+            if (errno == EINTR) continue;
+            result = COPY_FAILED;
+            break;
+        }
+
+        while (bytesWritten < bytesRead)
+        {
+            ssize_t written = pwrite(destFd, buffer + bytesWritten, bytesRead - bytesWritten, *copied + bytesWritten);
+            if (written == -1)
+            {
+                if (errno == EINTR) continue;
+                result = COPY_FAILED;
+                break;
+            }
+            bytesWritten += written;
+        }
+        if (result == COPY_FAILED) break;
+
+        *copied += bytesRead;
+    }
+
+    return result;
+}
+
+boolean isCopyUnsupported(int error)
+{
+    switch (error)
+    {
+        case EOPNOTSUPP:
+        case ENOTTY:
+        case ENOSYS:
+        case EXDEV:
+        case EINVAL:
+        case EBADF:
+        case ESPIPE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// a name in the destination that __ls never lists and no other writer (thread or process) picks
+void makeTempName(char* tempName)
+{
+    static unsigned int tempCounter = 0;
+
+    snprintf(tempName, TEMP_NAME_SIZE, "%s%d.%u", TEMP_FILE_PREFIX, (int)getpid(),
+        __atomic_fetch_add(&tempCounter, 1, __ATOMIC_RELAXED));
+}
+
+int openTempFile(const DirData* dest, mode_t mode, char* tempName)
+{
+    makeTempName(tempName);
+    return openat(dest->fd, tempName, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+}
+
+/*
+ * Closes a temp file and, when isComplete, renames it over name. A temp
+ * file that is not renamed is removed. errno is left as the first
+ * failure set it, for the caller's perror.
+ */
+boolean commitTempFile(const DirData* dest, int tempFd, const char* tempName, const char* name, boolean isComplete, Durability durability)
+{
+    int error = 0;
+
+    if (isComplete && durability == DURABILITY_FILE && fdatasync(tempFd) == -1) isComplete = false;
+    if (close(tempFd) == -1) isComplete = false;
+    if (isComplete && renameat(dest->fd, tempName, dest->fd, name) == -1) isComplete = false;
+
+    if (!isComplete)
+    {
+        error = errno;
+        unlinkat(dest->fd, tempName, 0);
+        errno = error;
+    }
+
+    return isComplete;
+}
+
+// with per-file durability the data is on disk before the rename, the new names are once their directory is
+void syncDestDirectory(const DirData* dest, Durability durability)
+{
+    if (durability != DURABILITY_FILE) return;
+
+    if (fsync(dest->fd) == -1)
+    {
+        perror("fsync failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// for a destination directory this run created, whose own name lives in its parent
+void syncDestParent(const DirData* dest, Durability durability)
+{
+    int parentFd = -1;
+
+    if (durability != DURABILITY_FILE) return;
+
+    parentFd = openat(dest->fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (parentFd == -1 || fsync(parentFd) == -1)
+    {
+        perror("fsync failed");
+        exit(EXIT_FAILURE);
+    }
+    close(parentFd);
+}
+
+void syncDestFilesystem(const DirData* dest, Durability durability)
+{
+    if (durability != DURABILITY_BATCH) return;
+
+    if (syncfs(dest->fd) == -1)
+    {
+        perror("syncfs failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void loadManifest(const DirData* dest, Manifest* manifest)
+{
+    const ManifestHeader* header = NULL;
+    struct stat manifestStat;
+    size_t expectedSize = 0;
+    int fd = -1;
+
+    memset(manifest, 0, sizeof(Manifest));
+
+    fd = openat(dest->fd, MANIFEST_FILE_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+
+    if (fstat(fd, &manifestStat) == -1 || (size_t)manifestStat.st_size < sizeof(ManifestHeader))
+    {
+        close(fd);
+        return;
+    }
+
+    manifest->mapSize = manifestStat.st_size;
+    manifest->map = mmap(NULL, manifest->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (manifest->map == MAP_FAILED)
+    {
+        memset(manifest, 0, sizeof(Manifest));
+        return;
+    }
+
+    // anything that does not add up is treated as no manifest at all
+    header = (const ManifestHeader*)manifest->map;
+    expectedSize = sizeof(ManifestHeader) + (size_t)header->recordsCount * sizeof(ManifestRecord) + header->namesSize;
+    if (memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) != 0
+        || header->version != MANIFEST_VERSION
+        || expectedSize != manifest->mapSize)
+    {
+        unloadManifest(manifest);
+        return;
+    }
+
+    manifest->records = (const ManifestRecord*)(header + 1);
+    manifest->recordsCount = header->recordsCount;
+    manifest->names = (const char*)(manifest->records + manifest->recordsCount);
+}
+
+void unloadManifest(Manifest* manifest)
+{
+    if (manifest->map != NULL)
+        munmap(manifest->map, manifest->mapSize);
+    memset(manifest, 0, sizeof(Manifest));
+}
+
+const ManifestRecord* findManifestRecord(const Manifest* manifest, const char* name)
+{
+    uint32_t low = 0;
+    uint32_t high = manifest->recordsCount;
+
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        const ManifestRecord* record = &manifest->records[middle];
+        int order = strcmp(manifest->names + record->nameOffset, name);
+
+        if (order == 0) return record;
+        if (order < 0) low = middle + 1;
+        else high = middle;
+    }
+
+    return NULL;
+}
+
+boolean isUnchangedSinceManifest(const ManifestRecord* record, const FileData* srcFile, const FileData* destFile)
+{
+    return record->size == (uint64_t)srcFile->size
+        && record->size == (uint64_t)destFile->size
+        && record->inode == (uint64_t)srcFile->inode
+        && record->mtimeSec == srcFile->lastModified.tv_sec
+        && record->mtimeNsec == srcFile->lastModified.tv_nsec
+        && record->destMtimeSec == destFile->lastModified.tv_sec
+        && record->destMtimeNsec == destFile->lastModified.tv_nsec;
+}
+
+/*
+ * Records every file that ended this run identical on both sides, i.e.
+ * was found identical or was just copied. Written next to the final name
+ * and renamed over it, so a crash never leaves a half-written manifest.
+ */
+void writeManifest(const SyncContext* context, const SyncPlan* plan)
+{
+    ManifestHeader header;
+    ManifestRecord* records = NULL;
+    uint32_t recordsCount = 0;
+    NamesBlob names = { NULL, 0, 0 };
+    int destFd = context->dest->fd;
+    boolean written = false;
+    int fd = -1;
+
+    records = (ManifestRecord*)malloc((plan->entriesCount + 1) * sizeof(ManifestRecord));
+    if (records == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < plan->entriesCount; i++)
+    {
+        const SyncEntry* entry = &plan->entries[i];
+        const FileData* file = entry->srcFile;
+        timespec destModified;
+
+        if (entry->outcome != OUTCOME_IDENTICAL && entry->outcome != OUTCOME_COPIED) continue;
+
+        // a copy carries the source mtime over to the destination
+        destModified = entry->outcome == OUTCOME_COPIED ? file->lastModified : entry->destFile->lastModified;
+
+        records[recordsCount++] = (ManifestRecord)
+        {
+            file->size,
+            file->lastModified.tv_sec,
+            file->lastModified.tv_nsec,
+            file->inode,
+            destModified.tv_sec,
+            destModified.tv_nsec,
+            entry->contentHash,
+            appendName(&names, fileName(context->src, file), file->nameLength),
+            file->nameLength,
+            entry->hasContentHash ? MANIFEST_HASH_KNOWN : 0,
+            0
+        };
+    }
+
+    qsort_r(records, recordsCount, sizeof(ManifestRecord), compareManifestRecords, names.data);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = MANIFEST_VERSION;
+    header.recordsCount = recordsCount;
+    header.namesSize = names.length;
+
+    fd = openat(destFd, MANIFEST_TEMP_FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1)
+    {
+        written = writeFull(fd, &header, sizeof(header))
+            && writeFull(fd, records, recordsCount * sizeof(ManifestRecord))
+            && writeFull(fd, names.data, names.length);
+        if (close(fd) == -1) written = false;
+    }
+
+    // the sync itself already succeeded, a missing manifest only costs the next run some compares
+    if (!written || renameat(destFd, MANIFEST_TEMP_FILE_NAME, destFd, MANIFEST_FILE_NAME) == -1)
+    {
+        perror("manifest write failed");
+        unlinkat(destFd, MANIFEST_TEMP_FILE_NAME, 0);
+    }
+
+    free(records);
+    free(names.data);
+}
+
+int compareManifestRecords(const void* first, const void* second, void* names)
+{
+    const ManifestRecord* firstRecord = (const ManifestRecord*)first;
+    const ManifestRecord* secondRecord = (const ManifestRecord*)second;
+
+    return strcmp((const char*)names + firstRecord->nameOffset, (const char*)names + secondRecord->nameOffset);
+}
+
+boolean writeFull(int fd, const void* buffer, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size)
+    {
+        ssize_t written = write(fd, (const char*)buffer + total, size - total);
+        if (written == -1)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        total += written;
+    }
+
+    return true;
+}
+
+uint64_t rotateLeft64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t hashRound(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * XXH_PRIME64_2;
+    accumulator = rotateLeft64(accumulator, 31);
+    return accumulator * XXH_PRIME64_1;
+}
+
+uint64_t hashMergeRound(uint64_t accumulator, uint64_t lane)
+{
+    accumulator ^= hashRound(0, lane);
+    return accumulator * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t readLittleEndian64(const unsigned char* bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+uint32_t readLittleEndian32(const unsigned char* bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+void hashInit(ContentHash* hash)
+{
+    hash->lanes[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    hash->lanes[1] = XXH_PRIME64_2;
+    hash->lanes[2] = 0;
+    hash->lanes[3] = -XXH_PRIME64_1;
+    hash->pendingLength = 0;
+    hash->totalLength = 0;
+}
+
+// XXH64 over 32-byte stripes, four independent lanes per stripe
+void hashUpdate(ContentHash* hash, const void* data, size_t length)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    const unsigned char* end = bytes + length;
+
+    hash->totalLength += length;
+
+    if (hash->pendingLength + length < sizeof(hash->pending))
+    {
+        memcpy(hash->pending + hash->pendingLength, bytes, length);
+        hash->pendingLength += length;
+        return;
+    }
+
+    if (hash->pendingLength > 0)
+    {
+        size_t fill = sizeof(hash->pending) - hash->pendingLength;
+        memcpy(hash->pending + hash->pendingLength, bytes, fill);
+        bytes += fill;
+        for (int lane = 0; lane < 4; lane++)
+            hash->lanes[lane] = hashRound(hash->lanes[lane], readLittleEndian64(hash->pending + lane * 8));
+        hash->pendingLength = 0;
+    }
+
+    for (; bytes + 32 <= end; bytes += 32)
+    {
+        hash->lanes[0] = hashRound(hash->lanes[0], readLittleEndian64(bytes));
+        hash->lanes[1] = hashRound(hash->lanes[1], readLittleEndian64(bytes + 8));
+        hash->lanes[2] = hashRound(hash->lanes[2], readLittleEndian64(bytes + 16));
+        hash->lanes[3] = hashRound(hash->lanes[3], readLittleEndian64(bytes + 24));
+    }
+
+    hash->pendingLength = end - bytes;
+    memcpy(hash->pending, bytes, hash->pendingLength);
+}
+
+uint64_t hashDigest(const ContentHash* hash)
+{
+    const unsigned char* bytes = hash->pending;
+    const unsigned char* end = hash->pending + hash->pendingLength;
+    uint64_t digest = 0;
+
+    if (hash->totalLength >= 32)
+    {
+        digest = rotateLeft64(hash->lanes[0], 1) + rotateLeft64(hash->lanes[1], 7)
+            + rotateLeft64(hash->lanes[2], 12) + rotateLeft64(hash->lanes[3], 18);
+        for (int lane = 0; lane < 4; lane++)
+            digest = hashMergeRound(digest, hash->lanes[lane]);
+    }
+    else
+    {
+        digest = XXH_PRIME64_5;
+    }
+
+    digest += hash->totalLength;
+
+    for (; bytes + 8 <= end; bytes += 8)
+    {
+        digest ^= hashRound(0, readLittleEndian64(bytes));
+        digest = rotateLeft64(digest, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (bytes + 4 <= end)
+    {
+        digest ^= (uint64_t)readLittleEndian32(bytes) * XXH_PRIME64_1;
+        digest = rotateLeft64(digest, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        bytes += 4;
+    }
+    for (; bytes < end; bytes++)
+    {
+        digest ^= *bytes * XXH_PRIME64_5;
+        digest = rotateLeft64(digest, 11) * XXH_PRIME64_1;
+    }
+
+    digest ^= digest >> 33;
+    digest *= XXH_PRIME64_2;
+    digest ^= digest >> 29;
+    digest *= XXH_PRIME64_3;
+    digest ^= digest >> 32;
+
+    return digest;
+}
+
+uint64_t hashFileContents(int fd, Arena* scratch)
+{
+    char* buffer = (char*)arenaAlloc(scratch, COMPARE_BLOCK_SIZE, IO_BUFFER_ALIGNMENT);
+    ContentHash hash;
+    struct stat fileStat;
+    off_t offset = 0;
+    ssize_t bytesRead = 0;
+    boolean isSparse = fstat(fd, &fileStat) == 0 && isSparseFile(&fileStat);
+
+    hashInit(&hash);
+    while (true)
+    {
+        // holes hash as the zeros they read as, without reading them
+        if (isSparse)
+        {
+            off_t dataStart = seekExtent(fd, offset, SEEK_DATA, fileStat.st_size);
+            if (dataStart > offset)
+            {
+                hashZeros(&hash, dataStart - offset);
+                offset = dataStart;
+            }
+        }
+
+        bytesRead = pread(fd, buffer, COMPARE_BLOCK_SIZE, offset);
+        if (bytesRead <= 0) break;
+
+        hashUpdate(&hash, buffer, bytesRead);
+        offset += bytesRead;
+    }
+    countStat(&runStats.bytesRead, offset);
+
+    return hashDigest(&hash);
+}
+
+void hashZeros(ContentHash* hash, off_t length)
+{
+    static const char zeros[1 << 16];
+
+    while (length > 0)
+    {
+        size_t chunk = length < (off_t)sizeof(zeros) ? length : sizeof(zeros);
+
+        hashUpdate(hash, zeros, chunk);
+        length -= chunk;
+    }
+}
+
+void __strcpy(char* dest, const char* src, int copy_size)
+{
+    int srcLength = strlen(src);
+
+    for (int i = 0; i < copy_size; i++)
+    {
+        if (srcLength == i)
+        {
+            perror("cannot copy more than srcLength bytes");
+            exit(EXIT_FAILURE);
+        }
+        dest[i] = src[i];
+    }
+    dest[copy_size] = '\0';
+}
+
+/*
+ * rsync-style delta transfer of a file whose older version is already in
+ * the destination. The destination is split into DELTA_BLOCK_SIZE blocks,
+ * each signed with a rolling weak checksum and an XXH64 strong hash; a
+ * window slides over the source looking for those blocks, and everything
+ * in between is literal data.
+ *
+ * The new file is built in a temp file next to the destination and
+ * renamed over it, like every other copy; matched blocks are cloned out
+ * of the old file with copy_file_range where the filesystem supports
+ * it, so only the literal ranges cost real writes.
+ *
+ * Returns false, with nothing changed, when the delta cannot be done; the
+ * caller then copies the whole file.
+ */
+boolean deltaTransfer(const DirData* dest, const DirData* src, const FileData* file, Durability durability, OutputBuffer* output, uint64_t* contentHash, Arena* scratch)
+{
+    const char* name = fileName(src, file);
+    unsigned char* srcData = MAP_FAILED;
+    unsigned char* destData = MAP_FAILED;
+    struct stat srcStat;
+    struct stat destStat;
+    DeltaPlan plan = { NULL, 0, 0, 0 };
+    boolean patched = false;
+    int srcFd = -1;
+    int destFd = -1;
+    long long startNs = statsClock();
+
+    srcFd = openat(src->fd, name, O_RDONLY | O_CLOEXEC);
+    destFd = openat(dest->fd, name, O_RDONLY | O_CLOEXEC);
+
+    if (srcFd != -1 && destFd != -1
+        && fstat(srcFd, &srcStat) == 0 && fstat(destFd, &destStat) == 0
+        && S_ISREG(srcStat.st_mode) && S_ISREG(destStat.st_mode)
+        && srcStat.st_size > 0 && destStat.st_size >= DELTA_BLOCK_SIZE)
+    {
+        srcData = (unsigned char*)mmap(NULL, srcStat.st_size, PROT_READ, MAP_PRIVATE, srcFd, 0);
+        destData = (unsigned char*)mmap(NULL, destStat.st_size, PROT_READ, MAP_PRIVATE, destFd, 0);
+    }
+
+    if (srcData != MAP_FAILED && destData != MAP_FAILED)
+        patched = patchMappedFile(dest, name, srcFd, destFd, &srcStat, srcData, destData, destStat.st_size, durability, &plan);
+
+    if (patched)
+    {
+        if (contentHash != NULL)
+            *contentHash = hashBlock(srcData, srcStat.st_size);
+        recordLatency(&runStats.copyLatency, startNs);
+
+        logTransfer(output, LOG_EVENT_PATCHED, src, dest, name, plan.literalBytes, srcStat.st_size);
+    }
+
+    if (srcData != MAP_FAILED) munmap(srcData, srcStat.st_size);
+    if (destData != MAP_FAILED) munmap(destData, destStat.st_size);
+    if (srcFd != -1) close(srcFd);
+    if (destFd != -1) close(destFd);
+    free(plan.ops);
+
+    return patched;
+}
+
+boolean patchMappedFile(const DirData* dest, const char* name, int srcFd, int destFd, const struct stat* srcStat, const unsigned char* srcData, const unsigned char* destData, off_t destSize, Durability durability, DeltaPlan* plan)
+{
+    DeltaSignature signature = { NULL, 0, NULL, 0 };
+    struct timespec times[2] = {
+        { .tv_nsec = UTIME_OMIT },
+        srcStat->st_mtim
+    };
+    char tempName[TEMP_NAME_SIZE];
+    boolean patched = false;
+    int tempFd = -1;
+
+    madvise((void*)srcData, srcStat->st_size, MADV_SEQUENTIAL);
+    madvise((void*)destData, destSize, MADV_SEQUENTIAL);
+
+    buildDeltaSignature(destData, destSize, &signature);
+    buildDeltaPlan(&signature, srcData, srcStat->st_size, destData, destSize, plan);
+    free(signature.blocks);
+    free(signature.buckets);
+    countStat(&runStats.bytesRead, srcStat->st_size + destSize);
+
+    tempFd = openTempFile(dest, srcStat->st_mode & 07777, tempName);
+    if (tempFd == -1) return false;
+
+    patched = applyDeltaToTempFile(plan, srcFd, destFd, tempFd, srcStat, srcData, destData)
+        && fchmod(tempFd, srcStat->st_mode & 07777) == 0
+        && futimens(tempFd, times) == 0;
+    patched = commitTempFile(dest, tempFd, tempName, name, patched, durability);
+    if (patched) countStat(&runStats.bytesWritten, srcStat->st_size);
+
+    return patched;
+}
+
+void buildDeltaSignature(const unsigned char* data, off_t size, DeltaSignature* signature)
+{
+    RollingChecksum checksum;
+    int bucketsCount = 0;
+
+    signature->blocksCount = size / DELTA_BLOCK_SIZE;
+
+    // at least twice as many buckets as blocks keeps the chains short
+    signature->bucketBits = 1;
+    while ((1 << signature->bucketBits) < 2 * signature->blocksCount) signature->bucketBits++;
+    bucketsCount = 1 << signature->bucketBits;
+
+    signature->blocks = (BlockSignature*)malloc(signature->blocksCount * sizeof(BlockSignature));
+    signature->buckets = (int*)malloc(bucketsCount * sizeof(int));
+    if (signature->blocks == NULL || signature->buckets == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(signature->buckets, -1, bucketsCount * sizeof(int));
+
+    // inserted back to front so every chain lists its blocks in file order
+    for (int i = signature->blocksCount - 1; i >= 0; i--)
+    {
+        const unsigned char* block = data + (off_t)i * DELTA_BLOCK_SIZE;
+        unsigned int bucket = 0;
+
+        rollingInit(&checksum, block, DELTA_BLOCK_SIZE);
+        signature->blocks[i].weak = rollingDigest(&checksum);
+        signature->blocks[i].strong = hashBlock(block, DELTA_BLOCK_SIZE);
+
+        bucket = weakBucket(signature->blocks[i].weak, signature->bucketBits);
+        signature->blocks[i].next = signature->buckets[bucket];
+        signature->buckets[bucket] = i;
+    }
+}
+
+void buildDeltaPlan(const DeltaSignature* signature, const unsigned char* srcData, off_t srcSize, const unsigned char* destData, off_t destSize, DeltaPlan* plan)
+{
+    RollingChecksum checksum;
+    off_t position = 0;
+    off_t literalStart = 0;
+    off_t tailOffset = signature->blocksCount * (off_t)DELTA_BLOCK_SIZE;
+    off_t tailLength = destSize - tailOffset;
+    boolean hasWindow = false;
+
+    while (position + DELTA_BLOCK_SIZE <= srcSize)
+    {
+        int block = -1;
+
+        if (!hasWindow)
+        {
+            rollingInit(&checksum, srcData + position, DELTA_BLOCK_SIZE);
+            hasWindow = true;
+        }
+
+        block = findMatchingBlock(signature, rollingDigest(&checksum), srcData + position, position);
+        if (block != -1)
+        {
+            addDeltaOp(plan, literalStart, -1, position - literalStart);
+            addDeltaOp(plan, position, (off_t)block * DELTA_BLOCK_SIZE, DELTA_BLOCK_SIZE);
+            position += DELTA_BLOCK_SIZE;
+            literalStart = position;
+            hasWindow = false;
+            continue;
+        }
+
+        if (position + DELTA_BLOCK_SIZE == srcSize) break;
+        rollingRotate(&checksum, srcData[position], srcData[position + DELTA_BLOCK_SIZE]);
+        position++;
+    }
+
+    // the short last block of the destination is not signed, but an unchanged tail is still worth catching
+    if (tailLength > 0 && srcSize - literalStart >= tailLength
+        && memcmp(srcData + srcSize - tailLength, destData + tailOffset, tailLength) == 0)
+    {
+        addDeltaOp(plan, literalStart, -1, srcSize - tailLength - literalStart);
+        addDeltaOp(plan, srcSize - tailLength, tailOffset, tailLength);
+        literalStart = srcSize;
+    }
+
+    addDeltaOp(plan, literalStart, -1, srcSize - literalStart);
+}
+
+// prefers the block at the window's own offset, so unchanged regions merge into long copy ops
+int findMatchingBlock(const DeltaSignature* signature, uint32_t weak, const unsigned char* window, off_t position)
+{
+    uint64_t strong = 0;
+    boolean hasStrong = false;
+    int firstMatch = -1;
+
+    for (int i = signature->buckets[weakBucket(weak, signature->bucketBits)]; i != -1; i = signature->blocks[i].next)
+    {
+        if (signature->blocks[i].weak != weak) continue;
+
+        if (!hasStrong)
+        {
+            strong = hashBlock(window, DELTA_BLOCK_SIZE);
+            hasStrong = true;
+        }
+        if (signature->blocks[i].strong != strong) continue;
+
+        if ((off_t)i * DELTA_BLOCK_SIZE == position) return i;
+        if (firstMatch == -1) firstMatch = i;
+    }
+
+    return firstMatch;
+}
+
+void addDeltaOp(DeltaPlan* plan, off_t srcOffset, off_t destOffset, off_t length)
+{
+    DeltaOp* last = plan->opsCount > 0 ? &plan->ops[plan->opsCount - 1] : NULL;
+
+    if (length == 0) return;
+
+    if (destOffset == -1)
+        plan->literalBytes += length;
+
+    // runs of literals, and of blocks that are contiguous in both files, collapse into one op
+    if (last != NULL && last->srcOffset + last->length == srcOffset
+        && ((last->destOffset == -1 && destOffset == -1)
+            || (last->destOffset != -1 && destOffset != -1 && last->destOffset + last->length == destOffset)))
+    {
+        last->length += length;
+        return;
+    }
+
+    if (plan->opsCount == plan->opsCapacity)
+    {
+        plan->opsCapacity = plan->opsCapacity ? plan->opsCapacity * 2 : DELTA_OPS_INITIAL_CAPACITY;
+        plan->ops = (DeltaOp*)realloc(plan->ops, plan->opsCapacity * sizeof(DeltaOp));
+        if (plan->ops == NULL)
+        {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    plan->ops[plan->opsCount++] = (DeltaOp){ srcOffset, destOffset, length };
+}
+
+/*
+ * The temp file starts empty, so whatever a sparse source has as holes is
+ * simply not written, whichever file the op would take the zeros from;
+ * the final ftruncate supplies a trailing hole.
+ */
+boolean applyDeltaToTempFile(const DeltaPlan* plan, int srcFd, int destFd, int tempFd, const struct stat* srcStat, const unsigned char* srcData, const unsigned char* destData)
+{
+    boolean isSparse = isSparseFile(srcStat);
+
+    for (int i = 0; i < plan->opsCount; i++)
+    {
+        const DeltaOp* op = &plan->ops[i];
+        off_t position = op->srcOffset;
+        off_t end = op->srcOffset + op->length;
+
+        while (position < end)
+        {
+            off_t dataStart = isSparse ? seekExtent(srcFd, position, SEEK_DATA, end) : position;
+            off_t dataEnd = end;
+
+            if (dataStart != -1 && dataStart < end && isSparse)
+                dataEnd = seekExtent(srcFd, dataStart, SEEK_HOLE, end);
+
+            // no extent map after all, write the rest of the op as it is
+            if (dataStart == -1 || dataEnd == -1)
+            {
+                dataStart = position;
+                dataEnd = end;
+            }
+
+            if (dataStart < dataEnd && !applyDeltaOp(op, dataStart, dataEnd, srcFd, destFd, tempFd, srcData, destData))
+                return false;
+            position = dataEnd;
+        }
+    }
+
+    return ftruncate(tempFd, srcStat->st_size) == 0;
+}
+
+// writes the [start, end) part of op, in source offsets
+boolean applyDeltaOp(const DeltaOp* op, off_t start, off_t end, int srcFd, int destFd, int tempFd, const unsigned char* srcData, const unsigned char* destData)
+{
+    off_t shift = start - op->srcOffset;
+
+    if (op->destOffset == -1)
+        return copyRange(srcFd, start, tempFd, start, end - start, srcData + start);
+
+    return copyRange(destFd, op->destOffset + shift, tempFd, start, end - start, destData + op->destOffset + shift);
+}
+
+/*
+ * Copies length bytes between two offsets, kernel side when inFd is given
+ * and the filesystem allows it, otherwise by writing out fallbackData
+ * (the same bytes, already mapped).
+ */
+boolean copyRange(int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length, const unsigned char* fallbackData)
+{
+    off_t done = 0;
+
+    while (inFd != -1 && done < length)
+    {
+        loff_t from = inOffset + done;
+        loff_t to = outOffset + done;
+        ssize_t bytesCopied = copy_file_range(inFd, &from, outFd, &to, length - done, 0);
+
+        if (bytesCopied > 0)
+        {
+            done += bytesCopied;
+            continue;
+        }
+        if (bytesCopied == -1 && errno == EINTR) continue;
+        if (bytesCopied == -1 && !isCopyUnsupported(errno)) return false;
+        break;
+    }
+
+    while (done < length)
+    {
+        ssize_t bytesWritten = pwrite(outFd, fallbackData + done, length - done, outOffset + done);
+
+        if (bytesWritten == -1)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        done += bytesWritten;
+    }
+
+    return true;
+}
+
+void rollingInit(RollingChecksum* checksum, const unsigned char* data, size_t length)
+{
+    checksum->a = 0;
+    checksum->b = 0;
+    checksum->length = length;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        checksum->a += data[i];
+        checksum->b += checksum->a;
+    }
+}
+
+void rollingRotate(RollingChecksum* checksum, unsigned char outByte, unsigned char inByte)
+{
+    checksum->a += inByte - outByte;
+    checksum->b += checksum->a - (uint32_t)checksum->length * outByte;
+}
+
+uint32_t rollingDigest(const RollingChecksum* checksum)
+{
+    return (checksum->a & 0xFFFF) | (checksum->b << 16);
+}
+
+// the low half of a weak checksum is a plain byte sum, so mix it before picking a bucket
+unsigned int weakBucket(uint32_t weak, int bits)
+{
+    return (uint32_t)(weak * 2654435761u) >> (32 - bits);
+}
+
+uint64_t hashBlock(const void* data, size_t length)
+{
+    ContentHash hash;
+
+    hashInit(&hash);
+    hashUpdate(&hash, data, length);
+    return hashDigest(&hash);
+}
+
+/*
+ * io_uring backend. Plan entries are handled in batches: for the small
+ * files of a batch every step (statx, open, read, open for writing,
+ * write, close) is queued for all of them at once and reaped in one
+ * io_uring_enter, so the device sees up to 2 * IO_RING_BATCH_SIZE
+ * requests instead of one. Anything the ring path does not cover (big or
+ * special files, manifest hits, errors before the destination is
+ * touched) goes through syncEntry, and the log is written in plan order,
+ * so the outcome and output are the same as the synchronous path.
+ */
+void syncDirsWithRing(const SyncContext* context, SyncPlan* plan, IoRing* ring, OutputBuffer* output)
+{
+    OutputBuffer entryOutput = { NULL, 0, 0 };
+    Arena scratch = { NULL, NULL };
+    RingTask* tasks = (RingTask*)malloc(IO_RING_BATCH_SIZE * sizeof(RingTask));
+
+    if (tasks == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int start = 0; start < plan->entriesCount; start += IO_RING_BATCH_SIZE)
+    {
+        int count = plan->entriesCount - start < IO_RING_BATCH_SIZE ? plan->entriesCount - start : IO_RING_BATCH_SIZE;
+
+        for (int i = 0; i < count; i++)
+            prepareRingTask(context, &plan->entries[start + i], &tasks[i]);
+
+        runRingBatch(context, ring, tasks, count, &scratch);
+
+        for (int i = 0; i < count; i++)
+        {
+            finishRingTask(context, &tasks[i], output != NULL ? output : &entryOutput, &scratch);
+            if (output == NULL) flushOutput(&entryOutput);
+        }
+
+        arenaReset(&scratch);
+    }
+
+    free(entryOutput.data);
+    arenaRelease(&scratch);
+    free(tasks);
+}
+
+void prepareRingTask(const SyncContext* context, SyncEntry* entry, RingTask* task)
+{
+    const ManifestRecord* record = NULL;
+
+    memset(task, 0, sizeof(RingTask));
+    task->entry = entry;
+    task->srcFd = -1;
+    task->destFd = -1;
+    task->writeFd = -1;
+    task->useSyncPath = true;
+
+    if (entry->kind == SYNC_DEST_ONLY) return;
+    if (entry->srcFile->size > IO_RING_SMALL_FILE_SIZE) return;
+
+    // link groups are coordinated in syncEntry
+    if (context->options->dedupMode != DEDUP_NONE) return;
+    if (context->options->preserveHardLinks && entry->srcFile->linksCount > 1) return;
+    if (entry->kind == SYNC_BOTH && entry->destFile->size > IO_RING_SMALL_FILE_SIZE) return;
+
+    // the ring compares whole files, the cheaper policies decide (mostly) without reading anything
+    if (entry->kind == SYNC_BOTH && context->options->comparePolicy != COMPARE_POLICY_FULL) return;
+
+    // a manifest hit needs no I/O at all
+    if (entry->kind == SYNC_BOTH && context->manifest != NULL)
+    {
+        record = findManifestRecord(context->manifest, fileName(context->src, entry->srcFile));
+        if (record != NULL && isUnchangedSinceManifest(record, entry->srcFile, entry->destFile)) return;
+    }
+
+    task->useSyncPath = false;
+}
+
+void runRingBatch(const SyncContext* context, IoRing* ring, RingTask* tasks, int count, Arena* scratch)
+{
+    int srcDirFd = context->src->fd;
+    int destDirFd = context->dest->fd;
+    struct io_uring_sqe* sqe = NULL;
+
+    // statx both sides first, so nothing but regular files is ever opened here
+    for (int i = 0; i < count; i++)
+    {
+        RingTask* task = &tasks[i];
+        const char* name = NULL;
+
+        if (task->useSyncPath) continue;
+        name = fileName(context->src, task->entry->srcFile);
+
+        sqe = ioRingNext(ring, IORING_OP_STATX, srcDirFd, &task->srcStatResult);
+        sqe->addr = (uintptr_t)name;
+        sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+        sqe->off = (uintptr_t)&task->srcStat;
+
+        if (task->entry->kind != SYNC_BOTH) continue;
+
+        sqe = ioRingNext(ring, IORING_OP_STATX, destDirFd, &task->destStatResult);
+        sqe->addr = (uintptr_t)name;
+        sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+        sqe->off = (uintptr_t)&task->destStat;
+    }
+    ioRingWait(ring);
+
+    for (int i = 0; i < count; i++)
+    {
+        RingTask* task = &tasks[i];
+        const char* name = NULL;
+        boolean isBoth = false;
+
+        if (task->useSyncPath) continue;
+        isBoth = task->entry->kind == SYNC_BOTH;
+
+        if (task->srcStatResult < 0 || !S_ISREG(task->srcStat.stx_mode) || task->srcStat.stx_size > IO_RING_SMALL_FILE_SIZE
+            || (isBoth && (task->destStatResult < 0 || !S_ISREG(task->destStat.stx_mode) || task->destStat.stx_size > IO_RING_SMALL_FILE_SIZE)))
+        {
+            task->useSyncPath = true;
+            continue;
+        }
+
+        name = fileName(context->src, task->entry->srcFile);
+
+        sqe = ioRingNext(ring, IORING_OP_OPENAT, srcDirFd, &task->srcFd);
+        sqe->addr = (uintptr_t)name;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+        if (!isBoth) continue;
+
+        sqe = ioRingNext(ring, IORING_OP_OPENAT, destDirFd, &task->destFd);
+        sqe->addr = (uintptr_t)name;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    }
+    ioRingWait(ring);
+
+    // one byte more than statx promised tells us when a file grew in the meantime
+    for (int i = 0; i < count; i++)
+    {
+        RingTask* task = &tasks[i];
+
+        if (task->useSyncPath) continue;
+
+        if (task->srcFd < 0 || (task->entry->kind == SYNC_BOTH && task->destFd < 0))
+        {
+            task->useSyncPath = true;
+            continue;
+        }
+
+        task->srcBuffer = (char*)arenaAlloc(scratch, task->srcStat.stx_size + 1, IO_BUFFER_ALIGNMENT);
+        sqe = ioRingNext(ring, IORING_OP_READ, task->srcFd, &task->srcLength);
+        sqe->addr = (uintptr_t)task->srcBuffer;
+        sqe->len = task->srcStat.stx_size + 1;
+
+        if (task->entry->kind != SYNC_BOTH) continue;
+
+        task->destBuffer = (char*)arenaAlloc(scratch, task->destStat.stx_size + 1, IO_BUFFER_ALIGNMENT);
+        sqe = ioRingNext(ring, IORING_OP_READ, task->destFd, &task->destLength);
+        sqe->addr = (uintptr_t)task->destBuffer;
+        sqe->len = task->destStat.stx_size + 1;
+    }
+    ioRingWait(ring);
+
+    // decide, then open the destinations that get rewritten and drop the read-side fds
+    for (int i = 0; i < count; i++)
+    {
+        RingTask* task = &tasks[i];
+        SyncEntry* entry = task->entry;
+
+        if (task->destFd >= 0)
+        {
+            ioRingNext(ring, IORING_OP_CLOSE, task->destFd, &task->closeResult);
+            task->destFd = -1;
+        }
+
+        if (task->useSyncPath) continue;
+
+        if (task->srcLength < 0 || task->srcLength > (int)task->srcStat.stx_size
+            || (entry->kind == SYNC_BOTH && (task->destLength < 0 || task->destLength > (int)task->destStat.stx_size)))
+        {
+            task->useSyncPath = true;
+            continue;
+        }
+
+        countStat(&runStats.bytesRead, task->srcLength + (entry->kind == SYNC_BOTH ? task->destLength : 0));
+        if (entry->kind == SYNC_BOTH && task->srcLength == task->destLength)
+            countStat(&runStats.bytesCompared, task->srcLength);
+
+        task->isIdentical = entry->kind == SYNC_BOTH && task->srcLength == task->destLength
+            && memcmp(task->srcBuffer, task->destBuffer, task->srcLength) == 0;
+        task->needsCopy = entry->kind == SYNC_NEW
+            || (!task->isIdentical && isFirstNewer(entry->srcFile, entry->destFile));
+        if (!task->needsCopy) continue;
+
+        makeTempName(task->tempName);
+        sqe = ioRingNext(ring, IORING_OP_OPENAT, destDirFd, &task->writeFd);
+        sqe->addr = (uintptr_t)task->tempName;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+        sqe->len = task->srcStat.stx_mode & 07777;
+    }
+    ioRingWait(ring);
+
+    for (int i = 0; i < count; i++)
+    {
+        RingTask* task = &tasks[i];
+
+        if (task->useSyncPath || !task->needsCopy) continue;
+
+        task->writeResult = task->writeFd;
+        if (task->writeFd < 0) continue;
+
+        sqe = ioRingNext(ring, IORING_OP_WRITE, task->writeFd, &task->writeResult);
+        sqe->addr = (uintptr_t)task->srcBuffer;
+        sqe->len = task->srcLength;
+    }
+    ioRingWait(ring);
+
+    // there is no ring op for these two, and they are cheap next to the data
+    for (int i = 0; i < count; i++)
+    {
+        RingTask* task = &tasks[i];
+        struct timespec times[2] = {
+            { .tv_nsec = UTIME_OMIT },
+            { task->srcStat.stx_mtime.tv_sec, task->srcStat.stx_mtime.tv_nsec }
+        };
+
+        if (task->writeFd < 0) continue;
+
+        if (task->writeResult == task->srcLength)
+        {
+            countStat(&runStats.bytesWritten, task->srcLength);
+            if (fchmod(task->writeFd, task->srcStat.stx_mode & 07777) == -1
+                || futimens(task->writeFd, times) == -1)
+                task->writeResult = -errno;
+        }
+        else if (task->writeResult >= 0)
+        {
+            task->writeResult = -EIO;
+        }
+
+        if (task->writeResult >= 0 && context->options->durability == DURABILITY_FILE)
+        {
+            sqe = ioRingNext(ring, IORING_OP_FSYNC, task->writeFd, &task->writeSyncResult);
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        }
+    }
+    // the fsyncs have to be done before their fds are closed, a round of their own keeps that simple
+    ioRingWait(ring);
+
+    for (int i = 0; i < count; i++)
+    {
+        RingTask* task = &tasks[i];
+
+        if (task->writeFd < 0) continue;
+        ioRingNext(ring, IORING_OP_CLOSE, task->writeFd, &task->writeCloseResult);
+        task->writeFd = -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (tasks[i].srcFd < 0) continue;
+        ioRingNext(ring, IORING_OP_CLOSE, tasks[i].srcFd, &tasks[i].closeResult);
+        tasks[i].srcFd = -1;
+    }
+    ioRingWait(ring);
+}
+
+// mirrors syncEntry, with the I/O already done by the batch
+void finishRingTask(const SyncContext* context, RingTask* task, OutputBuffer* output, Arena* scratch)
+{
+    SyncEntry* entry = task->entry;
+    const DirData* src = context->src;
+    const DirData* dest = context->dest;
+    const char* name = fileName(src, entry->srcFile);
+    const char* prefix = src->relativePath != NULL ? src->relativePath : "";
+
+    if (task->useSyncPath)
+    {
+        syncEntry(context, entry, output, scratch);
+        return;
+    }
+
+    if (task->needsCopy)
+    {
+        int error = task->writeResult < 0 ? -task->writeResult
+            : task->writeSyncResult < 0 ? -task->writeSyncResult
+            : task->writeCloseResult < 0 ? -task->writeCloseResult
+            : 0;
+
+        // the temp file is complete, the rename is what makes it the destination
+        if (error == 0 && renameat(dest->fd, task->tempName, dest->fd, name) == -1)
+            error = errno;
+
+        if (error != 0)
+        {
+            unlinkat(dest->fd, task->tempName, 0);
+            flushOutput(output);
+            errno = error;
+            perror("cp failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (context->manifest != NULL && (task->needsCopy || task->isIdentical))
+    {
+        entry->contentHash = hashBlock(task->srcBuffer, task->srcLength);
+        entry->hasContentHash = true;
+    }
+
+    if (entry->kind == SYNC_NEW)
+    {
+        logFile(output, LOG_EVENT_NEW, prefix, name);
+        logTransfer(output, LOG_EVENT_COPIED, src, dest, name, task->srcLength, task->srcLength);
+        entry->outcome = OUTCOME_COPIED;
+    }
+    else if (task->needsCopy)
+    {
+        logTransfer(output, LOG_EVENT_COPIED, src, dest, name, task->srcLength, task->srcLength);
+        logFile(output, LOG_EVENT_UPDATED, prefix, name);
+        entry->outcome = OUTCOME_COPIED;
+    }
+    else if (task->isIdentical)
+    {
+        logFile(output, LOG_EVENT_IDENTICAL, prefix, name);
+        entry->outcome = OUTCOME_IDENTICAL;
+    }
+    else
+    {
+        logFile(output, LOG_EVENT_DEST_NEWER, prefix, name);
+        entry->outcome = OUTCOME_SKIPPED;
+    }
+}
+
+/*
+ * Sets up the ring with plain syscalls, no liburing. Returns false when
+ * the kernel has no io_uring (or it is disabled), or lacks one of the
+ * opcodes runRingBatch uses, so callers can fall back to blocking I/O
+ * as a whole instead of file by file.
+ */
+boolean ioRingInit(IoRing* ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    size_t sqSize = 0;
+    size_t cqSize = 0;
+    char* map = NULL;
+    unsigned int* sqArray = NULL;
+
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(IoRing));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return false;
+
+    // one mapping for both rings needs 5.4, the opcodes themselves 5.6
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)
+        || !ioRingSupportsOps(ring->fd))
+    {
+        close(ring->fd);
+        return false;
+    }
+
+    sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringMapSize = sqSize > cqSize ? sqSize : cqSize;
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->ringMap = mmap(NULL, ring->ringMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ringMap == MAP_FAILED)
+    {
+        close(ring->fd);
+        return false;
+    }
+
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        munmap(ring->ringMap, ring->ringMapSize);
+        close(ring->fd);
+        return false;
+    }
+
+    map = (char*)ring->ringMap;
+    ring->sqHead = (unsigned int*)(map + params.sq_off.head);
+    ring->sqTail = (unsigned int*)(map + params.sq_off.tail);
+    ring->sqMask = *(unsigned int*)(map + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->cqHead = (unsigned int*)(map + params.cq_off.head);
+    ring->cqTail = (unsigned int*)(map + params.cq_off.tail);
+    ring->cqMask = *(unsigned int*)(map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(map + params.cq_off.cqes);
+
+    // sqe slots are used in ring order, so the indirection array never changes
+    sqArray = (unsigned int*)(map + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++) sqArray[i] = i;
+
+    return true;
+}
+
+// a kernel too old to answer the probe (before 5.6) has none of the file opcodes either
+boolean ioRingSupportsOps(int ringFd)
+{
+    static const unsigned char usedOps[] = {
+        IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE
+    };
+    struct io_uring_probe* probe = NULL;
+    boolean isSupported = true;
+
+    probe = (struct io_uring_probe*)calloc(1, sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+    {
+        perror("Calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) isSupported = false;
+
+    for (size_t i = 0; isSupported && i < sizeof(usedOps); i++)
+    {
+        isSupported = usedOps[i] <= probe->last_op && (probe->ops[usedOps[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return isSupported;
+}
+
+void ioRingDestroy(IoRing* ring)
+{
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->ringMap, ring->ringMapSize);
+    close(ring->fd);
+}
+
+// queues one op; its result lands in *result once ioRingWait returns
+struct io_uring_sqe* ioRingNext(IoRing* ring, unsigned char opcode, int fd, int* result)
+{
+    unsigned int tail = *ring->sqTail;
+    struct io_uring_sqe* sqe = NULL;
+
+    if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries)
+    {
+        // a full queue is handed over without waiting, the completions are reaped later
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 0, 0, NULL, 0);
+        if (submitted < 0)
+        {
+            perror("io_uring_enter failed");
+            exit(EXIT_FAILURE);
+        }
+        ring->queued -= submitted;
+        ring->pending += submitted;
+    }
+
+    sqe = &ring->sqes[tail & ring->sqMask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t)result;
+
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+
+    return sqe;
+}
+
+// submits everything queued and blocks until every op has completed
+void ioRingWait(IoRing* ring)
+{
+    while (ring->queued > 0 || ring->pending > 0)
+    {
+        unsigned int head = *ring->cqHead;
+        unsigned int tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+        {
+            int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (submitted < 0)
+            {
+                if (errno == EINTR) continue;
+                perror("io_uring_enter failed");
+                exit(EXIT_FAILURE);
+            }
+            ring->queued -= submitted;
+            ring->pending += submitted;
+            continue;
+        }
+
+        for (; head != tail; head++)
+        {
+            const struct io_uring_cqe* cqe = &ring->cqes[head & ring->cqMask];
+            *(int*)(uintptr_t)cqe->user_data = cqe->res;
+            ring->pending--;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Watch mode. After the initial sync the source directory is watched with
+ * inotify. Events only mark names dirty; once no new event has come in for
+ * WATCH_DEBOUNCE_MS (or WATCH_MAX_DELAY_MS after the first one, so a file
+ * that is written continuously still gets synced), the dirty names are
+ * re-stat'ed, patched into the sorted listings and synced on their own.
+ * A queue overflow falls back to a full rescan. SIGINT and SIGTERM end the
+ * loop between rounds. The manifest is only written by full syncs, so the
+ * next start compares whatever changed while watching.
+ */
+void watchDirs(DirData* src, DirData* dest, const SyncOptions* options)
+{
+    DirtySet dirty = { { NULL, 0, 0 }, NULL, 0, 0 };
+    struct sigaction stopAction;
+    sigset_t blocked;
+    sigset_t original;
+    struct pollfd watchPoll;
+    long long firstDirty = 0;
+    long long lastEvent = 0;
+    boolean rescanAll = false;
+    boolean keepWatching = true;
+    int inotifyFd = -1;
+
+    inotifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotifyFd == -1 || inotify_add_watch(inotifyFd, src->path, WATCH_EVENTS) == -1)
+    {
+        perror("inotify failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // the signals stay blocked except inside ppoll, so a stop request can never slip in before the wait
+    memset(&stopAction, 0, sizeof(stopAction));
+    stopAction.sa_handler = requestWatchStop;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigprocmask(SIG_BLOCK, &blocked, &original);
+    sigaction(SIGINT, &stopAction, NULL);
+    sigaction(SIGTERM, &stopAction, NULL);
+
+    watchPoll.fd = inotifyFd;
+    watchPoll.events = POLLIN;
+
+    logMessage(NULL, "Watching %s for changes...\n", src->path);
+
+    while (keepWatching && !watchStopRequested)
+    {
+        struct timespec timeout;
+        boolean isDirty = dirty.filesCount > 0 || rescanAll;
+        int ready = 0;
+
+        if (isDirty)
+        {
+            long long now = monotonicMillis();
+            long long deadline = lastEvent + WATCH_DEBOUNCE_MS;
+            long long remaining = 0;
+
+            if (deadline > firstDirty + WATCH_MAX_DELAY_MS) deadline = firstDirty + WATCH_MAX_DELAY_MS;
+            remaining = deadline > now ? deadline - now : 0;
+            timeout.tv_sec = remaining / 1000;
+            timeout.tv_nsec = (remaining % 1000) * 1000000;
+        }
+
+        ready = ppoll(&watchPoll, 1, isDirty ? &timeout : NULL, &original);
+        if (ready == -1)
+        {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            exit(EXIT_FAILURE);
+        }
+
+        if (ready > 0)
+        {
+            lastEvent = monotonicMillis();
+            if (!isDirty) firstDirty = lastEvent;
+            keepWatching = readWatchEvents(inotifyFd, &dirty, &rescanAll);
+            continue;
+        }
+
+        if (rescanAll)
+            rescanDirs(src, dest, options);
+        else
+            resyncDirtyFiles(src, dest, options, &dirty);
+        syncDestFilesystem(dest, options->durability);
+        resetLinkTable(&linkTable);
+
+        rescanAll = false;
+        dirty.filesCount = 0;
+        dirty.names.length = 0;
+    }
+
+    if (!keepWatching)
+        logMessage(NULL, "Source directory '%s' is gone, no longer watching.\n", src->path);
+
+    sigprocmask(SIG_SETMASK, &original, NULL);
+    close(inotifyFd);
+    free(dirty.files);
+    free(dirty.names.data);
+}
+
+// drains the inotify fd; false once the watched directory itself went away
+boolean readWatchEvents(int inotifyFd, DirtySet* dirty, boolean* rescanAll)
+{
+    char buffer[WATCH_EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    boolean keepWatching = true;
+    ssize_t length = 0;
+
+    while ((length = read(inotifyFd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char* cursor = buffer; cursor < buffer + length; cursor += sizeof(struct inotify_event) + ((struct inotify_event*)cursor)->len)
+        {
+            const struct inotify_event* event = (const struct inotify_event*)cursor;
+            size_t nameLength = 0;
+
+            if (event->mask & IN_Q_OVERFLOW) *rescanAll = true;
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) keepWatching = false;
+
+            // only the files of the directory itself are synced, same as a one-shot run
+            if (event->len == 0 || (event->mask & IN_ISDIR)) continue;
+
+            nameLength = strlen(event->name);
+            *appendFileData(&dirty->files, &dirty->filesCount, &dirty->filesCapacity) = (FileData)
+            {
+                appendName(&dirty->names, event->name, nameLength),
+                nameLength
+            };
+        }
+    }
+
+    if (length == -1 && errno != EAGAIN && errno != EINTR)
+    {
+        perror("inotify read failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return keepWatching;
+}
+
+void resyncDirtyFiles(DirData* src, DirData* dest, const SyncOptions* options, DirtySet* dirty)
+{
+    const char* names = NULL;
+    OutputBuffer output = { NULL, 0, 0 };
+    Arena scratch = { NULL, NULL };
+    SyncContext context = { src, dest, options, NULL };
+    SyncPlan plan = { NULL, 0 };
+    int uniqueCount = 0;
+
+    // the sort hands back an array of exactly filesCount entries
+    sortFileArray(dirty->names.data, &dirty->files, dirty->filesCount);
+    dirty->filesCapacity = dirty->filesCount;
+    names = dirty->names.data;
+
+    // collapse repeats, a burst of writes to one file is one resync
+    for (int i = 0; i < dirty->filesCount; i++)
+    {
+        if (uniqueCount > 0 && strcmp(names + dirty->files[i].nameOffset, names + dirty->files[uniqueCount - 1].nameOffset) == 0)
+            continue;
+        dirty->files[uniqueCount++] = dirty->files[i];
+    }
+    dirty->filesCount = uniqueCount;
+
+    // listings first, SyncEntry pointers into them are only taken once nothing moves any more
+    for (int i = 0; i < dirty->filesCount; i++)
+    {
+        const char* name = names + dirty->files[i].nameOffset;
+
+        if (isSkippedName(src, name, true)) continue;
+
+        refreshDirEntry(src, name);
+        refreshDirEntry(dest, name);
+    }
+
+    plan.entries = (SyncEntry*)malloc((dirty->filesCount + 1) * sizeof(SyncEntry));
+    if (plan.entries == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < dirty->filesCount; i++)
+    {
+        const char* name = names + dirty->files[i].nameOffset;
+        boolean inSrc = false;
+        boolean inDest = false;
+        int srcIdx = findSortedFile(src, name, &inSrc);
+        int destIdx = findSortedFile(dest, name, &inDest);
+
+        if (inSrc)
+            addSyncEntry(&plan, inDest ? SYNC_BOTH : SYNC_NEW, &src->files[srcIdx], inDest ? &dest->files[destIdx] : NULL);
+    }
+
+    if (plan.entriesCount > 0)
+        logMessage(&output, "Resynchronizing %d changed file%s...\n", plan.entriesCount, plan.entriesCount == 1 ? "" : "s");
+
+    for (int i = 0; i < plan.entriesCount; i++)
+    {
+        syncEntry(&context, &plan.entries[i], &output, &scratch);
+        flushOutput(&output);
+        arenaReset(&scratch);
+    }
+    flushOutput(&output);
+    syncDestDirectory(dest, options->durability);
+
+    free(plan.entries);
+    free(output.data);
+    arenaRelease(&scratch);
+
+    // copies changed the destination side of these names
+    for (int i = 0; i < dirty->filesCount; i++)
+        refreshDirEntry(dest, names + dirty->files[i].nameOffset);
+
+    compactNames(src);
+    compactNames(dest);
+}
+
+void rescanDirs(DirData* src, DirData* dest, const SyncOptions* options)
+{
+    DirData* dirs[2] = { src, dest };
+
+    logMessage(NULL, "Too many changes to track, rescanning %s...\n", src->path);
+
+    for (int i = 0; i < 2; i++)
+    {
+        free(dirs[i]->files);
+        free(dirs[i]->subdirs);
+        dirs[i]->files = NULL;
+        dirs[i]->subdirs = NULL;
+        dirs[i]->names.length = 0;
+
+        __ls(dirs[i], false, i == 0);
+        sortFilesLexicographically(dirs[i]);
+    }
+
+    syncDirs(src, dest, options, NULL);
+}
+
+// brings one name of a sorted listing up to date: inserted, updated in place or removed
+void refreshDirEntry(DirData* dir, const char* name)
+{
+    struct statx entryStat;
+    boolean found = false;
+    int idx = findSortedFile(dir, name, &found);
+    boolean exists = statEntry(dir->fd, name, &entryStat) && !S_ISDIR(entryStat.stx_mode);
+    FileData* file = NULL;
+
+    if (!exists)
+    {
+        if (found)
+        {
+            memmove(&dir->files[idx], &dir->files[idx + 1], (dir->filesCount - idx - 1) * sizeof(FileData));
+            dir->filesCount--;
+        }
+        return;
+    }
+
+    if (!found)
+    {
+        size_t nameLength = strlen(name);
+
+        dir->files = (FileData*)realloc(dir->files, (dir->filesCount + 1) * sizeof(FileData));
+        if (dir->files == NULL)
+        {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        memmove(&dir->files[idx + 1], &dir->files[idx], (dir->filesCount - idx) * sizeof(FileData));
+        dir->filesCount++;
+
+        dir->files[idx].nameOffset = appendName(&dir->names, name, nameLength);
+        dir->files[idx].nameLength = nameLength;
+    }
+
+    file = &dir->files[idx];
+    setFileStat(file, &entryStat);
+}
+
+// binary search over a sorted listing; without a match the result is where the name would go
+int findSortedFile(const DirData* dir, const char* name, boolean* found)
+{
+    int low = 0;
+    int high = dir->filesCount;
+
+    while (low < high)
+    {
+        int middle = low + (high - low) / 2;
+        int order = strcmp(fileName(dir, &dir->files[middle]), name);
+
+        if (order == 0)
+        {
+            *found = true;
+            return middle;
+        }
+        if (order < 0) low = middle + 1;
+        else high = middle;
+    }
+
+    *found = false;
+    return low;
+}
+
+// names of removed files stay in the blob, so a long-running watch rebuilds it once they dominate
+void compactNames(DirData* dir)
+{
+    NamesBlob compacted = { NULL, 0, 0 };
+    size_t liveLength = 0;
+
+    for (int i = 0; i < dir->filesCount; i++) liveLength += dir->files[i].nameLength + 1;
+    for (int i = 0; i < dir->subdirsCount; i++) liveLength += dir->subdirs[i].nameLength + 1;
+
+    if (dir->names.length <= 2 * liveLength + NAMES_INITIAL_CAPACITY) return;
+
+    for (int i = 0; i < dir->filesCount; i++)
+        dir->files[i].nameOffset = appendName(&compacted, fileName(dir, &dir->files[i]), dir->files[i].nameLength);
+    for (int i = 0; i < dir->subdirsCount; i++)
+        dir->subdirs[i].nameOffset = appendName(&compacted, fileName(dir, &dir->subdirs[i]), dir->subdirs[i].nameLength);
+
+    free(dir->names.data);
+    dir->names = compacted;
+}
+
+long long monotonicMillis()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void requestWatchStop(int signal)
+{
+    (void)signal;
+    watchStopRequested = 1;
+}
+
+// sampling reads procfs, so an empty phase measured up front tells us how much of every delta is our own
+void initRunStats(RunStats* stats, boolean enabled, int intervalSeconds)
+{
+    PhaseStats first;
+    PhaseStats second;
+    pthread_condattr_t attributes;
+
+    memset(stats, 0, sizeof(RunStats));
+    stats->enabled = enabled;
+    if (!enabled) return;
+
+    sampleCounters(&first);
+    sampleCounters(&second);
+    stats->overhead.readCalls = second.readCalls - first.readCalls;
+    stats->overhead.writeCalls = second.writeCalls - first.writeCalls;
+    stats->startNs = statsClock();
+
+    stats->intervalSeconds = intervalSeconds;
+    if (intervalSeconds == 0) return;
+
+    pthread_mutex_init(&stats->lock, NULL);
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&stats->wakeup, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    if (pthread_create(&stats->reporter, NULL, statsReporterMain, stats) != 0)
+    {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void finishRunStats(RunStats* stats)
+{
+    if (stats->intervalSeconds == 0) return;
+
+    pthread_mutex_lock(&stats->lock);
+    stats->stopRequested = true;
+    pthread_cond_signal(&stats->wakeup);
+    pthread_mutex_unlock(&stats->lock);
+
+    pthread_join(stats->reporter, NULL);
+    pthread_cond_destroy(&stats->wakeup);
+    pthread_mutex_destroy(&stats->lock);
+    stats->intervalSeconds = 0;
+}
+
+void beginPhase(RunStats* stats)
+{
+    if (stats->enabled) sampleCounters(&stats->start);
+}
+
+void endPhase(RunStats* stats, Phase phase)
+{
+    PhaseStats now;
+    PhaseStats* total = &stats->phases[phase];
+
+    if (!stats->enabled) return;
+
+    sampleCounters(&now);
+    __atomic_fetch_add(&total->elapsedNs, now.elapsedNs - stats->start.elapsedNs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->readCalls, now.readCalls - stats->start.readCalls - stats->overhead.readCalls, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->writeCalls, now.writeCalls - stats->start.writeCalls - stats->overhead.writeCalls, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->forks, now.forks - stats->start.forks, __ATOMIC_RELAXED);
+}
+
+// counters that cannot be read (no procfs) simply stay at zero
+void sampleCounters(PhaseStats* sample)
+{
+    struct timespec now;
+    char line[256];
+    FILE* file = NULL;
+
+    memset(sample, 0, sizeof(PhaseStats));
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sample->elapsedNs = (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    if ((file = fopen("/proc/self/io", "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            sscanf(line, "syscr: %llu", &sample->readCalls);
+            sscanf(line, "syscw: %llu", &sample->writeCalls);
+        }
+        fclose(file);
+    }
+
+    // the "processes" line of /proc/stat would count every fork on the machine
+    sample->forks = __atomic_load_n(&runStats.forks, __ATOMIC_RELAXED);
+}
+
+// prints an interim line every intervalSeconds until finishRunStats wakes it up
+void* statsReporterMain(void* arg)
+{
+    RunStats* stats = (RunStats*)arg;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    pthread_mutex_lock(&stats->lock);
+    while (!stats->stopRequested)
+    {
+        deadline.tv_sec += stats->intervalSeconds;
+        while (!stats->stopRequested
+            && pthread_cond_timedwait(&stats->wakeup, &stats->lock, &deadline) != ETIMEDOUT);
+
+        if (stats->stopRequested) break;
+
+        pthread_mutex_unlock(&stats->lock);
+        printRunStats(stats, false);
+        pthread_mutex_lock(&stats->lock);
+    }
+    pthread_mutex_unlock(&stats->lock);
+
+    return NULL;
+}
+
+// 0 when --stats is off, so the hot paths do not pay for a clock they never report
+long long statsClock()
+{
+    struct timespec now;
+
+    if (!runStats.enabled) return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void countStat(unsigned long long* counter, unsigned long long amount)
+{
+    if (runStats.enabled) __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+void recordLatency(LatencyHistogram* histogram, long long startNs)
+{
+    unsigned long long elapsedNs = 0;
+    unsigned long long micros = 0;
+    unsigned long long previousMax = 0;
+    int bucket = 0;
+
+    if (!runStats.enabled) return;
+
+    elapsedNs = statsClock() - startNs;
+    micros = elapsedNs / 1000;
+    while (micros >= 2 && bucket < LATENCY_BUCKETS - 1)
+    {
+        micros >>= 1;
+        bucket++;
+    }
+
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->totalNs, elapsedNs, __ATOMIC_RELAXED);
+
+    previousMax = __atomic_load_n(&histogram->maxNs, __ATOMIC_RELAXED);
+    while (elapsedNs > previousMax
+        && !__atomic_compare_exchange_n(&histogram->maxNs, &previousMax, elapsedNs, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * One line of JSON on stderr, so the regular log on stdout stays
+ * untouched. Interim lines (final false) show the phases finished so
+ * far and the counters as they are at that moment. Bytes are logical:
+ * a reflinked file counts as read and written in full. Files handled by
+ * the io_uring batches show up in the byte counts but not in the
+ * latency histograms, which only time single files.
+ */
+void printRunStats(RunStats* stats, boolean isFinal)
+{
+    const char* phaseNames[PHASES_COUNT] = { "ls", "sort", "sync" };
+    const char* fastPathNames[FAST_PATHS_COUNT] = { "manifest", "size", "metadata", "sample" };
+    OutputBuffer output = { NULL, 0, 0 };
+
+    appendOutput(&output, "{\"final\":%s,\"elapsed_ms\":%.3f,\"phases\":{",
+        isFinal ? "true" : "false", (statsClock() - stats->startNs) / 1000000.0);
+    for (int i = 0; i < PHASES_COUNT; i++)
+    {
+        PhaseStats* phase = &stats->phases[i];
+
+        appendOutput(&output, "%s\"%s\":{\"ms\":%.3f,\"read_syscalls\":%llu,\"write_syscalls\":%llu,\"forks\":%llu}",
+            i > 0 ? "," : "", phaseNames[i],
+            __atomic_load_n(&phase->elapsedNs, __ATOMIC_RELAXED) / 1000000.0,
+            __atomic_load_n(&phase->readCalls, __ATOMIC_RELAXED),
+            __atomic_load_n(&phase->writeCalls, __ATOMIC_RELAXED),
+            __atomic_load_n(&phase->forks, __ATOMIC_RELAXED));
+    }
+
+    appendOutput(&output, "},\"bytes\":{\"read\":%llu,\"written\":%llu,\"compared\":%llu,\"linked\":%llu},\"fast_paths\":{",
+        __atomic_load_n(&stats->bytesRead, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats->bytesWritten, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats->bytesCompared, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats->bytesLinked, __ATOMIC_RELAXED));
+    for (int i = 0; i < FAST_PATHS_COUNT; i++)
+    {
+        appendOutput(&output, "%s\"%s\":%llu", i > 0 ? "," : "", fastPathNames[i],
+            __atomic_load_n(&stats->fastPaths[i], __ATOMIC_RELAXED));
+    }
+
+    appendOutput(&output, "},\"latency_us\":{");
+    appendHistogram(&output, "compare", &stats->compareLatency);
+    appendOutput(&output, ",");
+    appendHistogram(&output, "copy", &stats->copyLatency);
+    appendOutput(&output, "}}\n");
+
+    // a single write, so an interim line never interleaves with other output on stderr
+    fwrite(output.data, 1, output.length, stderr);
+    free(output.data);
+}
+
+// buckets are keyed by their upper bound in microseconds, empty ones are left out
+void appendHistogram(OutputBuffer* output, const char* name, LatencyHistogram* histogram)
+{
+    boolean isFirst = true;
+
+    appendOutput(output, "\"%s\":{\"count\":%llu,\"total\":%.3f,\"max\":%.3f,\"buckets\":{", name,
+        __atomic_load_n(&histogram->count, __ATOMIC_RELAXED),
+        __atomic_load_n(&histogram->totalNs, __ATOMIC_RELAXED) / 1000.0,
+        __atomic_load_n(&histogram->maxNs, __ATOMIC_RELAXED) / 1000.0);
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        unsigned long long bucketCount = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+
+        if (bucketCount == 0) continue;
+        appendOutput(output, "%s\"%llu\":%llu", isFirst ? "" : ",", 1ULL << (i + 1), bucketCount);
+        isFirst = false;
+    }
+    appendOutput(output, "}}");
 }
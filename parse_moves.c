@@ -0,0 +1,74 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "san_parser.h"
+
+#define READ_BUFFER_SIZE 65536
+
+void printMove(const char* uci, void* context);
+void feedStdin(SanParser* parser);
+
+/*
+ * parse_moves.py without python-chess: parse_moves '<pgn text>' prints
+ * the main line of the first game as space separated UCI moves, with
+ * the same messages on stderr. parse_moves - reads the PGN from stdin.
+ */
+int main(int argc, char** argv)
+{
+    SanParser* parser = NULL;
+    int movesCount = 0;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s 'pgn_moves'\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    parser = createSanParser(printMove, &movesCount);
+    if (strcmp(argv[1], "-") == 0)
+        feedStdin(parser);
+    else
+        feedSanParser(parser, argv[1], strlen(argv[1]));
+
+    if (!finishSanParser(parser)) fprintf(stderr, "Failed to parse PGN\n");
+    freeSanParser(parser);
+
+    if (movesCount > 0)
+        putchar('\n');
+    else
+        fprintf(stderr, "No valid moves found.\n");
+
+    return 0;
+}
+
+void printMove(const char* uci, void* context)
+{
+    int* movesCount = (int*)context;
+
+    if (*movesCount > 0) putchar(' ');
+    fputs(uci, stdout);
+    (*movesCount)++;
+}
+
+void feedStdin(SanParser* parser)
+{
+    char buffer[READ_BUFFER_SIZE];
+    ssize_t bytesRead = 0;
+
+    while ((bytesRead = read(STDIN_FILENO, buffer, READ_BUFFER_SIZE)) != 0)
+    {
+        if (bytesRead == -1)
+        {
+            if (errno == EINTR) continue;
+            perror("read failed");
+            exit(EXIT_FAILURE);
+        }
+        feedSanParser(parser, buffer, bytesRead);
+    }
+}
@@ -0,0 +1,1231 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "san_parser.h"
+
+#define BOARD_SIZE 128
+#define EMPTY_SQUARE '.'
+#define NO_SQUARE -1
+#define PENDING_INITIAL_SIZE 256
+#define POSITIONS_INITIAL_CAPACITY 128
+#define LINES_INITIAL_CAPACITY 8
+#define FEN_SIZE 128
+#define TOKEN_SIZE 16
+#define UCI_SIZE 6
+
+#define WHITE 0
+#define BLACK 1
+
+#define CASTLE_WHITE_KINGSIDE 1
+#define CASTLE_WHITE_QUEENSIDE 2
+#define CASTLE_BLACK_KINGSIDE 4
+#define CASTLE_BLACK_QUEENSIDE 8
+
+#define SQUARE(file, rank) ((rank) * 16 + (file))
+#define FILE_OF(square) ((square) & 7)
+#define RANK_OF(square) ((square) >> 4)
+#define IS_ON_BOARD(square) ((square) >= 0 && ((square) & 0x88) == 0)
+
+#define START_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+
+/*
+ * A 0x88 board, square = rank * 16 + file with rank 0 being rank 1.
+ * Pieces are FEN letters, uppercase for white.
+ */
+typedef struct {
+    char squares[BOARD_SIZE];
+    int turn;
+    int castling;
+    int epSquare;
+    int halfmoveClock;
+    int fullmoveNumber;
+} Position;
+
+typedef struct {
+    int from;
+    int to;
+    char promotion;     // lowercase piece letter, '\0' for none
+    boolean isNull;
+} ChessMove;
+
+/*
+ * One entry of python-chess's board stack: the starting position and
+ * the one after every move played on it, so a variation can start
+ * from the position before the last move.
+ */
+typedef struct {
+    Position* positions;
+    int movesCount;
+    int capacity;
+} BoardLine;
+
+typedef enum {
+    PARSER_STATE_LEADING,     // blank and comment lines before the game
+    PARSER_STATE_HEADERS,
+    PARSER_STATE_MOVETEXT,
+    PARSER_STATE_COMMENT,     // inside a { } comment that goes on past its line
+    PARSER_STATE_DONE
+} ParserState;
+
+typedef enum {
+    TOKEN_MOVE,
+    TOKEN_COMMENT,
+    TOKEN_LINE_COMMENT,
+    TOKEN_NAG,
+    TOKEN_ANNOTATION,
+    TOKEN_VARIATION_START,
+    TOKEN_VARIATION_END,
+    TOKEN_RESULT
+} TokenKind;
+
+typedef enum {
+    SAN_OK,
+    SAN_INVALID,
+    SAN_ILLEGAL,
+    SAN_AMBIGUOUS
+} SanStatus;
+
+// the groups of python-chess's SAN regex
+typedef struct {
+    char piece;
+    int fromFile;
+    int fromRank;
+    int to;
+    char promotion;
+} SanParts;
+
+struct SanParser {
+    SanMoveCallback onMove;
+    void* context;
+    ParserState state;
+    boolean isFirstLine;
+    int emptyLinesCount;        // blank lines in a row among the headers, one is allowed
+    char* pending;              // a line fed without its newline yet
+    size_t pendingLength;
+    size_t pendingCapacity;
+    char* startFen;             // the FEN header, NULL for the standard start
+    BoardLine* lines;
+    int linesCount;
+    int linesCapacity;
+    int variationDepth;         // 0 while moves go to the main line
+    int skipDepth;              // open variations being skipped after a bad move
+    boolean isMainLineEnded;
+};
+
+void appendPending(SanParser* parser, const char* data, size_t length);
+void processLine(SanParser* parser, const char* line, size_t length);
+void processHeaderLine(SanParser* parser, const char* line, size_t length);
+void processMovetext(SanParser* parser, const char* line, size_t length, boolean isFreshLine);
+void startMovetext(SanParser* parser);
+void readFenHeader(SanParser* parser, const char* line, size_t length);
+size_t matchToken(const char* text, size_t length, TokenKind* kind);
+size_t matchSan(const char* text, size_t length, boolean isWhole, SanParts* parts);
+boolean isCharIn(char c, const char* set);
+boolean isBlankLine(const char* line, size_t length);
+boolean isCommentLine(const char* line, size_t length);
+void startVariation(SanParser* parser);
+void endVariation(SanParser* parser);
+void playSan(SanParser* parser, const char* san, size_t length);
+BoardLine* pushBoardLine(SanParser* parser);
+void pushPosition(BoardLine* line, const Position* position);
+SanStatus parseSan(const Position* position, const char* san, ChessMove* move);
+SanStatus findCastling(const Position* position, boolean isKingside, ChessMove* move);
+SanStatus findFullySpecified(const Position* position, const SanParts* parts, ChessMove* move);
+boolean isLegalMove(const Position* position, const ChessMove* move);
+boolean isPseudoLegalMove(const Position* position, const ChessMove* move);
+boolean isCastlingMove(const Position* position, const ChessMove* move);
+boolean isCastlingLegal(const Position* position, boolean isKingside);
+boolean isSquareAttacked(const Position* position, int square, int byColor);
+boolean isSlideClear(const Position* position, int from, int to, boolean isDiagonal);
+int colorOf(char piece);
+void applyMove(const Position* position, const ChessMove* move, Position* next);
+boolean parseFen(const char* fen, Position* position);
+void formatFen(const Position* position, char* fen);
+void formatUci(const ChessMove* move, char* uci);
+
+SanParser* createSanParser(SanMoveCallback onMove, void* context)
+{
+    SanParser* parser = (SanParser*)calloc(1, sizeof(SanParser));
+
+    if (parser == NULL)
+    {
+        perror("Calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    parser->onMove = onMove;
+    parser->context = context;
+    parser->state = PARSER_STATE_LEADING;
+    parser->isFirstLine = true;
+
+    return parser;
+}
+
+// whole lines go straight to the parser, only a line cut by the end of data is copied
+void feedSanParser(SanParser* parser, const char* data, size_t length)
+{
+    const char* newline = NULL;
+
+    while (length > 0 && (newline = (const char*)memchr(data, '\n', length)) != NULL)
+    {
+        size_t lineLength = newline - data + 1;
+
+        if (parser->pendingLength > 0)
+        {
+            appendPending(parser, data, lineLength);
+            processLine(parser, parser->pending, parser->pendingLength);
+            parser->pendingLength = 0;
+        }
+        else
+        {
+            processLine(parser, data, lineLength);
+        }
+
+        data += lineLength;
+        length -= lineLength;
+    }
+
+    if (length > 0) appendPending(parser, data, length);
+}
+
+void appendPending(SanParser* parser, const char* data, size_t length)
+{
+    if (parser->pendingLength + length > parser->pendingCapacity)
+    {
+        size_t capacity = parser->pendingCapacity ? parser->pendingCapacity : PENDING_INITIAL_SIZE;
+
+        while (capacity < parser->pendingLength + length) capacity *= 2;
+        parser->pending = (char*)realloc(parser->pending, capacity);
+        if (parser->pending == NULL)
+        {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        parser->pendingCapacity = capacity;
+    }
+
+    memcpy(parser->pending + parser->pendingLength, data, length);
+    parser->pendingLength += length;
+}
+
+boolean finishSanParser(SanParser* parser)
+{
+    // readline hands out the last line without a newline all the same
+    if (parser->pendingLength > 0)
+    {
+        processLine(parser, parser->pending, parser->pendingLength);
+        parser->pendingLength = 0;
+    }
+
+    return parser->state != PARSER_STATE_LEADING;
+}
+
+void freeSanParser(SanParser* parser)
+{
+    for (int i = 0; i < parser->linesCount; i++)
+        free(parser->lines[i].positions);
+    free(parser->lines);
+    free(parser->startFen);
+    free(parser->pending);
+    free(parser);
+}
+
+/*
+ * read_game, one line at a time: blank and comment lines are skipped
+ * up to the first header, one blank line may sit between headers and
+ * one after them, and a blank line in the movetext ends the game.
+ */
+void processLine(SanParser* parser, const char* line, size_t length)
+{
+    const char* commentEnd = NULL;
+
+    switch (parser->state)
+    {
+        case PARSER_STATE_LEADING:
+            if (parser->isFirstLine)
+            {
+                // a UTF-8 byte order mark
+                while (length >= 3 && memcmp(line, "\xef\xbb\xbf", 3) == 0)
+                {
+                    line += 3;
+                    length -= 3;
+                }
+                parser->isFirstLine = false;
+                if (length == 0) return;
+            }
+            if (isBlankLine(line, length) || isCommentLine(line, length)) return;
+            parser->state = PARSER_STATE_HEADERS;
+            processHeaderLine(parser, line, length);
+            return;
+
+        case PARSER_STATE_HEADERS:
+            processHeaderLine(parser, line, length);
+            return;
+
+        case PARSER_STATE_MOVETEXT:
+            processMovetext(parser, line, length, true);
+            return;
+
+        case PARSER_STATE_COMMENT:
+            commentEnd = (const char*)memchr(line, '}', length);
+            if (commentEnd == NULL) return;
+            parser->state = PARSER_STATE_MOVETEXT;
+            processMovetext(parser, commentEnd, length - (commentEnd - line), false);
+            return;
+
+        case PARSER_STATE_DONE:
+            return;
+    }
+}
+
+void processHeaderLine(SanParser* parser, const char* line, size_t length)
+{
+    if (isCommentLine(line, length)) return;
+
+    if (parser->emptyLinesCount < 1 && isBlankLine(line, length))
+    {
+        parser->emptyLinesCount++;
+        return;
+    }
+
+    if (line[0] != '[')
+    {
+        startMovetext(parser);
+        // a single blank line after the headers does not end the game yet
+        if (!isBlankLine(line, length)) processMovetext(parser, line, length, true);
+        return;
+    }
+
+    parser->emptyLinesCount = 0;
+    readFenHeader(parser, line, length);
+}
+
+/*
+ * The tokens are those of python-chess's MOVETEXT_REGEX, found the way
+ * finditer finds them: a character that starts no token is skipped, so
+ * move numbers, check signs and stray braces fall through. A { comment
+ * may go on over the following lines; the rest of the line after its }
+ * is not a fresh line and cannot end the game.
+ */
+void processMovetext(SanParser* parser, const char* line, size_t length, boolean isFreshLine)
+{
+    size_t position = 0;
+
+    if (isFreshLine && isCommentLine(line, length)) return;
+    if (isFreshLine && isBlankLine(line, length))
+    {
+        parser->state = PARSER_STATE_DONE;
+        return;
+    }
+
+    while (position < length && parser->state == PARSER_STATE_MOVETEXT)
+    {
+        TokenKind kind = TOKEN_MOVE;
+        size_t tokenLength = matchToken(line + position, length - position, &kind);
+        const char* commentEnd = NULL;
+
+        if (tokenLength == 0)
+        {
+            position++;
+            continue;
+        }
+
+        switch (kind)
+        {
+            case TOKEN_COMMENT:
+                commentEnd = (const char*)memchr(line + position, '}', length - position);
+                if (commentEnd == NULL)
+                {
+                    parser->state = PARSER_STATE_COMMENT;
+                    return;
+                }
+                position = commentEnd - line;
+                continue;
+
+            case TOKEN_LINE_COMMENT:
+                return;
+
+            case TOKEN_NAG:
+            case TOKEN_ANNOTATION:
+                break;
+
+            case TOKEN_VARIATION_START:
+                startVariation(parser);
+                break;
+
+            case TOKEN_VARIATION_END:
+                endVariation(parser);
+                break;
+
+            case TOKEN_RESULT:
+                // a result inside a variation is read as a move, and fails as one
+                if (parser->linesCount > 1) playSan(parser, line + position, tokenLength);
+                break;
+
+            case TOKEN_MOVE:
+                playSan(parser, line + position, tokenLength);
+                break;
+        }
+
+        position += tokenLength;
+    }
+}
+
+void startMovetext(SanParser* parser)
+{
+    BoardLine* line = pushBoardLine(parser);
+    Position start;
+
+    parser->state = PARSER_STATE_MOVETEXT;
+    if (!parseFen(parser->startFen != NULL ? parser->startFen : START_FEN, &start))
+    {
+        fprintf(stderr, "invalid fen: '%s'\n", parser->startFen);
+        parser->state = PARSER_STATE_DONE;
+        return;
+    }
+
+    pushPosition(line, &start);
+}
+
+// [FEN "..."], the only header that changes the moves; a later one wins
+void readFenHeader(SanParser* parser, const char* line, size_t length)
+{
+    size_t valueStart = 4;
+    size_t end = length;
+
+    if (length < 4 || memcmp(line, "[FEN", 4) != 0) return;
+    if (valueStart >= length || !isspace((unsigned char)line[valueStart])) return;
+    while (valueStart < length && isspace((unsigned char)line[valueStart])) valueStart++;
+    if (valueStart >= length || line[valueStart] != '"') return;
+    valueStart++;
+
+    while (end > valueStart && isspace((unsigned char)line[end - 1])) end--;
+    if (end < valueStart + 2 || line[end - 1] != ']' || line[end - 2] != '"') return;
+    end -= 2;
+    if (memchr(line + valueStart, '\r', end - valueStart) != NULL) return;
+
+    free(parser->startFen);
+    parser->startFen = strndup(line + valueStart, end - valueStart);
+    if (parser->startFen == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * The token at the start of text, tried in the order of the regex
+ * alternatives; 0 when none starts there.
+ */
+size_t matchToken(const char* text, size_t length, TokenKind* kind)
+{
+    static const char* fixedMoves[] = { "--", "Z0", "0000", "@@@@", "O-O-O", "O-O", "0-0-0", "0-0" };
+    static const char* results[] = { "*", "1-0", "0-1", "1/2-1/2" };
+    size_t tokenLength = 0;
+
+    *kind = TOKEN_MOVE;
+    tokenLength = matchSan(text, length, false, NULL);
+    if (tokenLength > 0) return tokenLength;
+
+    // a drop, which parses as no move at all later
+    tokenLength = isCharIn(text[0], "PNBRQK") ? 1 : 0;
+    if (tokenLength + 3 <= length && text[tokenLength] == '@'
+        && text[tokenLength + 1] >= 'a' && text[tokenLength + 1] <= 'h'
+        && text[tokenLength + 2] >= '1' && text[tokenLength + 2] <= '8')
+    {
+        return tokenLength + 3;
+    }
+
+    for (size_t i = 0; i < sizeof(fixedMoves) / sizeof(fixedMoves[0]); i++)
+    {
+        tokenLength = strlen(fixedMoves[i]);
+        if (tokenLength <= length && memcmp(text, fixedMoves[i], tokenLength) == 0) return tokenLength;
+    }
+
+    switch (text[0])
+    {
+        case '{':
+            *kind = TOKEN_COMMENT;
+            return length;
+        case ';':
+            *kind = TOKEN_LINE_COMMENT;
+            return length;
+        case '$':
+            for (tokenLength = 1; tokenLength < length && isdigit((unsigned char)text[tokenLength]); tokenLength++);
+            *kind = TOKEN_NAG;
+            return tokenLength > 1 ? tokenLength : 0;
+        case '(':
+            *kind = TOKEN_VARIATION_START;
+            return 1;
+        case ')':
+            *kind = TOKEN_VARIATION_END;
+            return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(results) / sizeof(results[0]); i++)
+    {
+        tokenLength = strlen(results[i]);
+        if (tokenLength <= length && memcmp(text, results[i], tokenLength) == 0)
+        {
+            *kind = TOKEN_RESULT;
+            return tokenLength;
+        }
+    }
+
+    if (isCharIn(text[0], "?!"))
+    {
+        *kind = TOKEN_ANNOTATION;
+        return length > 1 && isCharIn(text[1], "?!") ? 2 : 1;
+    }
+
+    return 0;
+}
+
+/*
+ * [NBKRQ]?[a-h]?[1-8]?[\-x]?[a-h][1-8](?:=?[nbrqkNBRQK])?, backtracking
+ * like the regex does: every optional part is tried present before
+ * absent, the earlier ones first. isWhole is SAN_REGEX, which also
+ * takes a check sign and has to reach the end of text.
+ */
+size_t matchSan(const char* text, size_t length, boolean isWhole, SanParts* parts)
+{
+    for (int present = 15; present >= 0; present--)
+    {
+        SanParts candidate = { '\0', -1, -1, NO_SQUARE, '\0' };
+        size_t i = 0;
+
+        if (present & 8)
+        {
+            if (i >= length || !isCharIn(text[i], "NBKRQ")) continue;
+            candidate.piece = text[i++];
+        }
+        if (present & 4)
+        {
+            if (i >= length || text[i] < 'a' || text[i] > 'h') continue;
+            candidate.fromFile = text[i++] - 'a';
+        }
+        if (present & 2)
+        {
+            if (i >= length || text[i] < '1' || text[i] > '8') continue;
+            candidate.fromRank = text[i++] - '1';
+        }
+        if (present & 1)
+        {
+            if (i >= length || (text[i] != '-' && text[i] != 'x')) continue;
+            i++;
+        }
+        if (i + 2 > length || text[i] < 'a' || text[i] > 'h' || text[i + 1] < '1' || text[i + 1] > '8') continue;
+        candidate.to = SQUARE(text[i] - 'a', text[i + 1] - '1');
+        i += 2;
+
+        // the promotion as "=Q", "Q" or nothing, and for SAN_REGEX a check sign or nothing
+        for (int promotion = 0; promotion < 3; promotion++)
+        {
+            size_t end = i;
+
+            candidate.promotion = '\0';
+            if (promotion == 0)
+            {
+                if (end + 1 >= length || text[end] != '=' || !isCharIn(text[end + 1], "nbrqkNBRQK")) continue;
+                candidate.promotion = tolower((unsigned char)text[end + 1]);
+                end += 2;
+            }
+            else if (promotion == 1)
+            {
+                if (end >= length || !isCharIn(text[end], "nbrqkNBRQK")) continue;
+                candidate.promotion = tolower((unsigned char)text[end]);
+                end++;
+            }
+
+            if (isWhole)
+            {
+                if (end < length && isCharIn(text[end], "+#") && end + 1 == length)
+                    end++;
+                if (end != length) continue;
+            }
+
+            if (parts != NULL) *parts = candidate;
+            return end;
+        }
+    }
+
+    return 0;
+}
+
+// strchr without the match on the terminator
+boolean isCharIn(char c, const char* set)
+{
+    return c != '\0' && strchr(set, c) != NULL;
+}
+
+// str.isspace(): not empty and nothing but whitespace
+boolean isBlankLine(const char* line, size_t length)
+{
+    if (length == 0) return false;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = line[i];
+
+        if (!isspace(c) && (c < 0x1c || c > 0x1f)) return false;
+    }
+
+    return true;
+}
+
+boolean isCommentLine(const char* line, size_t length)
+{
+    return length > 0 && (line[0] == '%' || line[0] == ';');
+}
+
+/*
+ * A variation is played on a copy of the board without its last move.
+ * One that starts while moves are being skipped is skipped whole, and
+ * one before any move is ignored, its moves going on where they are.
+ */
+void startVariation(SanParser* parser)
+{
+    BoardLine* current = NULL;
+    BoardLine* line = NULL;
+
+    if (parser->skipDepth > 0)
+    {
+        parser->skipDepth++;
+        return;
+    }
+
+    if (parser->lines[parser->linesCount - 1].movesCount == 0) return;
+
+    parser->variationDepth++;
+    line = pushBoardLine(parser);
+    current = &parser->lines[parser->linesCount - 2];
+    for (int i = 0; i < current->movesCount; i++)
+        pushPosition(line, &current->positions[i]);
+}
+
+/*
+ * The end of a skipped variation leaves the board stack alone, as
+ * python-chess does: after a bad move in a variation the moves that
+ * follow it are read on the variation's board.
+ */
+void endVariation(SanParser* parser)
+{
+    if (parser->skipDepth == 1)
+    {
+        parser->skipDepth = 0;
+        parser->variationDepth--;
+    }
+    else if (parser->skipDepth > 1)
+    {
+        parser->skipDepth--;
+    }
+    else if (parser->linesCount > 1)
+    {
+        parser->variationDepth--;
+        free(parser->lines[parser->linesCount - 1].positions);
+        parser->linesCount--;
+    }
+}
+
+void playSan(SanParser* parser, const char* san, size_t length)
+{
+    static const char* errorFormats[] = { NULL, "invalid san: '%s'", "illegal san: '%s' in %s", "ambiguous san: '%s' in %s" };
+    BoardLine* line = &parser->lines[parser->linesCount - 1];
+    const Position* position = &line->positions[line->movesCount];
+    char token[TOKEN_SIZE];
+    char uci[UCI_SIZE];
+    char fen[FEN_SIZE];
+    ChessMove move;
+    Position next;
+    SanStatus status = SAN_OK;
+
+    if (parser->skipDepth > 0) return;
+
+    if (length >= sizeof(token)) length = sizeof(token) - 1;
+    memcpy(token, san, length);
+    token[length] = '\0';
+
+    status = parseSan(position, token, &move);
+    if (status != SAN_OK)
+    {
+        formatFen(position, fen);
+        fprintf(stderr, errorFormats[status], token, fen);
+        fputc('\n', stderr);
+        parser->skipDepth = 1;
+        if (parser->variationDepth == 0) parser->isMainLineEnded = true;
+        return;
+    }
+
+    if (parser->variationDepth == 0 && !parser->isMainLineEnded)
+    {
+        formatUci(&move, uci);
+        parser->onMove(uci, parser->context);
+    }
+
+    applyMove(position, &move, &next);
+    pushPosition(line, &next);
+}
+
+BoardLine* pushBoardLine(SanParser* parser)
+{
+    BoardLine* line = NULL;
+
+    if (parser->linesCount == parser->linesCapacity)
+    {
+        parser->linesCapacity = parser->linesCapacity ? parser->linesCapacity * 2 : LINES_INITIAL_CAPACITY;
+        parser->lines = (BoardLine*)realloc(parser->lines, parser->linesCapacity * sizeof(BoardLine));
+        if (parser->lines == NULL)
+        {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    line = &parser->lines[parser->linesCount++];
+    line->capacity = POSITIONS_INITIAL_CAPACITY;
+    line->movesCount = -1;
+    line->positions = (Position*)malloc(line->capacity * sizeof(Position));
+    if (line->positions == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return line;
+}
+
+// the position after one more move on the line
+void pushPosition(BoardLine* line, const Position* position)
+{
+    if (line->movesCount + 1 >= line->capacity)
+    {
+        line->capacity *= 2;
+        line->positions = (Position*)realloc(line->positions, line->capacity * sizeof(Position));
+        if (line->positions == NULL)
+        {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    line->movesCount++;
+    line->positions[line->movesCount] = *position;
+}
+
+/*
+ * Board.parse_san: castling by name, then the SAN regex. A piece letter
+ * picks among that piece's legal moves to the target, a move with both
+ * origin file and rank and no piece is taken as given, and anything
+ * else is a pawn, capturing only when its file is named.
+ */
+SanStatus parseSan(const Position* position, const char* san, ChessMove* move)
+{
+    static const char* kingsideNames[] = { "O-O", "O-O+", "O-O#", "0-0", "0-0+", "0-0#" };
+    static const char* queensideNames[] = { "O-O-O", "O-O-O+", "O-O-O#", "0-0-0", "0-0-0+", "0-0-0#" };
+    static const char* nullNames[] = { "--", "Z0", "0000", "@@@@" };
+    SanParts parts;
+    ChessMove candidate;
+    boolean isFound = false;
+    char pieceType = 'p';
+
+    for (int i = 0; i < 6; i++)
+    {
+        if (strcmp(san, kingsideNames[i]) == 0) return findCastling(position, true, move);
+        if (strcmp(san, queensideNames[i]) == 0) return findCastling(position, false, move);
+    }
+
+    if (matchSan(san, strlen(san), true, &parts) == 0)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            if (strcmp(san, nullNames[i]) == 0)
+            {
+                memset(move, 0, sizeof(ChessMove));
+                move->isNull = true;
+                return SAN_OK;
+            }
+        }
+        return SAN_INVALID;
+    }
+
+    if (parts.piece != '\0')
+        pieceType = tolower((unsigned char)parts.piece);
+    else if (parts.fromFile != -1 && parts.fromRank != -1)
+        return findFullySpecified(position, &parts, move);
+    else if (parts.fromFile == -1)
+        parts.fromFile = FILE_OF(parts.to);
+
+    for (int rank = 0; rank < 8; rank++)
+    {
+        for (int file = 0; file < 8; file++)
+        {
+            int from = SQUARE(file, rank);
+            char piece = position->squares[from];
+
+            if (piece == EMPTY_SQUARE || colorOf(piece) != position->turn || tolower((unsigned char)piece) != pieceType) continue;
+            if ((parts.fromFile != -1 && file != parts.fromFile) || (parts.fromRank != -1 && rank != parts.fromRank)) continue;
+
+            candidate.from = from;
+            candidate.to = parts.to;
+            candidate.promotion = parts.promotion;
+            candidate.isNull = false;
+            if (isCastlingMove(position, &candidate) || !isLegalMove(position, &candidate)) continue;
+
+            if (isFound) return SAN_AMBIGUOUS;
+            *move = candidate;
+            isFound = true;
+        }
+    }
+
+    return isFound ? SAN_OK : SAN_ILLEGAL;
+}
+
+SanStatus findCastling(const Position* position, boolean isKingside, ChessMove* move)
+{
+    int backRank = position->turn == WHITE ? 0 : 7;
+
+    if (!isCastlingLegal(position, isKingside)) return SAN_ILLEGAL;
+
+    move->from = SQUARE(4, backRank);
+    move->to = SQUARE(isKingside ? 6 : 2, backRank);
+    move->promotion = '\0';
+    move->isNull = false;
+
+    return SAN_OK;
+}
+
+/*
+ * Board.find_move: a pawn reaching the last rank becomes a queen unless
+ * told otherwise, and the king taking its own rook is castling. The
+ * promotion has to come out as the SAN gave it.
+ */
+SanStatus findFullySpecified(const Position* position, const SanParts* parts, ChessMove* move)
+{
+    int from = SQUARE(parts->fromFile, parts->fromRank);
+    char piece = position->squares[from];
+
+    move->from = from;
+    move->to = parts->to;
+    move->promotion = parts->promotion;
+    move->isNull = false;
+
+    if (move->promotion == '\0' && (piece == 'P' || piece == 'p') && (RANK_OF(move->to) == 0 || RANK_OF(move->to) == 7))
+        move->promotion = 'q';
+
+    if (move->promotion == '\0' && (piece == 'K' || piece == 'k') && (from == SQUARE(4, 0) || from == SQUARE(4, 7)))
+    {
+        if (move->to == from + 3) move->to = from + 2;
+        else if (move->to == from - 4) move->to = from - 2;
+    }
+
+    if (!isLegalMove(position, move) || move->promotion != parts->promotion) return SAN_ILLEGAL;
+
+    return SAN_OK;
+}
+
+boolean isLegalMove(const Position* position, const ChessMove* move)
+{
+    Position next;
+    int mover = position->turn;
+
+    if (isCastlingMove(position, move)) return isCastlingLegal(position, FILE_OF(move->to) == 6);
+    if (!isPseudoLegalMove(position, move)) return false;
+
+    applyMove(position, move, &next);
+    for (int square = 0; square < BOARD_SIZE; square++)
+    {
+        if (IS_ON_BOARD(square) && next.squares[square] == (mover == WHITE ? 'K' : 'k'))
+            return !isSquareAttacked(&next, square, !mover);
+    }
+
+    return true;
+}
+
+boolean isPseudoLegalMove(const Position* position, const ChessMove* move)
+{
+    static const int knightSteps[] = { 33, 31, 18, 14, -33, -31, -18, -14 };
+    static const int kingSteps[] = { 1, 15, 16, 17, -1, -15, -16, -17 };
+    char piece = position->squares[move->from];
+    char target = position->squares[move->to];
+    int difference = move->to - move->from;
+    int forward = position->turn == WHITE ? 16 : -16;
+    int lastRank = position->turn == WHITE ? 7 : 0;
+
+    if (piece == EMPTY_SQUARE || colorOf(piece) != position->turn) return false;
+    if (target != EMPTY_SQUARE && colorOf(target) == position->turn) return false;
+
+    switch (tolower((unsigned char)piece))
+    {
+        case 'p':
+            if ((RANK_OF(move->to) == lastRank) != (move->promotion != '\0')) return false;
+            if (move->promotion != '\0' && !isCharIn(move->promotion, "nbrq")) return false;
+            if (difference == forward) return target == EMPTY_SQUARE;
+            if (difference == 2 * forward)
+            {
+                return RANK_OF(move->from) == (position->turn == WHITE ? 1 : 6)
+                    && target == EMPTY_SQUARE && position->squares[move->from + forward] == EMPTY_SQUARE;
+            }
+            if (difference == forward + 1 || difference == forward - 1)
+            {
+                if (target != EMPTY_SQUARE) return true;
+                // en passant, with the pawn that passed right behind the square
+                return move->to == position->epSquare
+                    && position->squares[move->to - forward] == (position->turn == WHITE ? 'p' : 'P');
+            }
+            return false;
+
+        case 'n':
+            if (move->promotion != '\0') return false;
+            for (int i = 0; i < 8; i++)
+                if (difference == knightSteps[i]) return true;
+            return false;
+
+        case 'k':
+            if (move->promotion != '\0') return false;
+            for (int i = 0; i < 8; i++)
+                if (difference == kingSteps[i]) return true;
+            return false;
+
+        case 'b':
+            return move->promotion == '\0' && isSlideClear(position, move->from, move->to, true);
+
+        case 'r':
+            return move->promotion == '\0' && isSlideClear(position, move->from, move->to, false);
+
+        case 'q':
+            return move->promotion == '\0'
+                && (isSlideClear(position, move->from, move->to, true) || isSlideClear(position, move->from, move->to, false));
+    }
+
+    return false;
+}
+
+// a king from its home square two files over, which only castling does
+boolean isCastlingMove(const Position* position, const ChessMove* move)
+{
+    char piece = position->squares[move->from];
+    int backRank = position->turn == WHITE ? 0 : 7;
+
+    return piece == (position->turn == WHITE ? 'K' : 'k') && move->promotion == '\0'
+        && move->from == SQUARE(4, backRank) && (move->to == SQUARE(6, backRank) || move->to == SQUARE(2, backRank));
+}
+
+/*
+ * The right to castle, the rook in its corner, nothing between them,
+ * and no attack on the squares the king starts on, crosses and lands on.
+ */
+boolean isCastlingLegal(const Position* position, boolean isKingside)
+{
+    int backRank = position->turn == WHITE ? 0 : 7;
+    int right = position->turn == WHITE
+        ? (isKingside ? CASTLE_WHITE_KINGSIDE : CASTLE_WHITE_QUEENSIDE)
+        : (isKingside ? CASTLE_BLACK_KINGSIDE : CASTLE_BLACK_QUEENSIDE);
+    int king = SQUARE(4, backRank);
+    int rook = SQUARE(isKingside ? 7 : 0, backRank);
+    int step = isKingside ? 1 : -1;
+
+    if (!(position->castling & right)) return false;
+    if (position->squares[king] != (position->turn == WHITE ? 'K' : 'k')) return false;
+    if (position->squares[rook] != (position->turn == WHITE ? 'R' : 'r')) return false;
+
+    for (int square = king + step; square != rook; square += step)
+        if (position->squares[square] != EMPTY_SQUARE) return false;
+
+    for (int i = 0; i <= 2; i++)
+        if (isSquareAttacked(position, king + i * step, !position->turn)) return false;
+
+    return true;
+}
+
+boolean isSquareAttacked(const Position* position, int square, int byColor)
+{
+    static const int knightSteps[] = { 33, 31, 18, 14, -33, -31, -18, -14 };
+    static const int kingSteps[] = { 1, 15, 16, 17, -1, -15, -16, -17 };
+    static const int diagonalSteps[] = { 15, 17, -15, -17 };
+    static const int straightSteps[] = { 1, 16, -1, -16 };
+    boolean isWhite = byColor == WHITE;
+    int pawnFrom = isWhite ? -16 : 16;
+
+    for (int side = -1; side <= 1; side += 2)
+    {
+        int from = square + pawnFrom + side;
+        if (IS_ON_BOARD(from) && position->squares[from] == (isWhite ? 'P' : 'p')) return true;
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        int knight = square + knightSteps[i];
+        int king = square + kingSteps[i];
+
+        if (IS_ON_BOARD(knight) && position->squares[knight] == (isWhite ? 'N' : 'n')) return true;
+        if (IS_ON_BOARD(king) && position->squares[king] == (isWhite ? 'K' : 'k')) return true;
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        for (int from = square + diagonalSteps[i]; IS_ON_BOARD(from); from += diagonalSteps[i])
+        {
+            char piece = position->squares[from];
+
+            if (piece == EMPTY_SQUARE) continue;
+            if (piece == (isWhite ? 'B' : 'b') || piece == (isWhite ? 'Q' : 'q')) return true;
+            break;
+        }
+
+        for (int from = square + straightSteps[i]; IS_ON_BOARD(from); from += straightSteps[i])
+        {
+            char piece = position->squares[from];
+
+            if (piece == EMPTY_SQUARE) continue;
+            if (piece == (isWhite ? 'R' : 'r') || piece == (isWhite ? 'Q' : 'q')) return true;
+            break;
+        }
+    }
+
+    return false;
+}
+
+// from and to on one diagonal (or one rank or file) with nothing in between
+boolean isSlideClear(const Position* position, int from, int to, boolean isDiagonal)
+{
+    int fileStep = FILE_OF(to) - FILE_OF(from);
+    int rankStep = RANK_OF(to) - RANK_OF(from);
+    int step = 0;
+
+    if (from == to) return false;
+    if (isDiagonal && abs(fileStep) != abs(rankStep)) return false;
+    if (!isDiagonal && fileStep != 0 && rankStep != 0) return false;
+
+    fileStep = fileStep > 0 ? 1 : (fileStep < 0 ? -1 : 0);
+    rankStep = rankStep > 0 ? 1 : (rankStep < 0 ? -1 : 0);
+    step = rankStep * 16 + fileStep;
+
+    for (int square = from + step; square != to; square += step)
+        if (position->squares[square] != EMPTY_SQUARE) return false;
+
+    return true;
+}
+
+int colorOf(char piece)
+{
+    return isupper((unsigned char)piece) ? WHITE : BLACK;
+}
+
+void applyMove(const Position* position, const ChessMove* move, Position* next)
+{
+    char piece = EMPTY_SQUARE;
+    int forward = position->turn == WHITE ? 16 : -16;
+    boolean isReset = false;
+
+    *next = *position;
+    next->epSquare = NO_SQUARE;
+    next->turn = !position->turn;
+    if (position->turn == BLACK) next->fullmoveNumber++;
+
+    if (move->isNull)
+    {
+        next->halfmoveClock++;
+        return;
+    }
+
+    piece = position->squares[move->from];
+    isReset = position->squares[move->to] != EMPTY_SQUARE;
+
+    if (piece == 'P' || piece == 'p')
+    {
+        isReset = true;
+        if (move->to == position->epSquare && FILE_OF(move->to) != FILE_OF(move->from) && position->squares[move->to] == EMPTY_SQUARE)
+            next->squares[move->to - forward] = EMPTY_SQUARE;
+        if (move->to - move->from == 2 * forward)
+            next->epSquare = move->from + forward;
+    }
+
+    if ((piece == 'K' || piece == 'k') && abs(FILE_OF(move->to) - FILE_OF(move->from)) == 2)
+    {
+        boolean isKingside = FILE_OF(move->to) > FILE_OF(move->from);
+        int rank = RANK_OF(move->from);
+
+        next->squares[SQUARE(isKingside ? 5 : 3, rank)] = next->squares[SQUARE(isKingside ? 7 : 0, rank)];
+        next->squares[SQUARE(isKingside ? 7 : 0, rank)] = EMPTY_SQUARE;
+    }
+
+    next->squares[move->to] = move->promotion == '\0'
+        ? piece
+        : (position->turn == WHITE ? toupper((unsigned char)move->promotion) : move->promotion);
+    next->squares[move->from] = EMPTY_SQUARE;
+
+    // a king or rook leaving home, or a rook taken at home, loses the castling
+    if (piece == 'K') next->castling &= ~(CASTLE_WHITE_KINGSIDE | CASTLE_WHITE_QUEENSIDE);
+    if (piece == 'k') next->castling &= ~(CASTLE_BLACK_KINGSIDE | CASTLE_BLACK_QUEENSIDE);
+    if (move->from == SQUARE(0, 0) || move->to == SQUARE(0, 0)) next->castling &= ~CASTLE_WHITE_QUEENSIDE;
+    if (move->from == SQUARE(7, 0) || move->to == SQUARE(7, 0)) next->castling &= ~CASTLE_WHITE_KINGSIDE;
+    if (move->from == SQUARE(0, 7) || move->to == SQUARE(0, 7)) next->castling &= ~CASTLE_BLACK_QUEENSIDE;
+    if (move->from == SQUARE(7, 7) || move->to == SQUARE(7, 7)) next->castling &= ~CASTLE_BLACK_KINGSIDE;
+
+    next->halfmoveClock = isReset ? 0 : position->halfmoveClock + 1;
+}
+
+boolean parseFen(const char* fen, Position* position)
+{
+    const char* cursor = fen;
+    int rank = 7;
+    int file = 0;
+
+    memset(position->squares, EMPTY_SQUARE, BOARD_SIZE);
+    position->castling = 0;
+    position->epSquare = NO_SQUARE;
+    position->halfmoveClock = 0;
+    position->fullmoveNumber = 1;
+
+    while (*cursor == ' ') cursor++;
+    for (; *cursor != '\0' && *cursor != ' '; cursor++)
+    {
+        if (*cursor == '/')
+        {
+            if (file != 8 || rank == 0) return false;
+            rank--;
+            file = 0;
+        }
+        else if (*cursor >= '1' && *cursor <= '8')
+        {
+            file += *cursor - '0';
+            if (file > 8) return false;
+        }
+        else if (isCharIn(*cursor, "pnbrqkPNBRQK"))
+        {
+            if (file >= 8) return false;
+            position->squares[SQUARE(file, rank)] = *cursor;
+            file++;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    if (rank != 0 || file != 8) return false;
+
+    while (*cursor == ' ') cursor++;
+    if (*cursor == 'w' || *cursor == '\0') position->turn = WHITE;
+    else if (*cursor == 'b') position->turn = BLACK;
+    else return false;
+    if (*cursor != '\0') cursor++;
+
+    while (*cursor == ' ') cursor++;
+    for (; *cursor != '\0' && *cursor != ' '; cursor++)
+    {
+        switch (*cursor)
+        {
+            case 'K': position->castling |= CASTLE_WHITE_KINGSIDE; break;
+            case 'Q': position->castling |= CASTLE_WHITE_QUEENSIDE; break;
+            case 'k': position->castling |= CASTLE_BLACK_KINGSIDE; break;
+            case 'q': position->castling |= CASTLE_BLACK_QUEENSIDE; break;
+            case '-': break;
+            default: return false;
+        }
+    }
+
+    while (*cursor == ' ') cursor++;
+    if (cursor[0] >= 'a' && cursor[0] <= 'h' && cursor[1] >= '1' && cursor[1] <= '8')
+    {
+        position->epSquare = SQUARE(cursor[0] - 'a', cursor[1] - '1');
+        cursor += 2;
+    }
+    else if (*cursor == '-')
+    {
+        cursor++;
+    }
+    else if (*cursor != '\0')
+    {
+        return false;
+    }
+
+    while (*cursor == ' ') cursor++;
+    if (*cursor != '\0') position->halfmoveClock = strtol(cursor, (char**)&cursor, 10);
+    while (*cursor == ' ') cursor++;
+    if (*cursor != '\0') position->fullmoveNumber = strtol(cursor, (char**)&cursor, 10);
+
+    return true;
+}
+
+// for error messages; the en passant square is only shown when the capture is legal, as python-chess does
+void formatFen(const Position* position, char* fen)
+{
+    char* cursor = fen;
+    boolean isEpShown = false;
+
+    for (int rank = 7; rank >= 0; rank--)
+    {
+        int empty = 0;
+
+        for (int file = 0; file < 8; file++)
+        {
+            char piece = position->squares[SQUARE(file, rank)];
+
+            if (piece == EMPTY_SQUARE)
+            {
+                empty++;
+                continue;
+            }
+            if (empty > 0) *cursor++ = '0' + empty;
+            empty = 0;
+            *cursor++ = piece;
+        }
+        if (empty > 0) *cursor++ = '0' + empty;
+        if (rank > 0) *cursor++ = '/';
+    }
+
+    *cursor++ = ' ';
+    *cursor++ = position->turn == WHITE ? 'w' : 'b';
+    *cursor++ = ' ';
+    if (position->castling & CASTLE_WHITE_KINGSIDE) *cursor++ = 'K';
+    if (position->castling & CASTLE_WHITE_QUEENSIDE) *cursor++ = 'Q';
+    if (position->castling & CASTLE_BLACK_KINGSIDE) *cursor++ = 'k';
+    if (position->castling & CASTLE_BLACK_QUEENSIDE) *cursor++ = 'q';
+    if (position->castling == 0) *cursor++ = '-';
+    *cursor++ = ' ';
+
+    if (position->epSquare != NO_SQUARE)
+    {
+        int behind = position->epSquare - (position->turn == WHITE ? 16 : -16);
+
+        for (int side = -1; side <= 1 && !isEpShown; side += 2)
+        {
+            ChessMove capture = { behind + side, position->epSquare, '\0', false };
+
+            isEpShown = IS_ON_BOARD(capture.from) && isLegalMove(position, &capture);
+        }
+    }
+
+    if (isEpShown)
+    {
+        *cursor++ = 'a' + FILE_OF(position->epSquare);
+        *cursor++ = '1' + RANK_OF(position->epSquare);
+    }
+    else
+    {
+        *cursor++ = '-';
+    }
+
+    sprintf(cursor, " %d %d", position->halfmoveClock, position->fullmoveNumber);
+}
+
+void formatUci(const ChessMove* move, char* uci)
+{
+    if (move->isNull)
+    {
+        strcpy(uci, "0000");
+        return;
+    }
+
+    uci[0] = 'a' + FILE_OF(move->from);
+    uci[1] = '1' + RANK_OF(move->from);
+    uci[2] = 'a' + FILE_OF(move->to);
+    uci[3] = '1' + RANK_OF(move->to);
+    uci[4] = move->promotion;
+    uci[5] = '\0';
+}
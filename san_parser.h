@@ -0,0 +1,34 @@
+#ifndef SAN_PARSER_H
+#define SAN_PARSER_H
+
+#include <stddef.h>
+
+#ifndef BOOLEAN_DEFINED
+#define BOOLEAN_DEFINED
+typedef enum  {
+    false,
+    true
+} boolean;
+#endif
+
+// a UCI move of the main line ("e2e4", "e7e8q", "e1g1", "0000" for a null move)
+typedef void (*SanMoveCallback)(const char* uci, void* context);
+
+typedef struct SanParser SanParser;
+
+/*
+ * Turns the first game of PGN text into the UCI moves of its main line,
+ * reading it the way python-chess's read_game does: headers (a FEN tag
+ * sets the starting position), then movetext with move numbers,
+ * comments, NAGs, annotations and variations skipped. The text can be
+ * fed in pieces of any size; moves go to onMove as soon as they are
+ * known. A move that is illegal, ambiguous or not SAN is reported on
+ * stderr and ends the main line, as it does for python-chess.
+ */
+SanParser* createSanParser(SanMoveCallback onMove, void* context);
+void feedSanParser(SanParser* parser, const char* data, size_t length);
+// false when the text held no game at all
+boolean finishSanParser(SanParser* parser);
+void freeSanParser(SanParser* parser);
+
+#endif
@@ -0,0 +1,672 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define MAX_PATH 4096
+#define EVENT_TAG "[Event"
+#define EVENT_LINE_TAG "[Event "
+#define GAMES_INITIAL_CAPACITY 1024
+#define OUTPUT_BUFFER_INITIAL_SIZE 4096
+#define MIN_RANGE_SIZE (1 << 20)
+
+typedef enum  {
+    false,
+    true
+} boolean;
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} OutputBuffer;
+
+/*
+ * The input as split_pgn.sh sees it. The script reads it with a plain
+ * `read line` and writes it back with an unquoted `echo $line`, so every
+ * line comes out with backslash escapes (and escaped newlines) removed
+ * and its words joined by single spaces, and an unterminated last line
+ * never comes out at all. size stops after the last newline for that.
+ *
+ * The rest of what that echo does is left out on purpose: a word like
+ * "*" (a game result) was glob-expanded against the current directory,
+ * and a line starting with -n, -e or -E lost it as an echo option. Here
+ * every word is written as it is, so on such lines the output differs
+ * from the script's.
+ */
+typedef struct {
+    const char* data;
+    size_t size;
+    const char* destDir;
+    char* baseName;
+    char* extension;
+} PgnInput;
+
+// offsets of the lines that start a game, in file order
+typedef struct {
+    size_t* starts;
+    int count;
+    int capacity;
+} GameStarts;
+
+typedef struct {
+    const char* src;
+    const char* dest;
+    int jobs;
+    boolean isJobsGiven;
+} SplitOptions;
+
+/*
+ * One thread's share of the input. The thread first collects the game
+ * starts whose "[Event" falls in [begin, end); once every range has
+ * been scanned, a running count over the ranges in order tells each one
+ * the number of its first game, and the thread writes its games out.
+ */
+typedef struct {
+    const PgnInput* input;
+    size_t begin;
+    size_t end;
+    GameStarts games;
+    int firstGame;      // 1 when the first start is a line the previous range already has
+    int counterBase;    // the script's number for games.starts[firstGame]
+    size_t nextStart;   // where the range's last game ends: the next range's first start, or the end of input
+} SplitRange;
+
+boolean parseArguments(int argc, char** argv, SplitOptions* options);
+void splitNames(const char* path, char** baseName, char** extension);
+boolean isFileExists(const char* path);
+boolean isDirExists(const char* path);
+SplitRange* createRanges(const PgnInput* input, const SplitOptions* options, int* rangesCount);
+void runRanges(SplitRange* ranges, int rangesCount, void* (*rangeMain)(void*));
+void* scanRangeMain(void* arg);
+void* writeRangeMain(void* arg);
+int numberRanges(SplitRange* ranges, int rangesCount, size_t size);
+void findGameStarts(const PgnInput* input, size_t begin, size_t end, GameStarts* games);
+void addGameStart(GameStarts* games, size_t start);
+boolean isEventLine(const PgnInput* input, size_t position, size_t* lineStart);
+size_t findLineStart(const PgnInput* input, size_t position);
+boolean findLineEnd(const PgnInput* input, size_t position, size_t* lineEnd);
+boolean isContinuation(const char* data, size_t newline);
+boolean needsNormalizing(const char* data, size_t start, size_t end);
+void appendNormalizedLines(OutputBuffer* output, const char* data, size_t start, size_t end);
+void appendWords(OutputBuffer* output, const char* text, size_t length);
+void writeGame(const PgnInput* input, int counter, size_t start, size_t end, boolean trimBlankLine, OutputBuffer* scratch);
+void printEcho(const char* format, ...);
+void appendBytes(OutputBuffer* output, const char* data, size_t length);
+boolean writeFull(int fd, const char* buffer, size_t size);
+
+/*
+ * Usage is split_pgn.sh's: split_pgn <source_pgn_file> <destination_directory>,
+ * plus --jobs N to split with N threads instead of one per core.
+ */
+int main(int argc, char** argv)
+{
+    PgnInput input = { NULL, 0, NULL, NULL, NULL };
+    SplitOptions options;
+    SplitRange* ranges = NULL;
+    OutputBuffer scratch = { NULL, 0, 0 };
+    const char* lastNewline = NULL;
+    struct stat srcStat;
+    char* map = MAP_FAILED;
+    size_t firstStart = 0;
+    int rangesCount = 0;
+    int gamesCount = 0;
+    int srcFd = -1;
+
+    if (!parseArguments(argc, argv, &options))
+    {
+        printEcho("Usage: %s <source_pgn_file> <destination_directory>", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!isFileExists(options.src))
+    {
+        printEcho("Error: File '%s' does not exist.", options.src);
+        exit(EXIT_FAILURE);
+    }
+
+    input.destDir = options.dest;
+    if (!isDirExists(input.destDir))
+    {
+        if (mkdir(input.destDir, 0777) == -1)
+        {
+            perror("mkdir failed");
+            exit(EXIT_FAILURE);
+        }
+        printEcho("Created directory '%s'.", input.destDir);
+    }
+
+    splitNames(options.src, &input.baseName, &input.extension);
+
+    srcFd = open(options.src, O_RDONLY | O_CLOEXEC);
+    if (srcFd == -1 || fstat(srcFd, &srcStat) == -1)
+    {
+        perror("open failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (srcStat.st_size > 0)
+    {
+        map = (char*)mmap(NULL, srcStat.st_size, PROT_READ, MAP_PRIVATE, srcFd, 0);
+        if (map == MAP_FAILED)
+        {
+            perror("mmap failed");
+            exit(EXIT_FAILURE);
+        }
+
+        input.data = map;
+        lastNewline = (const char*)memrchr(map, '\n', srcStat.st_size);
+        input.size = lastNewline != NULL ? (size_t)(lastNewline - map) + 1 : 0;
+    }
+
+    ranges = createRanges(&input, &options, &rangesCount);
+    runRanges(ranges, rangesCount, scanRangeMain);
+    gamesCount = numberRanges(ranges, rangesCount, input.size);
+
+    // whatever precedes the first game goes to a file numbered 0, trimmed only when no game follows
+    firstStart = ranges[0].nextStart;
+    if (ranges[0].games.count > 0) firstStart = ranges[0].games.starts[0];
+    if (gamesCount == 0 && input.size > 0)
+        writeGame(&input, 0, 0, input.size, true, &scratch);
+    else if (gamesCount > 0 && firstStart > 0)
+        writeGame(&input, 0, 0, firstStart, false, &scratch);
+
+    runRanges(ranges, rangesCount, writeRangeMain);
+
+    if (map != MAP_FAILED) munmap(map, srcStat.st_size);
+    close(srcFd);
+
+    for (int i = 0; i < rangesCount; i++)
+        free(ranges[i].games.starts);
+    free(ranges);
+    free(scratch.data);
+    free(input.baseName);
+    free(input.extension);
+
+    return 0;
+}
+
+// the script's [[ -n $3 || -z $2 ]]: a third argument only counts when it is not empty, later ones never
+boolean parseArguments(int argc, char** argv, SplitOptions* options)
+{
+    int positionalCount = 0;
+    long onlineCpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    options->src = NULL;
+    options->dest = NULL;
+    options->jobs = onlineCpus > 0 ? (int)onlineCpus : 1;
+    options->isJobsGiven = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--jobs") == 0 || strncmp(argv[i], "--jobs=", 7) == 0)
+        {
+            const char* value = argv[i][6] == '=' ? argv[i] + 7 : (i + 1 < argc ? argv[++i] : NULL);
+            char* end = NULL;
+
+            if (value == NULL) return false;
+            options->jobs = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || options->jobs < 1) return false;
+            options->isJobsGiven = true;
+            continue;
+        }
+
+        if (positionalCount == 0) options->src = argv[i];
+        else if (positionalCount == 1) options->dest = argv[i];
+        else if (positionalCount == 2 && argv[i][0] != '\0') return false;
+        positionalCount++;
+    }
+
+    return positionalCount >= 2 && options->dest[0] != '\0';
+}
+
+// ${name%.*} and ${name##*.} of the basename; a name without a dot is both
+void splitNames(const char* path, char** baseName, char** extension)
+{
+    const char* fileName = strrchr(path, '/');
+    const char* dot = NULL;
+
+    fileName = fileName != NULL ? fileName + 1 : path;
+    dot = strrchr(fileName, '.');
+
+    *baseName = dot != NULL ? strndup(fileName, dot - fileName) : strdup(fileName);
+    *extension = strdup(dot != NULL ? dot + 1 : fileName);
+    if (*baseName == NULL || *extension == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+boolean isFileExists(const char* path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+boolean isDirExists(const char* path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ * --jobs ranges of about equal size; without --jobs no range is made
+ * smaller than MIN_RANGE_SIZE, small files are not worth the threads.
+ */
+SplitRange* createRanges(const PgnInput* input, const SplitOptions* options, int* rangesCount)
+{
+    SplitRange* ranges = NULL;
+    int count = options->jobs;
+
+    if (!options->isJobsGiven && (size_t)count > input->size / MIN_RANGE_SIZE)
+        count = input->size / MIN_RANGE_SIZE;
+    if ((size_t)count > input->size) count = input->size;
+    if (count < 1) count = 1;
+
+    ranges = (SplitRange*)calloc(count, sizeof(SplitRange));
+    if (ranges == NULL)
+    {
+        perror("Calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        ranges[i].input = input;
+        ranges[i].begin = input->size * i / count;
+        ranges[i].end = input->size * (i + 1) / count;
+    }
+
+    *rangesCount = count;
+    return ranges;
+}
+
+// the calling thread takes the first range itself
+void runRanges(SplitRange* ranges, int rangesCount, void* (*rangeMain)(void*))
+{
+    pthread_t* threads = (pthread_t*)malloc(rangesCount * sizeof(pthread_t));
+
+    if (threads == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 1; i < rangesCount; i++)
+    {
+        if (pthread_create(&threads[i], NULL, rangeMain, &ranges[i]) != 0)
+        {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    rangeMain(&ranges[0]);
+
+    for (int i = 1; i < rangesCount; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+void* scanRangeMain(void* arg)
+{
+    SplitRange* range = (SplitRange*)arg;
+
+    findGameStarts(range->input, range->begin, range->end, &range->games);
+
+    return NULL;
+}
+
+void* writeRangeMain(void* arg)
+{
+    SplitRange* range = (SplitRange*)arg;
+    OutputBuffer scratch = { NULL, 0, 0 };
+
+    for (int i = range->firstGame; i < range->games.count; i++)
+    {
+        size_t end = i + 1 < range->games.count ? range->games.starts[i + 1] : range->nextStart;
+        writeGame(range->input, range->counterBase + i - range->firstGame, range->games.starts[i], end, true, &scratch);
+    }
+
+    free(scratch.data);
+
+    return NULL;
+}
+
+/*
+ * The prefix sum over the ranges' game counts, in file order. A line
+ * holding "[Event" on both sides of a range border was found by both
+ * ranges; the later one skips it. Returns the number of games.
+ */
+int numberRanges(SplitRange* ranges, int rangesCount, size_t size)
+{
+    boolean hasLastStart = false;
+    size_t lastStart = 0;
+    size_t nextStart = size;
+    int counter = 1;
+
+    for (int i = 0; i < rangesCount; i++)
+    {
+        SplitRange* range = &ranges[i];
+
+        range->firstGame = range->games.count > 0 && hasLastStart && range->games.starts[0] == lastStart ? 1 : 0;
+        range->counterBase = counter;
+        counter += range->games.count - range->firstGame;
+
+        if (range->games.count > 0)
+        {
+            lastStart = range->games.starts[range->games.count - 1];
+            hasLastStart = true;
+        }
+    }
+
+    for (int i = rangesCount - 1; i >= 0; i--)
+    {
+        SplitRange* range = &ranges[i];
+
+        range->nextStart = nextStart;
+        if (range->games.count > range->firstGame) nextStart = range->games.starts[range->firstGame];
+    }
+
+    return counter - 1;
+}
+
+/*
+ * The tag itself is rare enough that memmem (vectorized in glibc) can
+ * skip straight from one game to the next; only its hits are checked
+ * the way the script sees the line, and a line with the tag twice is a
+ * single start. A hit belongs to the range it starts in, so the search
+ * runs a tag length minus one past end.
+ */
+void findGameStarts(const PgnInput* input, size_t begin, size_t end, GameStarts* games)
+{
+    size_t position = begin;
+    size_t searchEnd = end + sizeof(EVENT_TAG) - 2 < input->size ? end + sizeof(EVENT_TAG) - 2 : input->size;
+    size_t lineStart = 0;
+    const char* hit = NULL;
+
+    while (position < end
+        && (hit = (const char*)memmem(input->data + position, searchEnd - position, EVENT_TAG, sizeof(EVENT_TAG) - 1)) != NULL)
+    {
+        position = hit - input->data;
+        if (position >= end) break;
+
+        if (isEventLine(input, position, &lineStart)
+            && (games->count == 0 || games->starts[games->count - 1] != lineStart))
+        {
+            addGameStart(games, lineStart);
+        }
+
+        position += sizeof(EVENT_TAG) - 1;
+    }
+}
+
+void addGameStart(GameStarts* games, size_t start)
+{
+    if (games->count == games->capacity)
+    {
+        games->capacity = games->capacity ? games->capacity * 2 : GAMES_INITIAL_CAPACITY;
+        games->starts = (size_t*)realloc(games->starts, games->capacity * sizeof(size_t));
+        if (games->starts == NULL)
+        {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    games->starts[games->count++] = start;
+}
+
+// grep "\[Event " on the echoed line, so "[Event" at the end of it or before a second blank does not count
+boolean isEventLine(const PgnInput* input, size_t position, size_t* lineStart)
+{
+    OutputBuffer line = { NULL, 0, 0 };
+    size_t lineEnd = 0;
+    boolean isEvent = false;
+
+    *lineStart = findLineStart(input, position);
+    if (!findLineEnd(input, position, &lineEnd)) return false;
+
+    appendNormalizedLines(&line, input->data, *lineStart, lineEnd);
+    isEvent = memmem(line.data, line.length, EVENT_LINE_TAG, sizeof(EVENT_LINE_TAG) - 1) != NULL;
+    free(line.data);
+
+    return isEvent;
+}
+
+// back to the start of the line read would return, across escaped newlines
+size_t findLineStart(const PgnInput* input, size_t position)
+{
+    const char* newline = NULL;
+
+    while (position > 0)
+    {
+        newline = (const char*)memrchr(input->data, '\n', position);
+        if (newline == NULL) return 0;
+
+        position = newline - input->data;
+        if (!isContinuation(input->data, position)) return position + 1;
+    }
+
+    return 0;
+}
+
+// just past the newline ending the line; false for a line the input ends in the middle of
+boolean findLineEnd(const PgnInput* input, size_t position, size_t* lineEnd)
+{
+    const char* newline = NULL;
+
+    while (position < input->size)
+    {
+        newline = (const char*)memchr(input->data + position, '\n', input->size - position);
+        if (newline == NULL) return false;
+
+        position = newline - input->data;
+        if (!isContinuation(input->data, position))
+        {
+            *lineEnd = position + 1;
+            return true;
+        }
+        position++;
+    }
+
+    return false;
+}
+
+// an odd run of backslashes before a newline escapes it
+boolean isContinuation(const char* data, size_t newline)
+{
+    size_t backslashes = 0;
+
+    while (backslashes < newline && data[newline - backslashes - 1] == '\\')
+        backslashes++;
+
+    return backslashes % 2 == 1;
+}
+
+// anything read and echo would change: escapes, tabs, NULs (dropped by read) and blanks echo would not print
+boolean needsNormalizing(const char* data, size_t start, size_t end)
+{
+    const char* from = data + start;
+    size_t length = end - start;
+
+    if (length == 0) return false;
+    if (*from == ' ') return true;
+
+    return memchr(from, '\\', length) != NULL
+        || memchr(from, '\t', length) != NULL
+        || memchr(from, '\0', length) != NULL
+        || memmem(from, length, "  ", 2) != NULL
+        || memmem(from, length, " \n", 2) != NULL
+        || memmem(from, length, "\n ", 2) != NULL;
+}
+
+/*
+ * Appends every complete line of [start, end) the way `read line` and
+ * `echo $line` pass it on: a backslash keeps the next byte (and drops a
+ * newline after it), then the words go out joined by single spaces.
+ */
+void appendNormalizedLines(OutputBuffer* output, const char* data, size_t start, size_t end)
+{
+    OutputBuffer line = { NULL, 0, 0 };
+
+    for (size_t i = start; i < end; i++)
+    {
+        if (data[i] == '\\' && i + 1 < end)
+        {
+            if (data[++i] != '\n') appendBytes(&line, data + i, 1);
+            continue;
+        }
+
+        if (data[i] == '\n')
+        {
+            appendWords(output, line.data, line.length);
+            appendBytes(output, "\n", 1);
+            line.length = 0;
+            continue;
+        }
+
+        if (data[i] != '\0') appendBytes(&line, data + i, 1);
+    }
+
+    free(line.data);
+}
+
+// the words of text (split on blanks, tabs and newlines) joined by single spaces
+void appendWords(OutputBuffer* output, const char* text, size_t length)
+{
+    boolean isFirst = true;
+    size_t wordStart = 0;
+
+    for (size_t i = 0; i <= length; i++)
+    {
+        boolean isBlank = i == length || text[i] == ' ' || text[i] == '\t' || text[i] == '\n';
+
+        if (!isBlank) continue;
+
+        if (i > wordStart)
+        {
+            if (!isFirst) appendBytes(output, " ", 1);
+            appendBytes(output, text + wordStart, i - wordStart);
+            isFirst = false;
+        }
+        wordStart = i + 1;
+    }
+}
+
+/*
+ * One game, appended to its file (the script never truncates) with a
+ * single write. trimBlankLine is the script's sed '${/^$/d;}': an empty
+ * last line is dropped, one at most.
+ */
+void writeGame(const PgnInput* input, int counter, size_t start, size_t end, boolean trimBlankLine, OutputBuffer* scratch)
+{
+    char path[MAX_PATH];
+    const char* data = input->data + start;
+    size_t length = end - start;
+    int fd = -1;
+
+    // most games need no rewriting at all and go out straight from the map
+    if (needsNormalizing(input->data, start, end))
+    {
+        scratch->length = 0;
+        appendNormalizedLines(scratch, input->data, start, end);
+        data = scratch->data;
+        length = scratch->length;
+    }
+
+    if (trimBlankLine && (length == 1 || (length >= 2 && data[length - 2] == '\n')) && data[length - 1] == '\n')
+        length--;
+
+    if (snprintf(path, MAX_PATH, "%s/%s_%d.%s", input->destDir, input->baseName, counter, input->extension) >= MAX_PATH)
+    {
+        fprintf(stderr, "Error: path too long for game %d\n", counter);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd == -1 || !writeFull(fd, data, length))
+    {
+        perror("write failed");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+// the script's messages go through an unquoted echo as well
+void printEcho(const char* format, ...)
+{
+    OutputBuffer message = { NULL, 0, 0 };
+    char* text = NULL;
+    va_list args;
+    int length = 0;
+
+    va_start(args, format);
+    length = vasprintf(&text, format, args);
+    va_end(args);
+    if (length == -1)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    appendWords(&message, text, length);
+    appendBytes(&message, "\n", 1);
+    fwrite(message.data, 1, message.length, stdout);
+
+    free(message.data);
+    free(text);
+}
+
+void appendBytes(OutputBuffer* output, const char* data, size_t length)
+{
+    if (output->length + length > output->capacity)
+    {
+        size_t capacity = output->capacity ? output->capacity : OUTPUT_BUFFER_INITIAL_SIZE;
+
+        while (capacity < output->length + length) capacity *= 2;
+        output->data = (char*)realloc(output->data, capacity);
+        if (output->data == NULL)
+        {
+            perror("Realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        output->capacity = capacity;
+    }
+
+    memcpy(output->data + output->length, data, length);
+    output->length += length;
+}
+
+boolean writeFull(int fd, const char* buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, buffer, size);
+
+        if (written == -1)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buffer += written;
+        size -= written;
+    }
+
+    return true;
+}
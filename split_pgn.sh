@@ -1,5 +1,12 @@
 #!/bin/bash
 
+# the compiled splitter (make split_pgn) writes the same files without a process per line
+SPLITTER="$(dirname "$0")/split_pgn"
+if [[ -x $SPLITTER ]]
+then
+    exec -a "$0" "$SPLITTER" "$@"
+fi
+
 SRC=$1
 DEST=$2
 
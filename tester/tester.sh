@@ -295,14 +295,133 @@ run_part_2_special_tests() {
     echo -e "${CYAN}========================================${NC}\n\n"
 }
 
+run_part_3_tests() {
+    echo -e "${CYAN}========================================${NC}"
+    echo -e "${CYAN}          Beginning Tests for Part 3          ${NC}"
+    echo -e "${CYAN}========================================${NC}"
+
+    # byte for byte what the old read/echo loop of split_pgn.sh wrote, for several range counts
+    if [[ ! -x "../split_pgn" ]]; then
+        echo -e "${RED}No compiled splitter found (make split_pgn)!${NC}"
+        return
+    fi
+
+    for TEST in $PART_3_TESTS; do
+        INPUT=$(echo "$TEST" | jq -r '.input')
+        EXPECTED_CHECKSUMS=$(echo "$TEST" | jq -r '.expected_checksums')
+
+        echo -e "${YELLOW}----------------------------------------${NC}"
+        echo -e "${YELLOW}Running test with input: ${BLUE}$INPUT${NC}"
+        echo -e "${YELLOW}----------------------------------------${NC}"
+
+        for JOBS in 1 3 64; do
+            TEMP_DIR=$(mktemp -d)
+
+            echo -e "${BLUE}Running the splitter with --jobs $JOBS...${NC}"
+            ../split_pgn --jobs "$JOBS" "$INPUT" "$TEMP_DIR/output" > /dev/null
+
+            if (cd "$TEMP_DIR/output" && sha256sum --quiet -c "$CURRENT_DIR/$EXPECTED_CHECKSUMS") > "$TEMP_DIR/check.txt" 2>&1 \
+                && [[ $(ls "$TEMP_DIR/output" | wc -l) -eq $(wc -l < "$EXPECTED_CHECKSUMS") ]]; then
+                echo -e "${GREEN}All files match the old script's output byte for byte.${NC}"
+            else
+                echo -e "${RED}Split test for $INPUT with --jobs $JOBS failed.${NC}"
+                FAIL_DIR="fails/test_split_$(basename "$INPUT" .pgn)_jobs_$JOBS"
+                mkdir -p "$FAIL_DIR"
+                cp "$TEMP_DIR/check.txt" "$FAIL_DIR/check.txt"
+                ls "$TEMP_DIR/output" > "$FAIL_DIR/files.txt"
+            fi
+
+            rm -r "$TEMP_DIR"
+        done
+
+        echo -e "${YELLOW}----------------------------------------${NC}"
+    done
+
+    echo -e "${CYAN}========================================${NC}"
+    echo -e "${CYAN}         Tests for Part 3 completed         ${NC}"
+    echo -e "${CYAN}========================================${NC}\n\n"
+}
+
+run_part_4_tests() {
+    echo -e "${CYAN}========================================${NC}"
+    echo -e "${CYAN}          Beginning Tests for Part 4          ${NC}"
+    echo -e "${CYAN}========================================${NC}"
+
+    if [[ ! -x "../parse_moves" ]]; then
+        echo -e "${RED}No compiled move parser found (make parse_moves)!${NC}"
+        return
+    fi
+
+    # the expected moves are what parse_moves.py prints, checked against it again wherever python-chess is installed
+    CHECK_PYTHON=0
+    if python3 -c "import chess.pgn" 2> /dev/null; then
+        CHECK_PYTHON=1
+    fi
+
+    for TEST in $PART_4_TESTS; do
+        INPUT_DIRECTORY=$(echo "$TEST" | jq -r '.input_directory')
+        EXPECTED_MOVES=$(echo "$TEST" | jq -r '.expected_moves')
+
+        echo -e "${YELLOW}----------------------------------------${NC}"
+        echo -e "${YELLOW}Running test with input: ${BLUE}$INPUT_DIRECTORY${NC}"
+        echo -e "${YELLOW}----------------------------------------${NC}"
+
+        TEMP_DIR=$(mktemp -d)
+
+        echo -e "${BLUE}Running the move parser on every game...${NC}"
+        while IFS=$'\t' read -r GAME _; do
+            printf '%s\t%s\n' "$GAME" "$(../parse_moves - < "$INPUT_DIRECTORY/$GAME" 2> /dev/null)" >> "$TEMP_DIR/student_moves.uci"
+            if [[ $CHECK_PYTHON -eq 1 ]]; then
+                printf '%s\t%s\n' "$GAME" "$(python3 parse_moves.py "$(< "$INPUT_DIRECTORY/$GAME")" 2> /dev/null)" >> "$TEMP_DIR/python_moves.uci"
+            fi
+        done < "$EXPECTED_MOVES"
+
+        NAME=$(basename "$INPUT_DIRECTORY")
+        if diff -u "$EXPECTED_MOVES" "$TEMP_DIR/student_moves.uci" > "$TEMP_DIR/diff.txt"; then
+            echo -e "${GREEN}All moves match the expected output.${NC}"
+        else
+            echo -e "${RED}Move test for $NAME failed.${NC}"
+            FAIL_DIR="fails/test_moves_$NAME"
+            mkdir -p "$FAIL_DIR"
+            cp "$TEMP_DIR/diff.txt" "$FAIL_DIR/diff.txt"
+        fi
+
+        if [[ $CHECK_PYTHON -eq 1 ]]; then
+            if diff -u "$EXPECTED_MOVES" "$TEMP_DIR/python_moves.uci" > "$TEMP_DIR/python_diff.txt"; then
+                echo -e "${GREEN}parse_moves.py agrees with the expected output.${NC}"
+            else
+                echo -e "${RED}parse_moves.py disagrees with the expected moves for $NAME.${NC}"
+                FAIL_DIR="fails/test_moves_$NAME"
+                mkdir -p "$FAIL_DIR"
+                cp "$TEMP_DIR/python_diff.txt" "$FAIL_DIR/python_diff.txt"
+            fi
+        fi
+
+        echo -e "${BLUE}Cleaning up...${NC}"
+        rm -r "$TEMP_DIR"
+
+        echo -e "${YELLOW}----------------------------------------${NC}"
+    done
+
+    echo -e "${CYAN}========================================${NC}"
+    echo -e "${CYAN}         Tests for Part 4 completed         ${NC}"
+    echo -e "${CYAN}========================================${NC}\n\n"
+}
+
 CURRENT_DIR=$(pwd)
 
 PART_1_TESTS=$(jq -c '.part_1[]' "$CONFIG_FILE")
 PART_2_TESTS=$(jq -c '.part_2[]' "$CONFIG_FILE")
 PART_2_SPECIAL_TESTS=$(jq -c '.part_2_special[]' "$CONFIG_FILE")
+PART_3_TESTS=$(jq -c '.part_3[]' "$CONFIG_FILE")
+PART_4_TESTS=$(jq -c '.part_4[]' "$CONFIG_FILE")
 
 run_part_1_tests
 
 run_part_2_tests
 
 run_part_2_special_tests
+
+run_part_3_tests
+
+run_part_4_tests